@@ -0,0 +1,289 @@
+#!/usr/bin/env python2
+"""
+End-to-end benchmark of 4grep against zgrep on a synthetic log corpus.
+
+Generates a corpus of log files, the same for the same seed, then times
+these scenarios, each repeated and reported by its median run:
+
+	zgrep/warm-cache           zgrep over the corpus, files in the page cache
+	zgrep/cold-cache           the same, with the corpus evicted first
+	4grep/cold-index           4grep with an empty index, building it
+	4grep/warm-index           4grep with the index built by a previous run
+	4grep/warm-index-cold-cache
+	                           the same, with the corpus and index evicted
+
+For each it reports the wall time, the CPU time of all the processes it
+ran, the bytes they read through syscalls and from storage, and for 4grep
+the percentage of files filtered out by their bitmaps.
+
+The page cache is emptied by fadvise(POSIX_FADV_DONTNEED) on every file,
+which needs no privileges but only drops pages nothing else has mapped or
+dirtied; run as root to also write /proc/sys/vm/drop_caches.
+
+Usage:
+	python bench.py [--files N] [--size BYTES] [--gzip FRACTION]
+	                [--rarity FRACTION] [--repeat N] [--cores N] [--json]
+"""
+from __future__ import print_function
+import multiprocessing as mp
+import subprocess
+import resource
+import argparse
+import tempfile
+import ctypes as ct
+import random
+import shutil
+import json
+import gzip
+import time
+import sys
+import os
+import re
+
+BENCH_DIR = os.path.dirname(os.path.realpath(__file__))
+
+# the needle some of the files contain, and the pattern that finds it
+NEEDLE = 'replication stalled: lease 4d1f3c lost to peer'
+PATTERN = 'lease 4d1f3c lost'
+
+POSIX_FADV_DONTNEED = 4
+
+LEVELS = ['INFO', 'INFO', 'INFO', 'DEBUG', 'WARNING', 'ERROR']
+MODULES = ['scheduler', 'io_path', 'replication', 'gc', 'nfs', 'metadata',
+		'api']
+EVENTS = ['request completed', 'request queued', 'cache miss for volume',
+		'retrying after timeout', 'snapshot created', 'lease renewed',
+		'STACK trace follows', 'checkpoint written',
+		'connection reset by peer']
+
+ANSI_ESCAPE = re.compile(r'\x1b\[[0-9;]*[A-Za-z]')
+
+def parse_size(text):
+	""" Parses sizes like 4096, 64K or 10M into bytes. """
+	units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+	if text[-1:].upper() in units:
+		return int(float(text[:-1]) * units[text[-1].upper()])
+	return int(text)
+
+def generate_lines(rng, count):
+	usec = rng.randrange(10 ** 12)
+	lines = []
+	for _ in range(count):
+		usec += rng.randrange(5000)
+		secs = usec // 10 ** 6
+		lines.append('2017-08-{:02d} {:02d}:{:02d}:{:02d}.{:06d} {} [{}/{}] {} '
+				'id={:016x} latency_us={}\n'.format(
+				1 + secs // 86400 % 28, secs // 3600 % 24, secs // 60 % 60,
+				secs % 60, usec % 10 ** 6, rng.choice(LEVELS),
+				rng.choice(MODULES), rng.randrange(64), rng.choice(EVENTS),
+				rng.getrandbits(64), rng.randrange(100000)))
+	return lines
+
+def generate_corpus(corpus_dir, num_files, mean_size, gzip_fraction, rarity,
+                    seed):
+	"""
+	Writes num_files log files of mean_size bytes on average into
+	corpus_dir, a gzip_fraction of them gzipped and a rarity fraction of
+	them containing NEEDLE. Returns the list of their paths.
+	"""
+	rng = random.Random(seed)
+	# a pool of lines to draw from, since formatting each line of a large
+	# corpus in python is slow
+	pool = generate_lines(rng, 50000)
+	paths = []
+	for i in range(num_files):
+		size = rng.randrange(mean_size // 2, mean_size * 3 // 2 + 1)
+		start = rng.randrange(len(pool))
+		lines = []
+		length = 0
+		while length < size:
+			line = pool[(start + len(lines)) % len(pool)]
+			lines.append(line)
+			length += len(line)
+		if rng.random() < rarity:
+			lines.insert(rng.randrange(len(lines)), NEEDLE + '\n')
+		subdir = os.path.join(corpus_dir, 'host{:02d}'.format(i % 16))
+		if not os.path.isdir(subdir):
+			os.makedirs(subdir)
+		path = os.path.join(subdir, 'messages.{}'.format(i))
+		if rng.random() < gzip_fraction:
+			path += '.gz'
+			f = gzip.open(path, 'wb')
+		else:
+			f = open(path, 'wb')
+		f.write(''.join(lines))
+		f.close()
+		paths.append(path)
+	return paths
+
+def evict_from_page_cache(dirs):
+	""" Drops the pages of every file under dirs from the page cache. """
+	libc = ct.CDLL(None, use_errno=True)
+	libc.posix_fadvise.argtypes = [ct.c_int, ct.c_long, ct.c_long, ct.c_int]
+	for d in dirs:
+		for root, _, files in os.walk(d):
+			for name in files:
+				try:
+					fd = os.open(os.path.join(root, name), os.O_RDONLY)
+				except OSError:
+					continue
+				libc.posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)
+				os.close(fd)
+	if os.geteuid() == 0:
+		subprocess.call('sync')
+		with open('/proc/sys/vm/drop_caches', 'w') as f:
+			f.write('3\n')
+
+def read_io():
+	"""
+	Returns the io counters of this process, which include those of the
+	children it has waited for.
+	"""
+	io = {}
+	with open('/proc/self/io') as f:
+		for line in f:
+			key, value = line.split(':')
+			io[key] = int(value)
+	return io
+
+def timed_run(command, stdin_data):
+	"""
+	Runs command with stdin_data on its stdin and returns its measurements
+	and stderr.
+	"""
+	io_before = read_io()
+	usage_before = resource.getrusage(resource.RUSAGE_CHILDREN)
+	start = time.time()
+	p = subprocess.Popen(command, stdin=subprocess.PIPE,
+			stdout=open(os.devnull, 'w'), stderr=subprocess.PIPE)
+	_, err = p.communicate(stdin_data)
+	wall = time.time() - start
+	usage_after = resource.getrusage(resource.RUSAGE_CHILDREN)
+	io_after = read_io()
+	# grep exits with 1 when nothing matches
+	if p.returncode not in (0, 1):
+		raise RuntimeError('{} failed with {}: {}'.format(command[0],
+				p.returncode, err))
+	return {
+		'wall_sec': wall,
+		'cpu_sec': (usage_after.ru_utime - usage_before.ru_utime
+				+ usage_after.ru_stime - usage_before.ru_stime),
+		'syscall_read_bytes': io_after['rchar'] - io_before['rchar'],
+		'storage_read_bytes': (io_after['read_bytes']
+				- io_before['read_bytes']),
+	}, err
+
+def filtered_percent(err):
+	""" Returns the Filtered percentage of 4grep's final progress line. """
+	for line in reversed(ANSI_ESCAPE.sub('', err).split('\n')):
+		match = re.search(r'Finished:.*Filtered:\s*([0-9.]+)%', line)
+		if match:
+			return float(match.group(1))
+	return None
+
+def median_run(runs):
+	""" Returns the run of median wall time. """
+	return sorted(runs, key=lambda r: r['wall_sec'])[len(runs) // 2]
+
+def run_scenarios(args, paths, corpus_dir, work_dir):
+	file_list = '\0'.join(paths)
+	zgrep = ['xargs', '-0', '-n', '64', '-P', str(args.cores), 'zgrep', '-H',
+			'-e', PATTERN]
+	index_dir = os.path.join(work_dir, 'index')
+	fourgrep = [sys.executable, args.fourgrep, PATTERN, '--indexdir',
+			index_dir, '--cores', str(args.cores)]
+
+	def reset_index():
+		shutil.rmtree(index_dir, ignore_errors=True)
+		os.makedirs(index_dir)
+
+	# in order: the warm-index runs use the index the cold-index runs built
+	scenarios = [
+		('zgrep/warm-cache', zgrep, None),
+		('zgrep/cold-cache', zgrep,
+			lambda: evict_from_page_cache([corpus_dir])),
+		('4grep/cold-index', fourgrep, reset_index),
+		('4grep/warm-index', fourgrep, None),
+		('4grep/warm-index-cold-cache', fourgrep,
+			lambda: evict_from_page_cache([corpus_dir, index_dir])),
+	]
+	results = []
+	for name, command, setup in scenarios:
+		runs = []
+		for _ in range(args.repeat):
+			if setup:
+				setup()
+			if command is zgrep:
+				stdin_data = file_list
+			else:
+				stdin_data = '\n'.join(paths) + '\n'
+			run, err = timed_run(command, stdin_data)
+			if command is fourgrep:
+				run['filtered_percent'] = filtered_percent(err)
+			runs.append(run)
+		result = median_run(runs)
+		result['scenario'] = name
+		results.append(result)
+		print_result(result, args.json)
+	return results
+
+def print_result(result, as_json):
+	if as_json:
+		print(json.dumps(result, sort_keys=True))
+	else:
+		filtered = result.get('filtered_percent')
+		print('{:<30} {:>8.2f}s wall {:>8.2f}s cpu {:>10.1f}MB read '
+				'{:>10.1f}MB from storage {:>9}'.format(
+				result['scenario'], result['wall_sec'], result['cpu_sec'],
+				result['syscall_read_bytes'] / 1e6,
+				result['storage_read_bytes'] / 1e6,
+				'' if filtered is None else
+				'{:.1f}% filtered'.format(filtered)))
+	sys.stdout.flush()
+
+def main():
+	parser = argparse.ArgumentParser(
+			description='Benchmarks 4grep against zgrep on a synthetic corpus.')
+	parser.add_argument('--files', type=int, default=200,
+			help='number of log files (default 200)')
+	parser.add_argument('--size', type=parse_size, default=parse_size('1M'),
+			help='mean uncompressed size of a file, e.g. 64K or 10M '
+			'(default 1M)')
+	parser.add_argument('--gzip', type=float, default=0.5,
+			help='fraction of the files gzipped (default 0.5)')
+	parser.add_argument('--rarity', type=float, default=0.02,
+			help='fraction of the files containing the pattern '
+			'(default 0.02)')
+	parser.add_argument('--seed', type=int, default=1)
+	parser.add_argument('--repeat', type=int, default=3,
+			help='runs of each scenario, of which the median is reported')
+	parser.add_argument('--cores', type=int, default=mp.cpu_count(),
+			help='processes for both 4grep and zgrep')
+	parser.add_argument('--workdir', type=str,
+			help='directory for the corpus and index, kept afterwards '
+			'(default: a temporary directory, removed afterwards)')
+	parser.add_argument('--4grep', dest='fourgrep', type=str,
+			default=os.path.join(BENCH_DIR, '4grep'))
+	parser.add_argument('--json', action='store_true',
+			help='print one JSON object per scenario')
+	args = parser.parse_args()
+	if args.files <= 0 or args.size <= 0 or args.repeat <= 0:
+		parser.error('--files, --size and --repeat must be positive')
+
+	work_dir = args.workdir or tempfile.mkdtemp(prefix='4grep_bench.')
+	try:
+		corpus_dir = os.path.join(work_dir, 'corpus')
+		shutil.rmtree(corpus_dir, ignore_errors=True)
+		start = time.time()
+		paths = generate_corpus(corpus_dir, args.files, args.size, args.gzip,
+				args.rarity, args.seed)
+		print('generated {} files of {:.1f}MB on average in {:.1f}s'.format(
+				args.files, args.size / 1e6, time.time() - start),
+				file=sys.stderr)
+		run_scenarios(args, paths, corpus_dir, work_dir)
+	finally:
+		if not args.workdir:
+			shutil.rmtree(work_dir, ignore_errors=True)
+
+if __name__ == '__main__':
+	main()
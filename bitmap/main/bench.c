@@ -0,0 +1,650 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "../src/bitmap.h"
+#include "../src/filter.h"
+#include "../src/packfile.h"
+#include "../src/bloom.h"
+#include "../src/util.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * Microbenchmarks of the hot paths of the library, on synthetic data that is
+ * the same from run to run:
+ *
+ *   apply_to_bitmap/<kernel>       bytes of log turned into ngram bits
+ *   get_4gram_indices              search strings split into ngrams
+ *   compress_to_fp                 bitmaps compressed into records
+ *   decompress_file                loose files read back into bitmaps
+ *   index_lookup/<search>/<size>/<hits|misses>
+ *                                  packfile index lookups, comparing
+ *                                  find_hash_in_index (interpolation) with
+ *                                  bisection, an eytzinger layout and the
+ *                                  bloom filter alone
+ *   should_filter_out_file         bitmaps checked against a filter
+ *   pack_loose_files_in_subdir     an index subdirectory of loose files packed
+ *
+ * Each benchmark runs a number of timed iterations and prints one JSON object
+ * per line to stdout, with the time per iteration and per operation:
+ *
+ *   {"benchmark": "...", "unit": "byte", "ops_per_iteration": N,
+ *    "iterations": N, "min_ns": N, "median_ns": N, "mean_ns": N,
+ *    "ns_per_op": X}
+ *
+ * ns_per_op is derived from the median. Compare the output of two builds to
+ * spot regressions.
+ *
+ * Usage: bench [-i iterations] [-l loose_files] [name_substring...]
+ */
+
+#define DEFAULT_ITERATIONS 10
+#define MAX_ITERATIONS 1000
+
+#define LOG_BYTES (16 * 1024 * 1024)
+#define NUM_SEARCH_STRINGS 4096
+#define NUM_COMPRESSIONS 64
+#define NUM_FILTER_CHECKS 4096
+#define NUM_LOOKUPS (1024 * 1024)
+#define DEFAULT_LOOSE_FILES 10000
+
+/*--------------------------------------------------------------------*/
+
+struct benchmark {
+  char *name;
+  char *unit;
+  size_t ops_per_iteration;
+  // untimed, before each iteration; may be NULL
+  int (*setup)(void *arg);
+  int (*run)(void *arg);
+  void *arg;
+};
+
+static int iterations = DEFAULT_ITERATIONS;
+static char **name_filters = NULL;
+static int num_name_filters = 0;
+
+/*--------------------------------------------------------------------*/
+
+static uint64_t random_hash(uint64_t *state) {
+  // splitmix64, to get hashes as uniform as xxhash ones
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/*--------------------------------------------------------------------*/
+
+static uint64_t now_nsec() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Fills buf with size bytes of log lines, the same for the same seed.
+ */
+static void generate_log(char *buf, size_t size, uint64_t seed) {
+  static char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARNING", "ERROR"};
+  static char *modules[] = {"scheduler", "io_path", "replication", "gc",
+                            "nfs", "metadata", "api"};
+  static char *events[] = {
+    "request completed", "request queued", "cache miss for volume",
+    "retrying after timeout", "snapshot created", "lease renewed",
+    "STACK trace follows", "checkpoint written", "connection reset by peer"
+  };
+  uint64_t state = seed;
+  uint64_t usec = 0;
+  size_t len = 0;
+  while (len < size) {
+    uint64_t r = random_hash(&state);
+    usec += r % 5000;
+    char line[256];
+    int n = snprintf(line, sizeof(line),
+        "2017-08-%02d %02d:%02d:%02d.%06d %s [%s/%d] %s id=%016llx "
+        "latency_us=%d\n",
+        (int) (1 + usec / 86400000000 % 28), (int) (usec / 3600000000 % 24),
+        (int) (usec / 60000000 % 60), (int) (usec / 1000000 % 60),
+        (int) (usec % 1000000), levels[r % 6], modules[(r >> 8) % 7],
+        (int) ((r >> 16) % 64), events[(r >> 24) % 9],
+        (unsigned long long) random_hash(&state), (int) ((r >> 32) % 100000));
+    size_t copy = (size_t) n < size - len ? (size_t) n : size - len;
+    memcpy(buf + len, line, copy);
+    len += copy;
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+static int compare_uint64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/*--------------------------------------------------------------------*/
+
+static int is_selected(char *name) {
+  if (num_name_filters == 0) {
+    return 1;
+  }
+  for (int i = 0; i < num_name_filters; i++) {
+    if (strstr(name, name_filters[i]) != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Runs the iterations of b and prints its results.
+ * Returns 0 on success, -1 if an iteration failed.
+ */
+static int run_benchmark(struct benchmark *b) {
+  uint64_t times[MAX_ITERATIONS];
+  uint64_t total = 0;
+  for (int i = 0; i < iterations; i++) {
+    if (b->setup != NULL && b->setup(b->arg) == -1) {
+      fprintf(stderr, "Error: setup of %s failed\n", b->name);
+      return -1;
+    }
+    uint64_t start = now_nsec();
+    if (b->run(b->arg) == -1) {
+      fprintf(stderr, "Error: %s failed\n", b->name);
+      return -1;
+    }
+    times[i] = now_nsec() - start;
+    total += times[i];
+  }
+  qsort(times, iterations, sizeof(uint64_t), compare_uint64);
+  uint64_t median = times[iterations / 2];
+  printf("{\"benchmark\": \"%s\", \"unit\": \"%s\", \"ops_per_iteration\": %zu, "
+         "\"iterations\": %d, \"min_ns\": %llu, \"median_ns\": %llu, "
+         "\"mean_ns\": %llu, \"ns_per_op\": %.3f}\n",
+         b->name, b->unit, b->ops_per_iteration, iterations,
+         (unsigned long long) times[0], (unsigned long long) median,
+         (unsigned long long) (total / iterations),
+         (double) median / b->ops_per_iteration);
+  fflush(stdout);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+struct apply_args {
+  char *log;
+  uint8_t *bitmap;
+  int (*kernel)(uint8_t *bitmap, char *buf, int len, int n);
+};
+
+static int run_apply(void *arg) {
+  struct apply_args *a = arg;
+  int n = 0;
+  // in the chunks apply_file_to_bitmap reads
+  for (size_t offset = 0; offset < LOG_BYTES; offset += BUFSIZE) {
+    n = a->kernel(a->bitmap, a->log + offset, BUFSIZE, n);
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+struct string_args {
+  char **strings;
+  int num_strings;
+};
+
+static int run_get_4gram_indices(void *arg) {
+  struct string_args *a = arg;
+  for (int i = 0; i < a->num_strings; i++) {
+    int *indices = get_4gram_indices(a->strings[i]);
+    if (indices == NULL) {
+      return -1;
+    }
+    free(indices);
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+struct compress_args {
+  uint8_t *bitmap;
+  FILE *out;
+  char *loose_path;
+};
+
+static int run_compress_to_fp(void *arg) {
+  struct compress_args *a = arg;
+  for (int i = 0; i < NUM_COMPRESSIONS; i++) {
+    if (compress_to_fp(a->bitmap, a->out, "/var/log/bench.log", 0, NULL)) {
+      return -1;
+    }
+  }
+  return fflush(a->out) == 0 ? 0 : -1;
+}
+
+static int run_decompress_file(void *arg) {
+  struct compress_args *a = arg;
+  for (int i = 0; i < NUM_COMPRESSIONS; i++) {
+    if (decompress_file(a->bitmap, a->loose_path)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+struct lookup_args {
+  struct index_entry *index;
+  struct index_entry *eytzinger;
+  uint8_t *filter;
+  uint64_t num_blocks;
+  size_t num_entries;
+  uint64_t *queries;
+  size_t found;
+};
+
+static size_t binary_search(struct index_entry *index, size_t num_entries,
+    uint64_t hash) {
+  size_t left = 0;
+  size_t right = num_entries - 1;
+  while (left != right) {
+    size_t middle = (right + left) / 2;
+    if (index[middle].hash < hash) {
+      left = middle + 1;
+    } else {
+      right = middle;
+    }
+  }
+  return index[left].hash == hash ? left : -1;
+}
+
+/**
+ * Fills eytzinger[1..num_entries] with the sorted index in BFS order.
+ */
+static size_t build_eytzinger(struct index_entry *sorted,
+    struct index_entry *eytzinger, size_t num_entries, size_t i, size_t k) {
+  if (k <= num_entries) {
+    i = build_eytzinger(sorted, eytzinger, num_entries, i, 2 * k);
+    eytzinger[k] = sorted[i++];
+    i = build_eytzinger(sorted, eytzinger, num_entries, i, 2 * k + 1);
+  }
+  return i;
+}
+
+static size_t eytzinger_search(struct index_entry *eytzinger,
+    size_t num_entries, uint64_t hash) {
+  size_t k = 1;
+  while (k <= num_entries) {
+    // the descendants four levels down share one or two cache lines
+    __builtin_prefetch(eytzinger + 16 * k);
+    k = 2 * k + (eytzinger[k].hash < hash);
+  }
+  k >>= __builtin_ffsll(~k);
+  return k != 0 && eytzinger[k].hash == hash ? k : -1;
+}
+
+static int run_interpolation(void *arg) {
+  struct lookup_args *a = arg;
+  for (size_t i = 0; i < NUM_LOOKUPS; i++) {
+    a->found += find_hash_in_index(a->index, a->num_entries,
+                                   a->queries[i]) != -1;
+  }
+  return 0;
+}
+
+static int run_binary(void *arg) {
+  struct lookup_args *a = arg;
+  for (size_t i = 0; i < NUM_LOOKUPS; i++) {
+    a->found += binary_search(a->index, a->num_entries, a->queries[i]) != -1;
+  }
+  return 0;
+}
+
+static int run_eytzinger(void *arg) {
+  struct lookup_args *a = arg;
+  for (size_t i = 0; i < NUM_LOOKUPS; i++) {
+    a->found += eytzinger_search(a->eytzinger, a->num_entries,
+                                 a->queries[i]) != -1;
+  }
+  return 0;
+}
+
+static int run_bloom(void *arg) {
+  struct lookup_args *a = arg;
+  for (size_t i = 0; i < NUM_LOOKUPS; i++) {
+    a->found += bloom_may_contain(a->filter, a->num_blocks, a->queries[i]);
+  }
+  return 0;
+}
+
+/**
+ * Runs the lookup benchmarks on an index of num_entries random hashes.
+ */
+static int bench_index_lookups(size_t num_entries, char *size_name) {
+  static struct {
+    char *name;
+    int (*run)(void *arg);
+  } searches[] = {
+    {"interpolation", run_interpolation},
+    {"binary", run_binary},
+    {"eytzinger", run_eytzinger},
+    {"bloom", run_bloom},
+  };
+  int num_searches = sizeof(searches) / sizeof(searches[0]);
+  char names[2][num_searches][64];
+  int any_selected = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < num_searches; i++) {
+      snprintf(names[pass][i], sizeof(names[pass][i]), "index_lookup/%s/%s/%s",
+               searches[i].name, size_name, pass == 0 ? "hits" : "misses");
+      any_selected |= is_selected(names[pass][i]);
+    }
+  }
+  if (!any_selected) {
+    return 0;
+  }
+
+  int ret_val = -1;
+  struct lookup_args a = {0};
+  uint64_t *hits = NULL;
+  uint64_t *misses = NULL;
+  a.num_entries = num_entries;
+  a.num_blocks = bloom_num_blocks(num_entries);
+  a.index = malloc(num_entries * sizeof(struct index_entry));
+  a.eytzinger = malloc((num_entries + 1) * sizeof(struct index_entry));
+  a.filter = calloc(a.num_blocks, BLOOM_BLOCK_BYTES);
+  hits = malloc(NUM_LOOKUPS * sizeof(uint64_t));
+  misses = malloc(NUM_LOOKUPS * sizeof(uint64_t));
+  if (!a.index || !a.eytzinger || !a.filter || !hits || !misses) {
+    perror("Error: Memory not allocated");
+    goto OUT;
+  }
+
+  uint64_t state = num_entries;
+  for (size_t i = 0; i < num_entries; i++) {
+    a.index[i].hash = random_hash(&state);
+    a.index[i].packfile_offset = i;
+    bloom_add(a.filter, a.num_blocks, a.index[i].hash);
+  }
+  qsort(a.index, num_entries, sizeof(struct index_entry),
+        compare_index_entries);
+  build_eytzinger(a.index, a.eytzinger, num_entries, 0, 1);
+  for (size_t i = 0; i < NUM_LOOKUPS; i++) {
+    hits[i] = a.index[random_hash(&state) % num_entries].hash;
+    misses[i] = random_hash(&state);
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    a.queries = pass == 0 ? hits : misses;
+    for (int i = 0; i < num_searches; i++) {
+      struct benchmark b = {names[pass][i], "lookup", NUM_LOOKUPS, NULL,
+                            searches[i].run, &a};
+      if (is_selected(b.name) && run_benchmark(&b)) {
+        goto OUT;
+      }
+    }
+  }
+  ret_val = 0;
+
+OUT:
+  free(a.index);
+  free(a.eytzinger);
+  free(a.filter);
+  free(hits);
+  free(misses);
+  return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+struct should_filter_args {
+  uint8_t *bitmap;
+  struct intarrayarray filter;
+  size_t filtered;
+};
+
+static int run_should_filter_out_file(void *arg) {
+  struct should_filter_args *a = arg;
+  for (int i = 0; i < NUM_FILTER_CHECKS; i++) {
+    a->filtered += should_filter_out_file(a->bitmap, a->filter);
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+struct pack_args {
+  char *subdir;
+  uint8_t *bitmap;
+  int num_loose_files;
+};
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+    struct FTW *ftw) {
+  return remove(path);
+}
+
+static int setup_pack(void *arg) {
+  struct pack_args *a = arg;
+  if (nftw(a->subdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS) == -1
+      && errno != ENOENT) {
+    perrorf("Error removing %s", a->subdir);
+    return -1;
+  }
+  if (mkdir(a->subdir, 0755) == -1) {
+    perrorf("Error creating %s", a->subdir);
+    return -1;
+  }
+  for (int i = 0; i < a->num_loose_files; i++) {
+    char filename[64];
+    snprintf(filename, sizeof(filename), "/var/log/bench/%d.log", i);
+    // distinct bitmaps, so that the packfile does not compress away
+    set_bit(a->bitmap, i * 7919 % POSSIBLE_NGRAMS);
+    if (compress_to_file(a->bitmap, filename, i, a->subdir)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int run_pack(void *arg) {
+  struct pack_args *a = arg;
+  return pack_loose_files_in_subdir(a->subdir) == -1 ? -1 : 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+int main(int argc, char **argv) {
+  int num_loose_files = DEFAULT_LOOSE_FILES;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:l:")) != -1) {
+    switch (opt) {
+    case 'i':
+      iterations = atoi(optarg);
+      break;
+    case 'l':
+      num_loose_files = atoi(optarg);
+      break;
+    default:
+      iterations = 0;
+    }
+  }
+  if (iterations <= 0 || iterations > MAX_ITERATIONS || num_loose_files <= 0) {
+    fprintf(stderr, "Usage: %s [-i iterations] [-l loose_files] "
+            "[name_substring...]\n", argv[0]);
+    return 1;
+  }
+  name_filters = argv + optind;
+  num_name_filters = argc - optind;
+
+  int ret_val = 1;
+  char tmpdir[] = "/tmp/4grep_bench.XXXXXX";
+  char path[PATH_MAX];
+  // room to read BUFSIZE past any chunk start
+  char *log = malloc(LOG_BYTES + BUFSIZE);
+  uint8_t *bitmap = init_bitmap();
+  uint8_t *scratch = init_bitmap();
+  struct string_args strings = {NULL, 0};
+  struct should_filter_args filter_args = {NULL};
+  FILE *devnull = NULL;
+  if (log == NULL || bitmap == NULL || scratch == NULL) {
+    perror("Error: Memory not allocated");
+    goto OUT;
+  }
+  if (mkdtemp(tmpdir) == NULL) {
+    perror("Error creating temporary directory");
+    goto OUT;
+  }
+  generate_log(log, LOG_BYTES + BUFSIZE, 1);
+
+  struct apply_args apply = {log, scratch, apply_to_bitmap_slow};
+  struct benchmark apply_slow = {"apply_to_bitmap/slow", "byte", LOG_BYTES,
+                                 NULL, run_apply, &apply};
+  if (is_selected(apply_slow.name) && run_benchmark(&apply_slow)) {
+    goto OUT;
+  }
+  if (supports_bmi2()) {
+    struct apply_args apply_bmi2 = {log, scratch, apply_to_bitmap_bmi2};
+    struct benchmark b = {"apply_to_bitmap/bmi2", "byte", LOG_BYTES,
+                          NULL, run_apply, &apply_bmi2};
+    if (is_selected(b.name) && run_benchmark(&b)) {
+      goto OUT;
+    }
+  }
+
+  // search strings cut out of the log at random
+  strings.strings = calloc(NUM_SEARCH_STRINGS, sizeof(char *));
+  if (strings.strings == NULL) {
+    perror("Error: Memory not allocated");
+    goto OUT;
+  }
+  uint64_t state = 2;
+  for (; strings.num_strings < NUM_SEARCH_STRINGS; strings.num_strings++) {
+    size_t len = NGRAM_CHARS + random_hash(&state) % 32;
+    size_t offset = random_hash(&state) % (LOG_BYTES - len);
+    strings.strings[strings.num_strings] = strndup(log + offset, len);
+    if (strings.strings[strings.num_strings] == NULL) {
+      perror("Error: Memory not allocated");
+      goto OUT;
+    }
+  }
+  struct benchmark indices = {"get_4gram_indices", "string",
+                              NUM_SEARCH_STRINGS, NULL, run_get_4gram_indices,
+                              &strings};
+  if (is_selected(indices.name) && run_benchmark(&indices)) {
+    goto OUT;
+  }
+
+  // a bitmap of one megabyte of log, about that of a rotated log file
+  apply_to_bitmap_slow(bitmap, log, 1024 * 1024, 0);
+  devnull = fopen("/dev/null", "w");
+  snprintf(path, sizeof(path), "%s/loose", tmpdir);
+  FILE *loose = fopen(path, "w");
+  if (devnull == NULL || loose == NULL) {
+    perror("Error opening output files");
+    if (loose != NULL) {
+      fclose(loose);
+    }
+    goto OUT;
+  }
+  int ret = compress_to_fp(bitmap, loose, "/var/log/bench.log", 0, NULL);
+  if (fclose(loose) || ret) {
+    perror("Error writing loose file");
+    goto OUT;
+  }
+  struct compress_args compress = {bitmap, devnull, path};
+  struct benchmark compress_bench = {"compress_to_fp", "bitmap",
+                                     NUM_COMPRESSIONS, NULL,
+                                     run_compress_to_fp, &compress};
+  if (is_selected(compress_bench.name) && run_benchmark(&compress_bench)) {
+    goto OUT;
+  }
+  struct compress_args decompress = {scratch, NULL, path};
+  struct benchmark decompress_bench = {"decompress_file", "bitmap",
+                                       NUM_COMPRESSIONS, NULL,
+                                       run_decompress_file, &decompress};
+  if (is_selected(decompress_bench.name) && run_benchmark(&decompress_bench)) {
+    goto OUT;
+  }
+
+  if (bench_index_lookups(1000, "1k")
+      || bench_index_lookups(1000000, "1M")
+      || bench_index_lookups(10000000, "10M")) {
+    goto OUT;
+  }
+
+  // alternatives of a regex, as 4grep passes them: the ones not in the log
+  // come first, so that every check goes through all of them
+  char *filter_strings[] = {"kernel panic", "out of memory", "segfault at",
+                            "STACK trace", "replication"};
+  int num_rows = sizeof(filter_strings) / sizeof(filter_strings[0]);
+  filter_args.bitmap = bitmap;
+  filter_args.filter.rows = calloc(num_rows, sizeof(struct intarray));
+  if (filter_args.filter.rows == NULL) {
+    perror("Error: Memory not allocated");
+    goto OUT;
+  }
+  for (; filter_args.filter.num_rows < num_rows;
+       filter_args.filter.num_rows++) {
+    char *string = filter_strings[filter_args.filter.num_rows];
+    struct intarray *row = &filter_args.filter.rows[filter_args.filter.num_rows];
+    row->length = strlen(string) - NGRAM_CHARS + 1;
+    row->data = get_4gram_indices(string);
+    if (row->data == NULL) {
+      perror("Error: Memory not allocated");
+      goto OUT;
+    }
+  }
+  struct benchmark filter_bench = {"should_filter_out_file", "check",
+                                   NUM_FILTER_CHECKS, NULL,
+                                   run_should_filter_out_file, &filter_args};
+  if (is_selected(filter_bench.name) && run_benchmark(&filter_bench)) {
+    goto OUT;
+  }
+
+  snprintf(path, sizeof(path), "%s/subdir", tmpdir);
+  struct pack_args pack = {path, scratch, num_loose_files};
+  memset(scratch, 0, SIZEOF_BITMAP);
+  struct benchmark pack_bench = {"pack_loose_files_in_subdir", "loose_file",
+                                 num_loose_files, setup_pack, run_pack, &pack};
+  if (is_selected(pack_bench.name) && run_benchmark(&pack_bench)) {
+    goto OUT;
+  }
+  ret_val = 0;
+
+OUT:
+  if (devnull != NULL) {
+    fclose(devnull);
+  }
+  if (filter_args.filter.rows != NULL) {
+    free_intarrayarray(filter_args.filter);
+  }
+  for (int i = 0; i < strings.num_strings; i++) {
+    free(strings.strings[i]);
+  }
+  free(strings.strings);
+  free(log);
+  free(bitmap);
+  free(scratch);
+  if (tmpdir[strlen(tmpdir) - 1] != 'X') {
+    nftw(tmpdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+  return ret_val;
+}
@@ -3,16 +3,36 @@
 #include <string.h>
 #include <limits.h>
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <time.h>
 #include <zstd.h>
+#include <zlib.h>
 #include <dirent.h>
+#include <libgen.h>
 #include <lockfile.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/prctl.h>
 
 #include "../lib/minunit.h"
 #include "../src/filter.h"
 #include "../src/bitmap.h"
 #include "../src/util.h"
 #include "../src/packfile.h"
+#include "../src/uring.h"
+#include "../src/snapshot.h"
+#include "../src/bloom.h"
+#include "../src/segment.h"
+#include "../src/dict.h"
+#include "../src/content.h"
+#include "../src/indexer.h"
+#include "../src/service.h"
+#include "../src/builder.h"
+#include "../src/stats.h"
+#include "../src/looselog.h"
+#include "../src/writebehind.h"
 #include "portable_endian.h"
 
 /*--------------------------------------------------------------------*/
@@ -21,6 +41,33 @@ int tests_run = 0;
 
 /*--------------------------------------------------------------------*/
 
+/*
+ * Heap allocations made by the process, counted by interposing the glibc
+ * allocator.
+ */
+static long num_allocations = 0;
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  __atomic_add_fetch(&num_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  __atomic_add_fetch(&num_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&num_allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+/*--------------------------------------------------------------------*/
+
 /*
  * Returns a file descriptor pointing towards a pipe containing solely the
  * passed-in string.
@@ -185,7 +232,7 @@ static char *test_compress_bitmap() {
   FILE *bitmap_file = fdopen(mkstemp(bitmap_tmpfile_path), "w");
   // compress to a file in the bitmap store
   mu_assert("Error writing to tmpfile", bitmap_file != NULL);
-  compress_to_fp(bitmap, bitmap_file, fake_tmpfile_path, fake_mtime);
+  compress_to_fp(bitmap, bitmap_file, fake_tmpfile_path, fake_mtime, NULL);
   fclose(bitmap_file);
 
   // try decompressing it
@@ -321,8 +368,7 @@ static char *test_file_packing_single_file() {
   while ((entry = readdir(dir))) {
     if (strcmp(entry->d_name, PACKFILE_NAME) == 0
         || strcmp(entry->d_name, PACKFILE_INDEX_NAME) == 0
-        || strcmp(entry->d_name, ".") == 0
-        || strcmp(entry->d_name, "..") == 0) {
+        || entry->d_name[0] == '.') {
       continue;
     }
     mu_assert("Loose file still in bitmap store directory", 0);
@@ -383,8 +429,7 @@ static char *test_file_packing_multiple_files() {
   while ((entry = readdir(dir))) {
     if (strcmp(entry->d_name, PACKFILE_NAME) == 0
         || strcmp(entry->d_name, PACKFILE_INDEX_NAME) == 0
-        || strcmp(entry->d_name, ".") == 0
-        || strcmp(entry->d_name, "..") == 0) {
+        || entry->d_name[0] == '.') {
       continue;
     }
     mu_assert("Loose file still in bitmap store directory", 0);
@@ -445,8 +490,7 @@ static char *test_file_packing_existing_packfile() {
   while ((entry = readdir(dir))) {
     if (strcmp(entry->d_name, PACKFILE_NAME) == 0
         || strcmp(entry->d_name, PACKFILE_INDEX_NAME) == 0
-        || strcmp(entry->d_name, ".") == 0
-        || strcmp(entry->d_name, "..") == 0) {
+        || entry->d_name[0] == '.') {
       continue;
     }
     mu_assert("Loose file still in bitmap store directory", 0);
@@ -456,10 +500,413 @@ static char *test_file_packing_existing_packfile() {
   return 0;
 }
 
+static char *test_file_packing_cached_handle() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  int num_files = 3;
+  uint8_t *bitmaps[num_files];
+  char *tmpfile_paths[num_files];
+  for (int i = 0; i < num_files; i++) {
+    char name[PATH_MAX];
+    sprintf(name, "%d.txt", i);
+    tmpfile_paths[i] = add_path_parts(tmpfile_dir, name);
+    FILE *tmpfile = fopen(tmpfile_paths[i], "w");
+    mu_assert("Could not create tmpfile", tmpfile != NULL);
+    fprintf(tmpfile, "%d", i * 1000);
+    fclose(tmpfile);
+    tmpfile = fopen(tmpfile_paths[i], "r");
+    bitmaps[i] = init_bitmap();
+    apply_file_to_bitmap(bitmaps[i], tmpfile);
+    fclose(tmpfile);
+    int64_t mtime = get_mtime(tmpfile_paths[i]);
+    int ret = compress_to_file(bitmaps[i], tmpfile_paths[i], mtime, store);
+    mu_assert("Error compressing", ret == 0);
+    pack_loose_files_in_subdir(store);
+
+    // every earlier entry must still be found through the cached handle,
+    // and the new one through the handle reopened after the index changed
+    for (int j = 0; j <= i; j++) {
+      mtime = get_mtime(tmpfile_paths[j]);
+      uint8_t *read_bitmap = read_from_packfile(tmpfile_paths[j], mtime, store);
+      mu_assert("Could not find bitmap in packfile", read_bitmap != NULL);
+      mu_assert("Wrong bitmap returned",
+          bitmaps_are_the_same(bitmaps[j], read_bitmap));
+      free(read_bitmap);
+    }
+  }
+  for (int i = 0; i < num_files; i++) {
+    free(bitmaps[i]);
+    free(tmpfile_paths[i]);
+  }
+  return 0;
+}
+
+static char *test_file_packing_index_filter() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  mu_assert("Could not create tmpdir", store != NULL);
+  int num_files = 50;
+  uint8_t *bitmap = init_bitmap();
+  for (int i = 0; i < num_files; i++) {
+    char name[PATH_MAX];
+    sprintf(name, "/tmp/nonexistent_%d", i);
+    int ret = compress_to_file(bitmap, name, i, store);
+    mu_assert("Error compressing", ret == 0);
+  }
+  pack_loose_files_in_subdir(store);
+
+  char *filter_path = add_path_parts(store, PACKFILE_FILTER_NAME);
+  mu_assert("Index filter not written", access(filter_path, F_OK) == 0);
+  for (int i = 0; i < num_files; i++) {
+    char name[PATH_MAX];
+    sprintf(name, "/tmp/nonexistent_%d", i);
+    uint8_t *read_bitmap = read_from_packfile(name, i, store);
+    mu_assert("Indexed file rejected by filter", read_bitmap != NULL);
+    free(read_bitmap);
+  }
+  mu_assert("Unindexed file found",
+      read_from_packfile("/tmp/nonexistent_unindexed", 0, store) == NULL);
+
+  // a filter left over from another index must be ignored
+  FILE *filter = fopen(filter_path, "r+");
+  mu_assert("Could not open filter", filter != NULL);
+  fseek(filter, 8, SEEK_SET);
+  uint64_t wrong_ino = 0;
+  fwrite(&wrong_ino, sizeof(wrong_ino), 1, filter);
+  fseek(filter, 32, SEEK_SET);
+  uint8_t empty[BLOOM_BLOCK_BYTES] = {0};
+  fwrite(empty, sizeof(empty), 1, filter);
+  fclose(filter);
+  invalidate_packfile_handle(store);
+  uint8_t *read_bitmap = read_from_packfile("/tmp/nonexistent_0", 0, store);
+  mu_assert("Stale filter was used", read_bitmap != NULL);
+  free(read_bitmap);
+
+  free(filter_path);
+  free(bitmap);
+  return 0;
+}
+
+static int count_segment_files(char *store) {
+  int num_segments = 0;
+  DIR *dir = opendir(store);
+  struct dirent *entry;
+  while (dir && (entry = readdir(dir))) {
+    num_segments += strncmp(entry->d_name, INDEX_SEGMENT_PREFIX,
+                            strlen(INDEX_SEGMENT_PREFIX)) == 0;
+  }
+  closedir(dir);
+  return num_segments;
+}
+
+static char *test_file_packing_segments() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  mu_assert("Could not create tmpdir", store != NULL);
+  uint8_t *bitmap = init_bitmap();
+  int base_files = 40;
+  int run_files = 3;
+  int num_files = 0;
+  // the expected segments after each run of 3 files on a base of 40: a new
+  // segment per run, four merged into one, then all folded into the base
+  int expected_segments[] = {1, 2, 3, 1, 2, 3, 0};
+  int num_runs = sizeof(expected_segments) / sizeof(int);
+  for (int run = -1; run < num_runs; run++) {
+    int files_in_run = run < 0 ? base_files : run_files;
+    for (int i = 0; i < files_in_run; i++, num_files++) {
+      char name[PATH_MAX];
+      sprintf(name, "/tmp/nonexistent_%d", num_files);
+      compress_to_file(bitmap, name, num_files, store);
+    }
+    pack_loose_files_in_subdir(store);
+
+    struct index_manifest manifest;
+    mu_assert("Could not read manifest",
+        read_index_manifest(store, &manifest) == 0);
+    int want = run < 0 ? 0 : expected_segments[run];
+    mu_assert("Wrong number of segments", manifest.num_segments == want);
+    mu_assert("Stale segment files left behind",
+        count_segment_files(store) == want);
+    free_index_manifest(&manifest);
+    for (int i = 0; i < num_files; i++) {
+      char name[PATH_MAX];
+      sprintf(name, "/tmp/nonexistent_%d", i);
+      uint8_t *read_bitmap = read_from_packfile(name, i, store);
+      mu_assert("Packed file missing from index segments",
+          read_bitmap != NULL);
+      free(read_bitmap);
+    }
+  }
+
+  char *index_path = add_path_parts(store, PACKFILE_INDEX_NAME);
+  struct stat index_stat;
+  mu_assert("Could not stat index", stat(index_path, &index_stat) == 0);
+  mu_assert("Segments not folded into base index",
+      index_stat.st_size == num_files * sizeof(struct index_entry));
+  free(index_path);
+
+  // compaction folds a segment holding a duplicate into the base
+  compress_to_file(bitmap, "/tmp/nonexistent_0", 0, store);
+  pack_loose_files_in_subdir(store);
+  mu_assert("Duplicate not packed into a segment",
+      count_segment_files(store) == 1);
+  mu_assert("Duplicate not dropped", compact_packfile_in_subdir(store, 0) == 1);
+  mu_assert("Segment left after compaction", count_segment_files(store) == 0);
+  for (int i = 0; i < num_files; i++) {
+    char name[PATH_MAX];
+    sprintf(name, "/tmp/nonexistent_%d", i);
+    uint8_t *read_bitmap = read_from_packfile(name, i, store);
+    mu_assert("Packed file lost in compaction", read_bitmap != NULL);
+    free(read_bitmap);
+  }
+  free(bitmap);
+  return 0;
+}
+
+static char *test_file_packing_compaction() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  char *kept_path = add_path_parts(tmpfile_dir, "kept.txt");
+  char *deleted_path = add_path_parts(tmpfile_dir, "deleted.txt");
+  FILE *tmpfile = fopen(kept_path, "w");
+  mu_assert("Could not create tmpfile", tmpfile != NULL);
+  fclose(tmpfile);
+  tmpfile = fopen(deleted_path, "w");
+  mu_assert("Could not create tmpfile", tmpfile != NULL);
+  fclose(tmpfile);
+  int64_t kept_mtime = get_mtime(kept_path);
+  int64_t deleted_mtime = get_mtime(deleted_path);
+
+  uint8_t *bitmap = init_bitmap();
+  compress_to_file(bitmap, kept_path, kept_mtime - 1, store);
+  pack_loose_files_in_subdir(store);
+  compress_to_file(bitmap, kept_path, kept_mtime, store);
+  compress_to_file(bitmap, deleted_path, deleted_mtime, store);
+  pack_loose_files_in_subdir(store);
+  unlink(deleted_path);
+
+  char *packfile_path = add_path_parts(store, PACKFILE_NAME);
+  char *old_packfile_path = add_path_parts(store, ".old_packfile");
+  char *new_packfile_path = add_path_parts(store, ".new_packfile");
+  link(packfile_path, old_packfile_path);
+  mu_assert("Wrong number of old entries dropped",
+      compact_packfile_in_subdir(store, 0) == 1);
+  // the manifest names the rewritten packfile, so a reader that opens the
+  // old packfile with the new index does not read it at the new offsets
+  struct index_manifest manifest;
+  struct stat packfile_stat;
+  mu_assert("Could not read manifest",
+      read_index_manifest(store, &manifest) == 0);
+  mu_assert("Could not stat packfile", stat(packfile_path, &packfile_stat) == 0);
+  mu_assert("Manifest does not record the packfile",
+      manifest.packfile_ino == packfile_stat.st_ino);
+  free_index_manifest(&manifest);
+  rename(packfile_path, new_packfile_path);
+  rename(old_packfile_path, packfile_path);
+  mu_assert("Old packfile read with the new index",
+      read_from_packfile(kept_path, kept_mtime, store) == NULL);
+  rename(new_packfile_path, packfile_path);
+  free(packfile_path);
+  free(old_packfile_path);
+  free(new_packfile_path);
+  // the replaced base index is kept aside for readers that have it mapped
+  char *retired_path = add_path_parts(store,
+                                      RETIRED_PREFIX PACKFILE_INDEX_NAME ".0");
+  mu_assert("Replaced index not retired", access(retired_path, F_OK) == 0);
+  delete_retired_index_files(store);
+  mu_assert("Retired index removed too early",
+      access(retired_path, F_OK) == 0);
+  free(retired_path);
+  uint8_t *read_bitmap = read_from_packfile(kept_path, kept_mtime - 1, store);
+  mu_assert("Old entry survived compaction", read_bitmap == NULL);
+  read_bitmap = read_from_packfile(kept_path, kept_mtime, store);
+  mu_assert("Newest entry lost in compaction", read_bitmap != NULL);
+  mu_assert("Wrong bitmap after compaction",
+      bitmaps_are_the_same(bitmap, read_bitmap));
+  free(read_bitmap);
+  read_bitmap = read_from_packfile(deleted_path, deleted_mtime, store);
+  mu_assert("Deleted file dropped without drop_missing", read_bitmap != NULL);
+  free(read_bitmap);
+
+  mu_assert("Wrong number of missing entries dropped",
+      compact_packfile_in_subdir(store, 1) == 1);
+  read_bitmap = read_from_packfile(deleted_path, deleted_mtime, store);
+  mu_assert("Deleted file survived compaction", read_bitmap == NULL);
+  read_bitmap = read_from_packfile(kept_path, kept_mtime, store);
+  mu_assert("Existing file dropped in compaction", read_bitmap != NULL);
+  free(read_bitmap);
+  mu_assert("Compacted packfile compacted again",
+      compact_packfile_in_subdir(store, 1) == 0);
+
+  char *packfile_lock = add_path_parts(store, PACKFILE_LOCK_NAME);
+  mu_assert("Could not lock packfile",
+      lockfile_create(packfile_lock, 0, 0) == 0);
+  mu_assert("Compacted despite lock", compact_packfile_in_subdir(store, 1) == -1);
+  lockfile_remove(packfile_lock);
+
+  free(packfile_lock);
+  free(bitmap);
+  free(kept_path);
+  free(deleted_path);
+  return 0;
+}
+
+static char *test_file_packing_dict() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  mu_assert("Could not create tmpdir", store != NULL);
+  // bitmaps of one family: a shared pattern plus a few bits of their own
+  uint8_t *shared = init_bitmap();
+  srand(1);
+  for (int i = 0; i < POSSIBLE_NGRAMS / 4; i++) {
+    set_bit(shared, rand() % POSSIBLE_NGRAMS);
+  }
+  int num_files = DICT_MIN_SAMPLES + 8;
+  uint8_t *bitmap = init_bitmap();
+  for (int i = 0; i < num_files; i++) {
+    memcpy(bitmap, shared, SIZEOF_BITMAP);
+    for (int j = 0; j < 64; j++) {
+      set_bit(bitmap, rand() % POSSIBLE_NGRAMS);
+    }
+    char name[PATH_MAX];
+    sprintf(name, "/tmp/nonexistent_%d", i);
+    compress_to_file(bitmap, name, i, store);
+  }
+  pack_loose_files_in_subdir(store);
+
+  char *dict_path = add_path_parts(store, DICT_NAME);
+  struct stat dict_stat;
+  mu_assert("Dictionary not trained", stat(dict_path, &dict_stat) == 0);
+  mu_assert("Dictionary not kept", dict_stat.st_size > 0);
+  free(dict_path);
+  uint8_t *read_bitmap = read_from_packfile("/tmp/nonexistent_0", 0, store);
+  mu_assert("File packed before training unreadable", read_bitmap != NULL);
+  free(read_bitmap);
+
+  // a bitmap written now is compressed with the dictionary
+  memcpy(bitmap, shared, SIZEOF_BITMAP);
+  set_bit(bitmap, 12345);
+  char name[PATH_MAX], hashed_filename[21];
+  sprintf(name, "/tmp/nonexistent_%d", num_files);
+  compress_to_file(bitmap, name, num_files, store);
+  get_hash(name, strlen(name), hashed_filename);
+  strcat(hashed_filename, "_000");
+  char *loose_path = add_path_parts(store, hashed_filename);
+  FILE *loose = fopen(loose_path, "r");
+  mu_assert("Loose file not written", loose != NULL);
+  uint8_t record[1024];
+  size_t record_len = fread(record, 1, sizeof(record), loose);
+  fclose(loose);
+  size_t header_len = sizeof(uint16_t) + strlen(name) + sizeof(int64_t)
+    + sizeof(uint32_t);
+  mu_assert("Loose file compressed without dictionary",
+      ZSTD_getDictID_fromFrame(record + header_len,
+                               record_len - header_len) != 0);
+  uint8_t *decompressed = init_bitmap();
+  mu_assert("Decompress error", decompress_file(decompressed, loose_path) == 0);
+  mu_assert("Decompressed bitmap not the same",
+      memcmp(bitmap, decompressed, SIZEOF_BITMAP) == 0);
+  free(loose_path);
+  free(decompressed);
+
+  pack_loose_files_in_subdir(store);
+  read_bitmap = read_from_packfile(name, num_files, store);
+  mu_assert("File packed with dictionary unreadable", read_bitmap != NULL);
+  mu_assert("Packed bitmap not the same",
+      memcmp(bitmap, read_bitmap, SIZEOF_BITMAP) == 0);
+  free(read_bitmap);
+  free(bitmap);
+  free(shared);
+  return 0;
+}
+
+static char *test_file_packing_batch_lookup() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  // the packed files, split over two segments, then two never indexed
+  int num_packed = 20, num = 22;
+  uint8_t *bitmaps[num];
+  uint8_t *read_bitmaps[num];
+  char *paths[num];
+  int64_t mtimes[num];
+  int found[num];
+  for (int i = 0; i < num; i++) {
+    char name[PATH_MAX];
+    sprintf(name, "%d.txt", i);
+    paths[i] = add_path_parts(tmpfile_dir, name);
+    FILE *tmpfile = fopen(paths[i], "w");
+    mu_assert("Could not create tmpfile", tmpfile != NULL);
+    fprintf(tmpfile, "%d", i * 1000);
+    fclose(tmpfile);
+    mtimes[i] = get_mtime(paths[i]);
+    bitmaps[i] = init_bitmap();
+    read_bitmaps[i] = init_bitmap();
+    if (i < num_packed) {
+      tmpfile = fopen(paths[i], "r");
+      apply_file_to_bitmap(bitmaps[i], tmpfile);
+      fclose(tmpfile);
+      mu_assert("Error compressing",
+          compress_to_file(bitmaps[i], paths[i], mtimes[i], store) == 0);
+    }
+    if (i == num_packed / 2) {
+      pack_loose_files_in_subdir(store);
+    }
+  }
+  pack_loose_files_in_subdir(store);
+  // a packed file with another mtime is not found either
+  mtimes[3]++;
+
+  // lookups out of hash order, from both segments, in one batch
+  int ret = read_from_packfile_batch(paths, mtimes, num, store,
+                                     read_bitmaps, found);
+  mu_assert("Wrong number of files found", ret == num_packed - 1);
+  for (int i = 0; i < num; i++) {
+    mu_assert("Wrong file found",
+        found[i] == (i < num_packed && i != 3));
+    if (found[i]) {
+      mu_assert("Wrong bitmap returned",
+          memcmp(bitmaps[i], read_bitmaps[i], SIZEOF_BITMAP) == 0);
+    }
+  }
+  // NULL bitmaps only check for the files
+  uint8_t *no_bitmaps[num];
+  memset(no_bitmaps, 0, sizeof(no_bitmaps));
+  mu_assert("Wrong number of files checked",
+      read_from_packfile_batch(paths, mtimes, num, store, no_bitmaps,
+                               found) == num_packed - 1);
+  mu_assert("Batch found files without a packfile",
+      read_from_packfile_batch(paths, mtimes, num, tmpfile_dir, read_bitmaps,
+                               found) == -1);
+  for (int i = 0; i < num; i++) {
+    free(bitmaps[i]);
+    free(read_bitmaps[i]);
+    free(paths[i]);
+  }
+  return 0;
+}
+
 static char *test_file_packing() {
   mu_run_test(test_file_packing_single_file);
   mu_run_test(test_file_packing_multiple_files);
   mu_run_test(test_file_packing_existing_packfile);
+  mu_run_test(test_file_packing_cached_handle);
+  mu_run_test(test_file_packing_index_filter);
+  mu_run_test(test_file_packing_segments);
+  mu_run_test(test_file_packing_compaction);
+  mu_run_test(test_file_packing_dict);
+  mu_run_test(test_file_packing_batch_lookup);
   return 0;
 }
 
@@ -561,10 +1008,725 @@ static char *test_filter_checks_packfile() {
   return 0;
 }
 
+static char *test_filter_checks_loose_snapshot() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  mu_assert("Could not create tmpdir", store != NULL);
+  char *filename = "/tmp/nonexistent";
+  char hash[21];
+  get_hash(filename, strlen(filename), hash);
+
+  mu_assert("Empty directory has loose candidates",
+      count_loose_candidates(store, hash) == 0);
+
+  uint8_t *bitmap = init_bitmap();
+  compress_to_file(bitmap, filename, 0, store);
+  mu_assert("Own loose file missing from snapshot",
+      count_loose_candidates(store, hash) == 1);
+
+  // a loose file written by another process shows up once rechecked
+  if (fork() == 0) {
+    compress_to_file(bitmap, filename, 0, store);
+    exit(0);
+  }
+  int wait_status;
+  wait(&wait_status);
+  usleep(SNAPSHOT_RECHECK_NSEC / 1000 + 100000);
+  mu_assert("Other process's loose file missing from snapshot",
+      count_loose_candidates(store, hash) == 2);
+
+  char *other = "/tmp/other_nonexistent";
+  char other_hash[21];
+  get_hash(other, strlen(other), other_hash);
+  mu_assert("Unrelated hash has loose candidates",
+      count_loose_candidates(store, other_hash) == 0);
+  free(bitmap);
+  return 0;
+}
+
+static char *test_filter_checks_no_allocations() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  char *tmpfile_path = add_path_parts(tmpfile_dir, "1.txt");
+  FILE *tmpfile = fopen(tmpfile_path, "w");
+  mu_assert("Could not create tmpfile", tmpfile != NULL);
+  fputs("asdfghjkl", tmpfile);
+  fclose(tmpfile);
+  int64_t mtime = get_mtime(tmpfile_path);
+  char *index_strings[] = {"asdfg"};
+  struct intarray row = strings_to_sorted_indices(index_strings, 1);
+  struct intarrayarray filter = {.num_rows = 1, .rows = &row};
+
+  uint8_t *bitmap = init_bitmap();
+  memset(bitmap, 0xff, SIZEOF_BITMAP);
+  char *index_subdir = get_index_subdirectory(store, mtime);
+  compress_to_file(bitmap, tmpfile_path, mtime, index_subdir);
+  pack_loose_files_in_subdir(index_subdir);
+  // a directory modified in the last seconds has its listing re-read
+  struct timeval old_times[2] = {{1000000000, 0}, {1000000000, 0}};
+  utimes(index_subdir, old_times);
+
+  // the first lookups set up the thread's buffers and the open packfile
+  mu_assert("Packed bitmap not found",
+      start_filter(filter, tmpfile_path, store) == 1);
+  long allocations_before = num_allocations;
+  for (int i = 0; i < 100; i++) {
+    mu_assert("Packed bitmap not found",
+        start_filter(filter, tmpfile_path, store) == 1);
+  }
+  mu_assert("Filtering a packed file allocated memory",
+      num_allocations == allocations_before);
+
+  // so does a batch, once the thread's batch buffers have grown to fit it
+  char *batch[] = {tmpfile_path, tmpfile_path, tmpfile_path};
+  int results[3];
+  mu_assert("Batch failed", start_filter_batch(filter, batch, 3, store,
+                                               results) == 0);
+  allocations_before = num_allocations;
+  for (int i = 0; i < 100; i++) {
+    mu_assert("Batch failed", start_filter_batch(filter, batch, 3, store,
+                                                 results) == 0);
+    mu_assert("Packed bitmap not found in batch",
+        results[0] == 1 && results[1] == 1 && results[2] == 1);
+  }
+  mu_assert("Filtering a packed batch allocated memory",
+      num_allocations == allocations_before);
+
+  free_intarray(row);
+  free(bitmap);
+  free(index_subdir);
+  free(tmpfile_path);
+  return 0;
+}
+
+static void write_gzip_file(char *path, char *text, int repeat) {
+  gzFile gzf = gzopen(path, "wb");
+  for (int i = 0; i < repeat; i++) {
+    gzputs(gzf, text);
+  }
+  gzclose(gzf);
+}
+
+static void copy_file(char *from, char *to) {
+  char buf[BUFSIZE];
+  FILE *in = fopen(from, "r");
+  FILE *out = fopen(to, "w");
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    fwrite(buf, 1, n, out);
+  }
+  fclose(in);
+  fclose(out);
+}
+
+static char *test_filter_checks_gzip_content() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  char *log_path = add_path_parts(tmpfile_dir, "log.2.gz");
+  char *copy_path = add_path_parts(tmpfile_dir, "copy.gz");
+  char *rotated_path = add_path_parts(tmpfile_dir, "log.3.gz");
+  char *other_path = add_path_parts(tmpfile_dir, "other.gz");
+  write_gzip_file(log_path, "asdfghjkl\n", 100);
+  write_gzip_file(other_path, "asdfghjkl qwertyuiop\n", 100);
+  char *index_strings[] = {"asdfg"};
+  struct intarray row = strings_to_sorted_indices(index_strings, 1);
+  struct intarrayarray filter = {.num_rows = 1, .rows = &row};
+
+  char content_name[CONTENT_NAME_MAX];
+  int fd = open(log_path, O_RDONLY);
+  mu_assert("No content name for gzip file",
+      gzip_content_name(fd, content_name) == 0);
+  close(fd);
+  fd = open(tmpfile_dir, O_RDONLY);
+  mu_assert("Content name for a directory",
+      gzip_content_name(fd, content_name) != 0);
+  close(fd);
+
+  mu_assert("Bitmap not created",
+      start_filter(filter, log_path, store) == 3);
+  // a copy keeping the mtime shares the bitmap, loose and then packed
+  struct stat log_stat;
+  stat(log_path, &log_stat);
+  struct timeval log_times[2] = {{log_stat.st_mtime, 0},
+                                 {log_stat.st_mtime, 0}};
+  copy_file(log_path, copy_path);
+  utimes(copy_path, log_times);
+  mu_assert("Copy not found by content",
+      start_filter(filter, copy_path, store) == 1);
+  pack_loose_files(store);
+  rename(log_path, rotated_path);
+  mu_assert("Rotated file not found by content",
+      start_filter(filter, rotated_path, store) == 1);
+  mu_assert("Other content found",
+      start_filter(filter, other_path, store) == 3);
+  // content is stored under the month of the file's mtime, so a copy from
+  // another month is indexed again and ages out with its own month
+  struct timeval old_times[2] = {{1000000000, 0}, {1000000000, 0}};
+  utimes(copy_path, old_times);
+  mu_assert("Copy from another month found in this month",
+      start_filter(filter, copy_path, store) == 3);
+  pack_loose_files(store);
+  compact_packfiles(store, 1);
+  mu_assert("Packed copy from another month not found",
+      start_filter(filter, copy_path, store) == 1);
+  mu_assert("Rotated file not found after compaction",
+      start_filter(filter, rotated_path, store) == 1);
+
+  // only the content subdirectories of the months hold bitmaps
+  char content_dir[PATH_MAX];
+  content_subdirectory_path(content_dir, store, log_stat.st_mtime);
+  mu_assert("No content subdirectory", is_dir(content_dir));
+  content_subdirectory_path(content_dir, store, 1000000000);
+  mu_assert("No content subdirectory for the old month", is_dir(content_dir));
+  char *month_dir = dirname(content_dir);
+  DIR *dir = opendir(month_dir);
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    mu_assert("Gzip file stored by path", entry->d_name[0] == '.'
+        || strcmp(entry->d_name, CONTENT_SUBDIR) == 0
+        || strcmp(entry->d_name, PACKFILE_NAME) == 0);
+  }
+  closedir(dir);
+  char *month_packfile = add_path_parts(month_dir, PACKFILE_NAME);
+  struct stat packfile_stat;
+  mu_assert("Gzip file packed by path", stat(month_packfile, &packfile_stat)
+      != 0 || packfile_stat.st_size == 0);
+  free(month_packfile);
+  char *top_content_dir = add_path_parts(store, CONTENT_SUBDIR);
+  mu_assert("Content stored outside a month", !is_dir(top_content_dir));
+  free(top_content_dir);
+
+  free_intarray(row);
+  free(log_path);
+  free(copy_path);
+  free(rotated_path);
+  free(other_path);
+  return 0;
+}
+
+static char *test_filter_checks_batch() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  char *index_strings[] = {"asdfg"};
+  struct intarray row = strings_to_sorted_indices(index_strings, 1);
+  struct intarrayarray filter = {.num_rows = 1, .rows = &row};
+  char *contents[] = {"asdfghjkl", "qwertyuiop", "xasdfgx", "zxcvbnm"};
+  int num = 4;
+  char *paths[num + 1];
+  int results[num + 1];
+  for (int i = 0; i < num; i++) {
+    char name[PATH_MAX];
+    sprintf(name, "%d.txt", i);
+    paths[i] = add_path_parts(tmpfile_dir, name);
+    FILE *tmpfile = fopen(paths[i], "w");
+    mu_assert("Could not create tmpfile", tmpfile != NULL);
+    fputs(contents[i], tmpfile);
+    fclose(tmpfile);
+  }
+  paths[num] = "/tmp/nonexistent";
+
+  // the first two are packed, the third is loose, the fourth unindexed
+  mu_assert("Bitmap not created", start_filter(filter, paths[0], store) == 3);
+  mu_assert("Bitmap not created", start_filter(filter, paths[1], store) == 4);
+  pack_loose_files(store);
+  mu_assert("Bitmap not created", start_filter(filter, paths[2], store) == 3);
+
+  mu_assert("Batch failed",
+      start_filter_batch(filter, paths, num + 1, store, results) == 0);
+  mu_assert("Packed match not found", results[0] == 1);
+  mu_assert("Packed mismatch not found", results[1] == 2);
+  mu_assert("Loose match not found", results[2] == 1);
+  mu_assert("Bitmap not created in batch", results[3] == 4);
+  mu_assert("Missing file filtered", results[4] == -1);
+  mu_assert("Batch bitmap not stored",
+      start_filter(filter, paths[3], store) == 2);
+  for (int i = 0; i < num; i++) {
+    free(paths[i]);
+  }
+  return 0;
+}
+
 static char *test_filter_checks() {
   mu_run_test(test_filter_checks_emptydir);
   mu_run_test(test_filter_checks_loose_file);
   mu_run_test(test_filter_checks_packfile);
+  mu_run_test(test_filter_checks_loose_snapshot);
+  mu_run_test(test_filter_checks_no_allocations);
+  mu_run_test(test_filter_checks_gzip_content);
+  mu_run_test(test_filter_checks_batch);
+  return 0;
+}
+
+static char *test_prefetch() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+
+  char *tmpfile_path = add_path_parts(tmpfile_dir, "1.txt");
+  mu_assert("Prefetched nonexistent file",
+      prefetch_file(tmpfile_path, store) != 0);
+
+  FILE *tmpfile = fopen(tmpfile_path, "w");
+  mu_assert("Could not create tmpfile", tmpfile != NULL);
+  fputs("asdf", tmpfile);
+  fclose(tmpfile);
+  int64_t mtime = get_mtime(tmpfile_path);
+  mu_assert("Could not prefetch unindexed file",
+      prefetch_file(tmpfile_path, store) == 0);
+
+  uint8_t *bitmap = init_bitmap();
+  char *index_subdir = get_index_subdirectory(store, mtime);
+  compress_to_file(bitmap, tmpfile_path, mtime, index_subdir);
+  pack_loose_files_in_subdir(index_subdir);
+  mu_assert("Packed entry not found by prefetch",
+      prefetch_from_packfile(tmpfile_path, index_subdir) == 0);
+  mu_assert("Nonexistent entry found by prefetch",
+      prefetch_from_packfile("/tmp/nonexistent", index_subdir) != 0);
+  mu_assert("Could not prefetch indexed file",
+      prefetch_file(tmpfile_path, store) == 0);
+
+  free(index_subdir);
+  free(tmpfile_path);
+  free(bitmap);
+  return 0;
+}
+
+static char *test_uring_batches() {
+  if (!uring_available()) {
+    // the callers fall back to their synchronous path; nothing to test
+    return 0;
+  }
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *dir = mkdtemp(template);
+  mu_assert("Could not create tmpdir", dir != NULL);
+  int num_files = 300;
+  char *paths[num_files];
+  for (int i = 0; i < num_files; i++) {
+    char name[PATH_MAX];
+    sprintf(name, "%d.txt", i);
+    paths[i] = add_path_parts(dir, name);
+    if (i % 3 == 0) {
+      // leave every third file missing
+      continue;
+    }
+    FILE *f = fopen(paths[i], "w");
+    mu_assert("Could not create tmpfile", f != NULL);
+    fprintf(f, "%d", i * 1000);
+    fclose(f);
+  }
+
+  int exists[num_files];
+  mu_assert("uring_files_exist failed",
+      uring_files_exist(paths, num_files, exists) == 0);
+  struct uring_read_result results[num_files];
+  mu_assert("uring_read_files failed",
+      uring_read_files(paths, num_files, results) == 0);
+  for (int i = 0; i < num_files; i++) {
+    mu_assert("uring_files_exist wrong", exists[i] == (i % 3 != 0));
+    if (i % 3 == 0) {
+      mu_assert("Read missing file", results[i].error == ENOENT);
+      mu_assert("Read missing file", results[i].data == NULL);
+      continue;
+    }
+    char expected[PATH_MAX];
+    sprintf(expected, "%d", i * 1000);
+    mu_assert("Wrong length read", results[i].length == strlen(expected));
+    mu_assert("Wrong data read",
+        memcmp(results[i].data, expected, results[i].length) == 0);
+    free(results[i].data);
+  }
+
+  mu_assert("uring_unlink_files failed",
+      uring_unlink_files(paths, num_files) == 0);
+  for (int i = 0; i < num_files; i++) {
+    mu_assert("File not removed", access(paths[i], F_OK) != 0);
+    free(paths[i]);
+  }
+  return 0;
+}
+
+static void write_text_file(char *path, char *text) {
+  FILE *f = fopen(path, "w");
+  fputs(text, f);
+  fclose(f);
+}
+
+static char *test_indexer() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *root = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", root != NULL);
+  char *old_path = add_path_parts(root, "old.txt");
+  char *new_path = add_path_parts(root, "new.txt");
+  char *subdir = add_path_parts(root, "sub");
+  char *sub_path = add_path_parts(subdir, "new.txt");
+  write_text_file(old_path, "asdfghjkl\n");
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // do not outlive a failed test
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    exit(run_indexer(&root, 1, store, 2, 50, 3600, 1) == 0 ? 0 : 1);
+  }
+  mu_assert("Could not fork indexer", pid > 0);
+  // give the indexer time to set up its watches
+  usleep(500000);
+  write_text_file(new_path, "asdfghjkl qwertyuiop\n");
+  mkdir(subdir, 0777);
+  write_text_file(sub_path, "asdfghjkl zxcvbnm\n");
+  usleep(1000000);
+  kill(pid, SIGTERM);
+  int wait_status;
+  waitpid(pid, &wait_status, 0);
+  mu_assert("Indexer failed",
+      WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0);
+
+  // searches find the bitmaps the indexer built
+  char *index_strings[] = {"asdfg"};
+  struct intarray row = strings_to_sorted_indices(index_strings, 1);
+  struct intarrayarray filter = {.num_rows = 1, .rows = &row};
+  mu_assert("Existing file not indexed",
+      start_filter(filter, old_path, store) == 1);
+  mu_assert("New file not indexed",
+      start_filter(filter, new_path, store) == 1);
+  mu_assert("File in new directory not indexed",
+      start_filter(filter, sub_path, store) == 1);
+
+  free_intarray(row);
+  free(old_path);
+  free(new_path);
+  free(subdir);
+  free(sub_path);
+  return 0;
+}
+
+/**
+ * Returns the number of sockets the process has open.
+ */
+static int count_open_sockets() {
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == NULL) {
+    return -1;
+  }
+  int num_sockets = 0;
+  char path[PATH_MAX];
+  char target[PATH_MAX];
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    snprintf(path, sizeof(path), "/proc/self/fd/%s", entry->d_name);
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len > 0) {
+      target[len] = '\0';
+      num_sockets += strncmp(target, "socket:", strlen("socket:")) == 0;
+    }
+  }
+  closedir(dir);
+  return num_sockets;
+}
+
+static char *test_service() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  char *tmpfile_path = add_path_parts(tmpfile_dir, "1.txt");
+  write_text_file(tmpfile_path, "asdfghjkl\n");
+  char *index_strings[] = {"asdfg"};
+  struct intarray row = strings_to_sorted_indices(index_strings, 1);
+  struct intarrayarray filter = {.num_rows = 1, .rows = &row};
+  char *other_strings[] = {"qwert"};
+  struct intarray other_row = strings_to_sorted_indices(other_strings, 1);
+  struct intarrayarray other_filter = {.num_rows = 1, .rows = &other_row};
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    exit(run_service(store, 1024 * 1024) == 0 ? 0 : 1);
+  }
+  mu_assert("Could not fork service", pid > 0);
+  usleep(300000);
+  int sock = connect_service(store);
+  mu_assert("Could not connect to service", sock != -1);
+  int fd = open(tmpfile_path, O_RDONLY);
+  int8_t result;
+  mu_assert("Query failed", query_service(sock, filter, &fd, 1, &result) == 0);
+  mu_assert("Unindexed file known", result == SERVICE_UNKNOWN);
+
+  // the service leaves unindexed files to start_filter, then serves them
+  mu_assert("Bitmap not created",
+      start_filter(filter, tmpfile_path, store) == 3);
+  // the service's snapshot of the index subdirectory may miss the new loose
+  // file until it is rechecked
+  usleep(SNAPSHOT_RECHECK_NSEC / 1000 + 100000);
+  mu_assert("Query failed", query_service(sock, filter, &fd, 1, &result) == 0);
+  mu_assert("Indexed file not matched", result == 1);
+  mu_assert("Query failed",
+      query_service(sock, other_filter, &fd, 1, &result) == 0);
+  mu_assert("Indexed file not filtered out", result == 2);
+  close(fd);
+  close(sock);
+
+  // with the bitmap gone from disk, the service still has it in memory
+  char real_path[PATH_MAX];
+  char index_subdir[PATH_MAX];
+  char hashed_filename[21];
+  realpath(tmpfile_path, real_path);
+  index_subdirectory_path(index_subdir, store, get_mtime(real_path));
+  get_hash(real_path, strlen(real_path), hashed_filename);
+  strcat(hashed_filename, "_000");
+  char *loose_path = add_path_parts(index_subdir, hashed_filename);
+  mu_assert("Could not remove loose file", unlink(loose_path) == 0);
+  mu_assert("Bitmap not served from memory",
+      start_filter(filter, tmpfile_path, store) == 1);
+  int wait_status;
+  mu_assert("Bitmap not served from memory",
+      start_filter(other_filter, tmpfile_path, store) == 2);
+
+  // a forked worker drops the parent's connection for one of its own,
+  // leaving no more descriptors open than before
+  pid_t child = fork();
+  if (child == 0) {
+    int sockets_before = count_open_sockets();
+    int ret = start_filter(filter, tmpfile_path, store);
+    _exit(ret == 1 && count_open_sockets() == sockets_before ? 0 : 1);
+  }
+  mu_assert("Could not fork worker", child > 0);
+  waitpid(child, &wait_status, 0);
+  mu_assert("Forked worker leaked the parent's connection",
+      WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0);
+
+  kill(pid, SIGTERM);
+  waitpid(pid, &wait_status, 0);
+  mu_assert("Service failed",
+      WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0);
+  // without the service, the file is indexed again
+  mu_assert("Bitmap not recreated",
+      start_filter(filter, tmpfile_path, store) == 3);
+
+  free_intarray(row);
+  free_intarray(other_row);
+  free(loose_path);
+  free(tmpfile_path);
+  return 0;
+}
+
+static char *test_build_index() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *root = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", root != NULL);
+  int num_files = BUILD_CHUNK_FILES + 44;
+  char *subdir = add_path_parts(root, "sub");
+  mkdir(subdir, 0777);
+  char *paths[num_files];
+  for (int i = 0; i < num_files; i++) {
+    char name[PATH_MAX];
+    sprintf(name, "%03d.txt", i);
+    paths[i] = add_path_parts(i % 2 ? subdir : root, name);
+    char text[PATH_MAX];
+    sprintf(text, "asdfghjkl %d\n", i);
+    write_text_file(paths[i], text);
+  }
+  char *gzip_path = add_path_parts(subdir, "log.gz");
+  write_gzip_file(gzip_path, "asdfghjkl\n", 100);
+  char *checkpoint_path = add_path_parts(store, BUILD_CHECKPOINT_NAME);
+
+  // a signal stops the build after its first chunk, and the next resumes it
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, &old_signals);
+  kill(getpid(), SIGTERM);
+  mu_assert("Interrupted build indexed the wrong files",
+      build_index(&root, 1, store, 4) == BUILD_CHUNK_FILES);
+  sigprocmask(SIG_SETMASK, &old_signals, NULL);
+  mu_assert("No checkpoint left", access(checkpoint_path, F_OK) == 0);
+  mu_assert("Resumed build indexed the wrong files",
+      build_index(&root, 1, store, 4) == num_files + 1 - BUILD_CHUNK_FILES);
+  mu_assert("Checkpoint left", access(checkpoint_path, F_OK) != 0);
+  mu_assert("Indexed files indexed again",
+      build_index(&root, 1, store, 4) == 0);
+
+  char *index_strings[] = {"asdfg"};
+  struct intarray row = strings_to_sorted_indices(index_strings, 1);
+  struct intarrayarray filter = {.num_rows = 1, .rows = &row};
+  for (int i = 0; i < num_files; i++) {
+    mu_assert("Built file not indexed",
+        start_filter(filter, paths[i], store) == 1);
+    free(paths[i]);
+  }
+  mu_assert("Gzip file not indexed by content",
+      start_filter(filter, gzip_path, store) == 1);
+  // bitmaps go straight into packfiles, never into loose files
+  char index_subdir[PATH_MAX];
+  index_subdirectory_path(index_subdir, store, time(NULL));
+  mu_assert("Loose files written", count_loose_files(index_subdir) == 0);
+
+  free_intarray(row);
+  free(subdir);
+  free(gzip_path);
+  free(checkpoint_path);
+  return 0;
+}
+
+static char *test_stats() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  char *tmpfile_path = add_path_parts(tmpfile_dir, "1.txt");
+  write_text_file(tmpfile_path, "asdfghjkl\n");
+  char *index_strings[] = {"asdfg"};
+  struct intarray row = strings_to_sorted_indices(index_strings, 1);
+  struct intarrayarray filter = {.num_rows = 1, .rows = &row};
+
+  reset_stats();
+  mu_assert("Stats kept while disabled", stats_clock() == 0);
+  enable_stats(1);
+  mu_assert("Bitmap not created",
+      start_filter(filter, tmpfile_path, store) == 3);
+  mu_assert("Bitmap not found",
+      start_filter(filter, tmpfile_path, store) == 1);
+  // 1500ns lands in the [1024, 2048) bucket
+  record_stage_nsec(STAGE_GREP, 1500);
+  enable_stats(0);
+
+  char json[16384];
+  long len = stats_to_json(json, sizeof(json));
+  mu_assert("Stats not written", len > 0 && len < sizeof(json));
+  mu_assert("Truncated stats have the wrong length",
+      stats_to_json(json, 10) == len && strlen(json) == 9);
+  stats_to_json(json, sizeof(json));
+  mu_assert("Built bitmap not counted",
+      strstr(json, "\"bitmaps_built\": 1,") != NULL);
+  mu_assert("Loose hit not counted",
+      strstr(json, "\"loose_hits\": 1,") != NULL);
+  mu_assert("Filters not timed",
+      strstr(json, "\"filter\": {\"count\": 2,") != NULL);
+  mu_assert("Grep time not recorded",
+      strstr(json, "\"grep\": {\"count\": 1, \"total_ns\": 1500, "
+             "\"max_ns\": 1500, \"histogram_log2_ns\": [0, 0, 0, 0, 0, 0, 0, "
+             "0, 0, 0, 1, 0,") != NULL);
+
+  free_intarray(row);
+  free(tmpfile_path);
+  return 0;
+}
+
+static char *test_bitmap_density() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  char *tmpfile_path = add_path_parts(tmpfile_dir, "1.txt");
+  // ten characters, six distinct ngrams
+  write_text_file(tmpfile_path, "asdfghjkl\n");
+
+  mu_assert("Wrong density of a new bitmap",
+      get_bitmap_density(tmpfile_path, store) * POSSIBLE_NGRAMS == 6);
+  mu_assert("Wrong density of a stored bitmap",
+      get_bitmap_density(tmpfile_path, store) * POSSIBLE_NGRAMS == 6);
+  mu_assert("Density of a missing file",
+      get_bitmap_density("/tmp/nonexistent", store) == -1);
+
+  int ngram_chars, ngram_char_bits;
+  get_ngram_config(&ngram_chars, &ngram_char_bits);
+  mu_assert("Wrong ngram config",
+      ngram_chars == NGRAM_CHARS && ngram_char_bits == NGRAM_CHAR_BITS);
+
+  free(tmpfile_path);
+  return 0;
+}
+
+static char *test_saturated_bitmap() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char template2[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  char *tmpfile_dir = mkdtemp(template2);
+  mu_assert("Could not create tmpdir", store != NULL);
+  mu_assert("Could not create tmpdir", tmpfile_dir != NULL);
+  char *tmpfile_path = add_path_parts(tmpfile_dir, "1.txt");
+  uint8_t *bitmap = init_bitmap();
+  memset(bitmap, 0xff, SIZEOF_BITMAP / 4 * 3);
+
+  // stored as a record without compressed data
+  int ret = compress_to_file(bitmap, tmpfile_path, 1, store);
+  mu_assert("Error compressing", ret == 0);
+  DIR *dir = opendir(store);
+  mu_assert("Error opening bitmap store directory", dir != NULL);
+  char loose_path[PATH_MAX] = "";
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] != '.') {
+      snprintf(loose_path, sizeof(loose_path), "%s/%s", store, entry->d_name);
+    }
+  }
+  closedir(dir);
+  struct stat s;
+  mu_assert("Loose file not written", stat(loose_path, &s) == 0);
+  mu_assert("Saturated bitmap compressed", s.st_size == sizeof(uint16_t)
+      + strlen(tmpfile_path) + sizeof(int64_t) + sizeof(uint32_t));
+
+  // which reads back as all bits set, loose or packed
+  uint8_t *read_bitmap = init_bitmap();
+  mu_assert("Could not read loose file",
+      decompress_file(read_bitmap, loose_path) == 0);
+  mu_assert("Saturated bitmap read wrong",
+      count_set_bits(read_bitmap) == POSSIBLE_NGRAMS);
+  pack_loose_files_in_subdir(store);
+  free(read_bitmap);
+  read_bitmap = read_from_packfile(tmpfile_path, 1, store);
+  mu_assert("Could not find bitmap in packfile", read_bitmap != NULL);
+  mu_assert("Saturated bitmap read wrong from packfile",
+      count_set_bits(read_bitmap) == POSSIBLE_NGRAMS);
+
+  // a file dense with ngrams passes every filter once indexed
+  FILE *f = fopen(tmpfile_path, "w");
+  mu_assert("Could not create tmpfile", f != NULL);
+  srand(1);
+  for (int i = 0; i < 2 * 1024 * 1024; i++) {
+    fputc('a' + rand() % 16, f);
+  }
+  fclose(f);
+  char *index_strings[] = {"zzzzzzzzzzzz"};
+  struct intarray row = strings_to_sorted_indices(index_strings, 1);
+  struct intarrayarray filter = {.num_rows = 1, .rows = &row};
+  char template3[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store2 = mkdtemp(template3);
+  mu_assert("Could not create tmpdir", store2 != NULL);
+  start_filter(filter, tmpfile_path, store2);
+  mu_assert("Saturated bitmap filtered a file out",
+      start_filter(filter, tmpfile_path, store2) == 1);
+
+  free_intarray(row);
+  free(tmpfile_path);
+  free(bitmap);
+  free(read_bitmap);
   return 0;
 }
 
@@ -604,6 +1766,45 @@ static char *test_packfile_locking() {
   return 0;
 }
 
+static char *test_find_hash_in_index() {
+  int num_entries = 5000;
+  struct index_entry *index = malloc(num_entries * sizeof(*index));
+  srand(4);
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < num_entries; i++) {
+      uint64_t hash = ((uint64_t) rand() << 33) ^ ((uint64_t) rand() << 2);
+      if (pass == 1) {
+        // skewed hashes must still be found, just less quickly
+        hash = i < num_entries / 2 ? (uint64_t) i : hash;
+      }
+      if (i % 10 == 1) {
+        hash = index[i - 1].hash;
+      }
+      index[i].hash = hash;
+      index[i].packfile_offset = i;
+    }
+    qsort(index, num_entries, sizeof(*index), compare_index_entries);
+    for (int i = 0; i < num_entries; i++) {
+      size_t found = find_hash_in_index(index, num_entries, index[i].hash);
+      mu_assert("Hash not found in index",
+          found != -1 && index[found].hash == index[i].hash);
+      mu_assert("Not the first entry with the hash",
+          found == 0 || index[found - 1].hash != index[i].hash);
+      uint64_t missing = index[i].hash + 1;
+      if (i + 1 < num_entries && index[i + 1].hash != missing) {
+        mu_assert("Missing hash found in index",
+            find_hash_in_index(index, num_entries, missing) == -1);
+      }
+    }
+  }
+  mu_assert("Hash before index start found",
+      find_hash_in_index(index, num_entries, 0) == -1 || index[0].hash == 0);
+  mu_assert("Hash after index end found",
+      find_hash_in_index(index, num_entries, UINT64_MAX) == -1);
+  free(index);
+  return 0;
+}
+
 static char *test_get_4gram_indices() {
   char *strings[] = {
     "qwertyuiop",
@@ -657,38 +1858,187 @@ static char *test_corruption_size() {
   return 0;
 }
 
-static char *test_loose_file_locking() {
+static char *test_loose_file_publication() {
   uint8_t *bitmap = init_bitmap();
+  apply_string_to_bitmap(bitmap, "published whole");
   char *filename = "/tmp/nonexistent";
   char template[] = "/tmp/4gramtmpdir.XXXXXX";
   char *store = mkdtemp(template);
   mu_assert("Could not create tmpdir", store != NULL);
-  compress_to_file(bitmap, filename, 0, store);
+  mu_assert("compress_to_file failed",
+      compress_to_file(bitmap, filename, 0, store) == 0);
+  mu_assert("compress_to_file failed",
+      compress_to_file(bitmap, filename, 1, store) == 0);
 
   char hash[21];
   uint16_t len = strlen(filename);
   get_hash(filename, len, hash);
   char loose_file_name[PATH_MAX];
-  strcpy(loose_file_name, hash);
-  strcat(loose_file_name, "_000");
-  char *lockfile_path = get_lock_path(store, loose_file_name);
-  mu_assert("Could not lock file", lockfile_create(lockfile_path, 0, 0) == 0);
+  for (int i = 0; i < 2; i++) {
+    sprintf(loose_file_name, "%s_%.3d", hash, i);
+    char *loose_file_path = add_path_parts(store, loose_file_name);
+    FILE *f = fopen(loose_file_path, "r");
+    mu_assert("Loose file not published", f != NULL);
+    mu_assert("Published loose file is incomplete", is_corrupted(f) == 0);
+    fclose(f);
+    free(loose_file_path);
+  }
 
-  if (fork() == 0) {
-    pack_loose_files_in_subdir(store);
-    exit(0);
+  // neither lock files nor temporary files are left behind
+  DIR *dir = opendir(store);
+  mu_assert("Error opening bitmap store directory", dir != NULL);
+  struct dirent *entry;
+  int num_entries = 0;
+  while ((entry = readdir(dir))) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      num_entries++;
+    }
   }
-  int wait_status;
-  wait(&wait_status);
+  closedir(dir);
+  mu_assert("Files other than the loose files left", num_entries == 2);
+
+  // the pack run deletes temporary files abandoned by killed writers, but
+  // not those still being written, nor other dot files
+  char abandoned[PATH_MAX];
+  char fresh[PATH_MAX];
+  char other[PATH_MAX];
+  snprintf(abandoned, sizeof(abandoned), "%s/.%s.abcdef", store, hash);
+  snprintf(fresh, sizeof(fresh), "%s/.%s.ghijkl", store, hash);
+  snprintf(other, sizeof(other), "%s/.%s.abcdefg", store, hash);
+  fclose(fopen(abandoned, "w"));
+  fclose(fopen(fresh, "w"));
+  fclose(fopen(other, "w"));
+  time_t old = time(NULL) - LOOSE_TEMP_GRACE_SEC - 1;
+  struct timeval old_times[2] = {{old, 0}, {old, 0}};
+  utimes(abandoned, old_times);
+  utimes(other, old_times);
+  pack_loose_files_in_subdir(store);
+  mu_assert("Abandoned temporary file kept", access(abandoned, F_OK) != 0);
+  mu_assert("Temporary file deleted while written", access(fresh, F_OK) == 0);
+  mu_assert("Other dot file deleted", access(other, F_OK) == 0);
 
-  char *loose_file_path = add_path_parts(store, loose_file_name);
-  mu_assert("Loose file was packed despite lock",
-      access(loose_file_path, F_OK) == 0);
-  free(loose_file_path);
-  lockfile_remove(lockfile_path);
-  free(lockfile_path);
   free(bitmap);
+  return 0;
+}
+
+static char *test_loose_log() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  mu_assert("Could not create tmpdir", store != NULL);
+  char *names[] = {"/tmp/logged_0", "/tmp/logged_1", "/tmp/logged_2"};
+  uint8_t *bitmaps[3];
+  for (int i = 0; i < 3; i++) {
+    bitmaps[i] = init_bitmap();
+    apply_string_to_bitmap(bitmaps[i], names[i]);
+    mu_assert("append_to_loose_log failed",
+        append_to_loose_log(bitmaps[i], names[i], i, store) == 0);
+  }
+  mu_assert("Loose files written", count_loose_files(store) == 0);
+  mu_assert("Loose log not written", count_loose_logs(store) == 1);
+
+  // records can be read before they are packed
+  uint8_t *read_bitmap = init_bitmap();
+  for (int i = 0; i < 3; i++) {
+    mu_assert("Logged bitmap not found",
+        check_loose_files(names[i], i, read_bitmap, store) == 0);
+    mu_assert("Wrong logged bitmap returned",
+        memcmp(read_bitmap, bitmaps[i], SIZEOF_BITMAP) == 0);
+  }
+  mu_assert("Logged bitmap found for the wrong mtime",
+      check_loose_files(names[0], 5, read_bitmap, store) != 0);
+
+  // a record torn by a crash is dropped, but not those before it
+  DIR *dir = opendir(store);
+  mu_assert("Error opening bitmap store directory", dir != NULL);
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (strncmp(entry->d_name, LOOSE_LOG_PREFIX,
+                strlen(LOOSE_LOG_PREFIX)) == 0) {
+      char *log_path = add_path_parts(store, entry->d_name);
+      FILE *log = fopen(log_path, "a");
+      mu_assert("Could not open loose log", log != NULL);
+      uint32_t torn[3] = {htobe32(LOOSE_LOG_MAGIC), htobe32(100), 0};
+      fwrite(torn, sizeof(torn), 1, log);
+      fclose(log);
+      free(log_path);
+    }
+  }
+  closedir(dir);
+
+  mu_assert("pack_loose_files_in_subdir failed",
+      pack_loose_files_in_subdir(store) == 0);
+  mu_assert("Loose log not removed", count_loose_logs(store) == 0);
+  for (int i = 0; i < 3; i++) {
+    uint8_t *packed = read_from_packfile(names[i], i, store);
+    mu_assert("Logged bitmap not packed", packed != NULL);
+    mu_assert("Wrong packed bitmap returned",
+        memcmp(packed, bitmaps[i], SIZEOF_BITMAP) == 0);
+    free(packed);
+  }
+
+  // a log taken over while open is renamed aside on NFS, not unlinked, and
+  // later appends must move on to a new log rather than follow it there
+  mu_assert("append_to_loose_log failed",
+      append_to_loose_log(bitmaps[0], names[0], 10, store) == 0);
+  dir = opendir(store);
+  mu_assert("Error opening bitmap store directory", dir != NULL);
+  while ((entry = readdir(dir))) {
+    if (strncmp(entry->d_name, LOOSE_LOG_PREFIX,
+                strlen(LOOSE_LOG_PREFIX)) == 0) {
+      char *log_path = add_path_parts(store, entry->d_name);
+      char *hidden_path = add_path_parts(store, ".nfs0000000000000001");
+      mu_assert("Could not rename loose log",
+          rename(log_path, hidden_path) == 0);
+      free(hidden_path);
+      free(log_path);
+    }
+  }
+  closedir(dir);
+  mu_assert("append_to_loose_log failed",
+      append_to_loose_log(bitmaps[1], names[1], 11, store) == 0);
+  mu_assert("Append followed the renamed log", count_loose_logs(store) == 1);
+  mu_assert("pack_loose_files_in_subdir failed",
+      pack_loose_files_in_subdir(store) == 0);
+  uint8_t *packed = read_from_packfile(names[1], 11, store);
+  mu_assert("Bitmap appended after the rename not packed", packed != NULL);
+  free(packed);
+  for (int i = 0; i < 3; i++) {
+    free(bitmaps[i]);
+  }
+  free(read_bitmap);
+  return 0;
+}
 
+static char *test_write_behind() {
+  char template[] = "/tmp/4gramtmpdir.XXXXXX";
+  char *store = mkdtemp(template);
+  mu_assert("Could not create tmpdir", store != NULL);
+  // a queue shorter than the writes, so that some wait for room
+  enable_write_behind(2);
+  uint8_t *bitmap = init_bitmap();
+  char name[32];
+  for (int i = 0; i < 8; i++) {
+    sprintf(name, "/tmp/written_behind_%d", i);
+    apply_string_to_bitmap(bitmap, name);
+    mu_assert("store_bitmap failed", store_bitmap(bitmap, name, i, store) == 0);
+  }
+  // the bitmap is copied when queued, so the caller may reuse it
+  memset(bitmap, 0, SIZEOF_BITMAP);
+  flush_bitmap_writes();
+  mu_assert("Not every bitmap written", count_loose_files(store) == 8);
+
+  uint8_t *expected = init_bitmap();
+  for (int i = 0; i < 8; i++) {
+    sprintf(name, "/tmp/written_behind_%d", i);
+    apply_string_to_bitmap(expected, name);
+    mu_assert("Bitmap written behind not found",
+        check_loose_files(name, i, bitmap, store) == 0);
+    mu_assert("Wrong bitmap written behind",
+        memcmp(bitmap, expected, SIZEOF_BITMAP) == 0);
+  }
+  enable_write_behind(0);
+  free(expected);
+  free(bitmap);
   return 0;
 }
 
@@ -814,10 +2164,21 @@ static char *run_tests() {
   mu_run_test(test_compress_bitmap);
   mu_run_test(test_file_packing);
   mu_run_test(test_filter_checks);
+  mu_run_test(test_prefetch);
+  mu_run_test(test_uring_batches);
   mu_run_test(test_packfile_locking);
+  mu_run_test(test_indexer);
+  mu_run_test(test_service);
+  mu_run_test(test_build_index);
+  mu_run_test(test_stats);
+  mu_run_test(test_bitmap_density);
+  mu_run_test(test_saturated_bitmap);
+  mu_run_test(test_find_hash_in_index);
   mu_run_test(test_get_4gram_indices);
   mu_run_test(test_corruption_size);
-  mu_run_test(test_loose_file_locking);
+  mu_run_test(test_loose_file_publication);
+  mu_run_test(test_loose_log);
+  mu_run_test(test_write_behind);
   mu_run_test(test_strings_to_sorted_indices);
   mu_run_test(test_mtime);
   mu_run_test(test_get_index_subdirectory);
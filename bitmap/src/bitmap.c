@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -9,19 +12,19 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
-#include <lockfile.h>
+#include <ctype.h>
+#include <time.h>
 
 #include "bitmap.h"
 #include "xxhash.h"
 #include "util.h"
+#include "snapshot.h"
+#include "dict.h"
+#include "stats.h"
 #include "portable_endian.h"
 
 /*--------------------------------------------------------------------*/
 
-#define ESTIMATED_ZSTD_SIZE (ZSTD_compressBound(SIZEOF_BITMAP))
-
-/*--------------------------------------------------------------------*/
-
 /**
  * Initalizes memory for bitmap
  */
@@ -48,50 +51,64 @@ uint8_t get_bit(uint8_t *bitmap, int bit_index) {
 
 /*--------------------------------------------------------------------*/
 
-void write_bitmap(uint8_t *bitmap, FILE *file){
-  fwrite(bitmap, 1, SIZEOF_BITMAP, file);
+uint64_t count_set_bits(uint8_t *bitmap) {
+  uint64_t set_bits = 0;
+  for (size_t i = 0; i < SIZEOF_BITMAP; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bitmap + i, sizeof(word));
+    set_bits += __builtin_popcountll(word);
+  }
+  return set_bits;
 }
 
 /*--------------------------------------------------------------------*/
 
-char *get_lock_path(char *directory, char *filename) {
-  char lock_filename[PATH_MAX];
-  sprintf(lock_filename, ".%s.lock", filename);
-  return add_path_parts(directory, lock_filename);
+void write_bitmap(uint8_t *bitmap, FILE *file){
+  fwrite(bitmap, 1, SIZEOF_BITMAP, file);
 }
 
 /*--------------------------------------------------------------------*/
 
 /**
- * Finds the first path of the form "directory/filename_XXX" that doesn't
- * already exist, counting up from 000 to 999.
+ * Gives the complete loose file open at fd the first name of the form
+ * "directory/filename_XXX" that doesn't already exist, counting up from 000
+ * to 999. fd is either an O_TMPFILE without a name, or the file at temp_path.
  *
- * When found, it creates a new file with mode 0666 and returns a file
- * descriptor.
+ * Linking never replaces an existing file, so writers racing for a name each
+ * end up with their own, and readers only ever see loose files whole.
+ *
+ * Returns 0 and stores the name in filename, or -1 on error.
  */
-int available_name(char *filename, char *directory){
-  char tmp[21];
-  int i = 0;
+static int link_available_name(int fd, char *temp_path, char *filename,
+    char *directory) {
+  char tmp[LOOSE_NAME_MAX];
+  char fd_path[32];
+  sprintf(fd_path, "/proc/self/fd/%d", fd);
   //Max hash collision will be _999
-  while(i < 1000){
-    sprintf(tmp, "%s_%.3d", filename, i);
+  for (int i = 0; i < 1000; i++) {
+    if (snprintf(tmp, sizeof(tmp), "%s_%.3d", filename, i) >= sizeof(tmp)) {
+      fprintf(stderr, "Error: Loose file name too long: %s\n", filename);
+      return -1;
+    }
     char *full_path = add_path_parts(directory, tmp);
-    int fd = open(full_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    int ret;
+    if (temp_path[0] != '\0') {
+      ret = link(temp_path, full_path);
+    } else {
+      ret = linkat(AT_FDCWD, fd_path, AT_FDCWD, full_path, AT_SYMLINK_FOLLOW);
+    }
     free(full_path);
-    if(fd != -1) {//exists
-      char *lock_path = get_lock_path(directory, tmp);
-      int a = lockfile_create(lock_path, 0, 0);
-      free(lock_path);
-      if(a != 0){
-        i++;
-        continue;
-      }
+    if (ret == 0) {
       strcpy(filename, tmp);
-      return fd;
+      return 0;
+    }
+    if (errno != EEXIST) {
+      perrorf("Error: Loose file not linked: %s", tmp);
+      return -1;
     }
-    i++;
   }
-  return(-1);
+  fprintf(stderr, "Error: No loose file name left for %s\n", filename);
+  return -1;
 }
 
 /*--------------------------------------------------------------------*/
@@ -101,17 +118,12 @@ int available_name(char *filename, char *directory){
  * in hash_hex_str
  */
 int get_hash(char *filename, size_t len, char *hash_hex_str){
-  XXH64_canonical_t* dst = malloc(sizeof(XXH64_canonical_t));
-  if (dst == NULL){
-    perror("Error: Memory not allocated");
-    return(-1);
-  }
+  XXH64_canonical_t dst;
   uint64_t hashed = XXH64(filename, len, HASH_SEED);
-  XXH64_canonicalFromHash(dst, hashed);
+  XXH64_canonicalFromHash(&dst, hashed);
   for(int i = 0; i < 8; i++){
-    sprintf((hash_hex_str+2*i), "%02X", dst->digest[i]);
+    sprintf((hash_hex_str+2*i), "%02X", dst.digest[i]);
   }
-  free(dst);
   return 0;
 }
 
@@ -160,12 +172,20 @@ int decompress_file(uint8_t *decompressed, char *full_path){
   }
   compressed_size = be32toh(compressed_size);
   char stream[compressed_size+1];
-  if (fread(&stream, compressed_size, 1, f) != 1){
+  if (compressed_size > 0 && fread(&stream, compressed_size, 1, f) != 1){
     perrorf("Error in reading decompressed file: %s", full_path);
     goto OUT1;
   }
-  size_t decompressed_size = ZSTD_decompress(decompressed, SIZEOF_BITMAP,
-                                             stream,compressed_size);
+  // the dictionary, if the frame needs one, is that of the loose file's
+  // index directory
+  char directory[PATH_MAX];
+  snprintf(directory, sizeof(directory), "%s", full_path);
+  char *slash = strrchr(directory, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+  }
+  size_t decompressed_size = decompress_bitmap(decompressed, stream,
+      compressed_size, slash != NULL ? directory : ".");
   if(ZSTD_isError(decompressed_size) == 1){
     perrorf("Error in decompression of %s: %s",
             full_path, ZSTD_getErrorName(decompressed_size));
@@ -185,24 +205,29 @@ int decompress_file(uint8_t *decompressed, char *full_path){
  * Compresses the bitmap into the file described by fp using ZSTD
  * The original filename's length is stored followed by the filename, followed
  * by the compressed size, followed by the actual compressed data.
+ * The bitmap is compressed with the dictionary of indexdir if it has one; pass
+ * NULL for indexdir to compress without a dictionary. A saturated bitmap is
+ * not compressed at all: its record has a compressed size of 0.
  */
 int compress_to_fp(uint8_t *bitmap, FILE *fp, char *orig_filename,
-    int64_t mtime) {
+    int64_t mtime, char *indexdir) {
   uint16_t len = strlen(orig_filename);
-  void* compressed = malloc(ESTIMATED_ZSTD_SIZE);
+  void* compressed = get_compression_buffer();
   int ret_val = -1;
   if (compressed == NULL){
   	perror("Error: Memory not allocated");
     return ret_val;
   }
 
-  uint32_t compressed_size = ZSTD_compress(compressed, ESTIMATED_ZSTD_SIZE,
-                                           bitmap, SIZEOF_BITMAP, 8);
-
-  if(ZSTD_isError(compressed_size) == 1) {
-  	perror("Error in compression");
+  size_t ret = 0;
+  if (count_set_bits(bitmap) < SATURATED_BITS) {
+    ret = compress_bitmap(compressed, ESTIMATED_ZSTD_SIZE, bitmap, indexdir);
+  }
+  if(ZSTD_isError(ret) == 1) {
+    fprintf(stderr, "Error in compression: %s\n", ZSTD_getErrorName(ret));
     goto OUT2;
   }
+  uint32_t compressed_size = ret;
   uint16_t len_be = htobe16(len);
   if (fwrite(&len_be, sizeof(uint16_t), 1, fp) != 1){
     goto OUT2;
@@ -221,7 +246,7 @@ int compress_to_fp(uint8_t *bitmap, FILE *fp, char *orig_filename,
     perror("Error: Compressed size not written");
     goto OUT2;
   }
-  if (fwrite(compressed, compressed_size, 1, fp) != 1){
+  if (compressed_size > 0 && fwrite(compressed, compressed_size, 1, fp) != 1){
     perror("Error: Compressed file not written");
     goto OUT2;
   }
@@ -229,7 +254,6 @@ int compress_to_fp(uint8_t *bitmap, FILE *fp, char *orig_filename,
   goto OUT2;
 
   OUT2:
-    free(compressed);
     return ret_val;
 }
 
@@ -238,27 +262,107 @@ int compress_to_fp(uint8_t *bitmap, FILE *fp, char *orig_filename,
 /**
  * Function will compress the bitmap into a loosefile which is
  * named after the filename's hash and number of occurences.
+ *
+ * The loose file is written without a name, or under a dot-prefixed temporary
+ * one where O_TMPFILE isn't supported, and only linked into place once it is
+ * complete, so readers need no locks to skip half-written files. A writer
+ * killed meanwhile leaves the temporary file behind for
+ * delete_abandoned_loose_files.
  */
 int compress_to_file(uint8_t *bitmap, char *filename, int64_t mtime,
     char *indexdir) {
-  char hashed_filename[21], lock[27];
+  char hashed_filename[LOOSE_NAME_MAX];
+  char temp_path[PATH_MAX] = "";
+  int ret = -1;
   uint16_t len = strlen(filename);
   get_hash(filename, len, hashed_filename);
-  int fd = available_name(hashed_filename, indexdir);
+  int fd = -1;
+#ifdef O_TMPFILE
+  fd = open(indexdir, O_TMPFILE | O_WRONLY, 0666);
+#endif
+  if (fd == -1) {
+    snprintf(temp_path, sizeof(temp_path), "%s/.%s.XXXXXX", indexdir,
+             hashed_filename);
+    fd = mkstemp(temp_path);
+    if (fd == -1) {
+      perrorf("Error: File not opened: %s", temp_path);
+      return -1;
+    }
+    // mkstemp creates files only the owner can read
+    fchmod(fd, 0644);
+  }
   FILE *fp = fdopen(fd, "wb");
   if(fp == NULL) {
     perrorf("Error: File not opened: %s", hashed_filename);
-    return(-1);
+    close(fd);
+    goto OUT;
+  }
+  ret = compress_to_fp(bitmap, fp, filename, mtime, indexdir);
+  if (ret == 0 && (fflush(fp) != 0 || fsync(fd) != 0)) {
+    perrorf("Error: Loose file not written: %s", hashed_filename);
+    ret = -1;
+  }
+  if (ret == 0) {
+    ret = link_available_name(fd, temp_path, hashed_filename, indexdir);
+  }
+  if (ret == 0) {
+    note_loose_file(indexdir, hashed_filename);
   }
-  int ret = compress_to_fp(bitmap, fp, filename, mtime);
-  fflush(fp);
-  fsync(fd);
   fclose(fp);
-  sprintf(lock, ".%s.lock", hashed_filename);
-  char *lock_path = add_path_parts(indexdir, lock);
-  lockfile_remove(lock_path);
-  free(lock_path);
-  return ret;
+
+  OUT:
+    if (temp_path[0] != '\0') {
+      unlink(temp_path);
+    }
+    return ret;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns 1 if name is a temporary name compress_to_file writes a loose file
+ * under: "." followed by the 16 hex digits of the hash, "." and the 6
+ * characters mkstemp fills in.
+ */
+static int is_loose_temp_name(const char *name) {
+  if (name[0] != '.' || strlen(name) != 1 + 16 + 1 + 6 || name[17] != '.') {
+    return 0;
+  }
+  for (int i = 1; i <= 16; i++) {
+    if (!isxdigit((unsigned char) name[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Removes the temporary loose files in indexdir that writers killed before
+ * linking them into place left behind, once LOOSE_TEMP_GRACE_SEC has passed
+ * since they were last written to. Called by the pack run, which visits every
+ * index subdirectory.
+ */
+void delete_abandoned_loose_files(char *indexdir) {
+  DIR *dir = opendir(indexdir);
+  if (dir == NULL) {
+    return;
+  }
+  time_t now = time(NULL);
+  char path[PATH_MAX];
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (!is_loose_temp_name(entry->d_name)) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", indexdir, entry->d_name);
+    struct stat s;
+    if (stat(path, &s) == 0 && now - s.st_mtime >= LOOSE_TEMP_GRACE_SEC) {
+      unlink(path);
+    }
+  }
+  closedir(dir);
 }
 
 /*--------------------------------------------------------------------*/
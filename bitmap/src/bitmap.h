@@ -8,22 +8,58 @@
 
 /*--------------------------------------------------------------------*/
 
+/* needs zstd.h and util.h; large enough for any compressed bitmap */
+#define ESTIMATED_ZSTD_SIZE (ZSTD_compressBound(SIZEOF_BITMAP))
+
+/*
+ * Bitmaps with at least this many of their bits set filter out almost
+ * nothing, so they are stored as a record with no compressed data, which
+ * reads back as all bits set
+ */
+#define SATURATED_BITS (POSSIBLE_NGRAMS / 100 * 60)
+
+/*
+ * Longest loose file name, including the terminating null byte: the 16 hex
+ * digits of the hash, "_" and a 3 digit suffix
+ */
+#define LOOSE_NAME_MAX (16 + 1 + 3 + 1)
+
+/*
+ * A loose file is written under a temporary name ".<hash>.XXXXXX" where
+ * O_TMPFILE isn't supported; the pack run deletes those left behind by
+ * killed writers once they have not been written to for this long
+ */
+#define LOOSE_TEMP_GRACE_SEC (10 * 60)
+
+/*--------------------------------------------------------------------*/
+
 uint8_t *init_bitmap();
 
 void set_bit(uint8_t *bitmap, int bit_index);
 
 uint8_t get_bit(uint8_t *bitmap, int bit_index);
 
+uint64_t count_set_bits(uint8_t *bitmap);
+
 void write_bitmap(uint8_t *bitmap, FILE *file);
 
 int get_hash(char *filename, size_t len, char *hash_hex_str);
 
 int decompress_file(uint8_t *decompressed, char *full_path);
 
-int compress_to_fp(uint8_t *bitmap, FILE *fp, char *orig_filename, int64_t mtime);
+int compress_to_fp(uint8_t *bitmap, FILE *fp, char *orig_filename, int64_t mtime,
+    char *indexdir);
 
 int compress_to_file(uint8_t *bitmap, char *filename, int64_t mtime, char *indexdir);
 
+void delete_abandoned_loose_files(char *indexdir);
+
+int apply_to_bitmap_bmi2(uint8_t *bitmap, char *buf, int len, int n);
+
+int apply_to_bitmap_slow(uint8_t *bitmap, char *buf, int len, int n);
+
+int apply_to_bitmap(uint8_t *bitmap, char *buf, int len, int n);
+
 int apply_file_to_bitmap(uint8_t *bitmap, FILE *f);
 
 uint8_t *b_or_b(uint8_t *bitmap1, uint8_t *bitmap2);
@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bloom.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * A blocked bloom filter over 64-bit xxhash values.
+ *
+ * All bits for a key fall in the same cache line, so answering a query
+ * touches a single line of the filter. The keys are already uniform hashes,
+ * so the block comes from the high half of the hash and the bit positions
+ * from a bijective remix of it.
+ */
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns how many blocks a filter over num_keys keys should have.
+ */
+uint64_t bloom_num_blocks(size_t num_keys) {
+  uint64_t bits = (uint64_t) num_keys * BLOOM_BITS_PER_KEY;
+  uint64_t blocks = (bits + BLOOM_BLOCK_BYTES * 8 - 1) / (BLOOM_BLOCK_BYTES * 8);
+  return blocks > 0 ? blocks : 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+static const uint8_t *block_for(const uint8_t *blocks, uint64_t num_blocks,
+    uint64_t hash) {
+  // maps the high 32 bits onto [0, num_blocks) without a division
+  uint64_t block = ((hash >> 32) * num_blocks) >> 32;
+  return blocks + block * BLOOM_BLOCK_BYTES;
+}
+
+/*--------------------------------------------------------------------*/
+
+static uint64_t probe_bits(uint64_t hash) {
+  return hash * 0x9e3779b97f4a7c15ULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Sets the bits for hash in the filter.
+ */
+void bloom_add(uint8_t *blocks, uint64_t num_blocks, uint64_t hash) {
+  uint8_t *block = (uint8_t *) block_for(blocks, num_blocks, hash);
+  uint64_t bits = probe_bits(hash);
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    unsigned bit = bits & (BLOOM_BLOCK_BYTES * 8 - 1);
+    block[bit / 8] |= 1 << (bit % 8);
+    bits >>= 9;
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns 0 if hash was certainly never added to the filter, 1 if it may
+ * have been.
+ */
+int bloom_may_contain(const uint8_t *blocks, uint64_t num_blocks,
+    uint64_t hash) {
+  const uint8_t *block = block_for(blocks, num_blocks, hash);
+  uint64_t bits = probe_bits(hash);
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    unsigned bit = bits & (BLOOM_BLOCK_BYTES * 8 - 1);
+    if ((block[bit / 8] & (1 << (bit % 8))) == 0) {
+      return 0;
+    }
+    bits >>= 9;
+  }
+  return 1;
+}
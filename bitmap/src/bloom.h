@@ -0,0 +1,29 @@
+#ifndef BLOOM_INCLUDED
+#define BLOOM_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*--------------------------------------------------------------------*/
+
+/* each key sets BLOOM_PROBES bits inside one 64-byte block */
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_PROBES 7
+
+/* filter size per key; 10 bits gives about a 1% false positive rate */
+#define BLOOM_BITS_PER_KEY 10
+
+/*--------------------------------------------------------------------*/
+
+uint64_t bloom_num_blocks(size_t num_keys);
+
+void bloom_add(uint8_t *blocks, uint64_t num_blocks, uint64_t hash);
+
+int bloom_may_contain(const uint8_t *blocks, uint64_t num_blocks,
+    uint64_t hash);
+
+/*--------------------------------------------------------------------*/
+
+#endif
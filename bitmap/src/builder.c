@@ -0,0 +1,599 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <lockfile.h>
+
+#include "builder.h"
+#include "bitmap.h"
+#include "filter.h"
+#include "packfile.h"
+#include "content.h"
+#include "dict.h"
+#include "stats.h"
+#include "util.h"
+#include "xxhash.h"
+#include "portable_endian.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * Builds the index for whole directory trees up front, instead of letting
+ * searches index files one at a time.
+ *
+ * The inputs are walked and their files sorted by path, then indexed in chunks
+ * of BUILD_CHUNK_FILES on num_threads threads. Files whose bitmap the index
+ * already holds are skipped after a lookup of the packed record header. The
+ * new bitmaps are appended straight to the packfiles of their index
+ * subdirectories, a chunk at a time under each packfile's lock, and added to
+ * the index as one new segment per chunk, so no loose files or per-bitmap lock
+ * files are ever written.
+ *
+ * After each chunk the last path committed is written to a checkpoint in the
+ * index directory, together with a fingerprint of the inputs. A build of the
+ * same inputs that finds the checkpoint starts after that path. Files added
+ * meanwhile that sort before it are left for searches to index.
+ */
+
+/*--------------------------------------------------------------------*/
+
+struct path_list {
+  char **paths;
+  size_t num_paths;
+  size_t capacity;
+};
+
+/**
+ * The bitmap record built for one file of a chunk, stored under name in the
+ * index subdirectory subdir. record is NULL if the file was skipped.
+ */
+struct build_result {
+  char *subdir;
+  char *name;
+  uint8_t *record;
+  size_t record_len;
+};
+
+struct build_worker_args {
+  char **paths;
+  struct build_result *results;
+  int num_files;
+  int first;
+  int stride;
+  char *indexdir;
+};
+
+/*--------------------------------------------------------------------*/
+
+static int add_path(struct path_list *list, char *path) {
+  if (list->num_paths == list->capacity) {
+    size_t capacity = list->capacity ? 2 * list->capacity : 1024;
+    char **paths = realloc(list->paths, capacity * sizeof(char *));
+    if (paths == NULL) {
+      perror("Error: Memory not allocated");
+      return -1;
+    }
+    list->paths = paths;
+    list->capacity = capacity;
+  }
+  list->paths[list->num_paths] = strdup(path);
+  if (list->paths[list->num_paths] == NULL) {
+    perror("Error: Memory not allocated");
+    return -1;
+  }
+  list->num_paths++;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void free_path_list(struct path_list *list) {
+  for (size_t i = 0; i < list->num_paths; i++) {
+    free(list->paths[i]);
+  }
+  free(list->paths);
+}
+
+/*--------------------------------------------------------------------*/
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Adds the regular files at path, or in the tree under it, to list. path must
+ * be a real path, so the paths added are too. Symbolic links to directories
+ * and the index directory itself are not followed.
+ *
+ * Returns 0 upon success, -1 on error.
+ */
+static int walk_path(struct path_list *list, char *path, char *indexdir) {
+  struct stat s;
+  if (lstat(path, &s) != 0) {
+    return 0;
+  }
+  if (S_ISLNK(s.st_mode)) {
+    // files are named by their real path, as searches name them
+    char real_path[PATH_MAX];
+    if (stat(path, &s) == 0 && S_ISREG(s.st_mode)
+        && realpath(path, real_path) != NULL) {
+      return add_path(list, real_path);
+    }
+    return 0;
+  }
+  if (S_ISREG(s.st_mode)) {
+    return add_path(list, path);
+  }
+  if (!S_ISDIR(s.st_mode) || strcmp(path, indexdir) == 0) {
+    return 0;
+  }
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    perrorf("Error in opening directory: %s", path);
+    return 0;
+  }
+  int ret_val = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char child[PATH_MAX];
+    if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name)
+        >= sizeof(child)) {
+      continue;
+    }
+    if (walk_path(list, child, indexdir) != 0) {
+      ret_val = -1;
+      break;
+    }
+  }
+  closedir(dir);
+  return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Builds the bitmap record of the file at path into result, unless the index
+ * already holds its bitmap. Gzip files are stored by content, as
+ * get_bitmap_for_file stores them.
+ */
+static void build_file(char *path, char *indexdir, uint8_t *bitmap,
+    struct build_result *result) {
+  struct stat s;
+  if (stat(path, &s) != 0 || !S_ISREG(s.st_mode)) {
+    return;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != EACCES) {
+      perrorf("Could not open file %s", path);
+    }
+    return;
+  }
+  char subdir[PATH_MAX];
+  char content_name[CONTENT_NAME_MAX];
+  char *name = path;
+  int64_t mtime = s.st_mtime;
+  if (gzip_content_name(fd, content_name) == 0) {
+    content_subdirectory_path(subdir, indexdir, mtime);
+    name = content_name;
+    mtime = 0;
+  } else {
+    index_subdirectory_path(subdir, indexdir, mtime);
+  }
+  if (check_loose_files(name, mtime, bitmap, subdir) == 0
+      || read_from_packfile_into(NULL, name, mtime, subdir) == 0) {
+    close(fd);
+    return;
+  }
+
+  FILE *file = fdopen(fd, "r");
+  if (file == NULL) {
+    perrorf("Could not open file %s", path);
+    close(fd);
+    return;
+  }
+  memset(bitmap, 0, SIZEOF_BITMAP);
+  int ret = apply_file_to_bitmap(bitmap, file);
+  fclose(file);
+  if (ret != 0) {
+    return;
+  }
+  // the bitmap is compressed with the subdirectory's dictionary, if any
+  FILE *record = open_memstream((char **) &result->record,
+                                &result->record_len);
+  if (record == NULL) {
+    perror("Error: Memory not allocated");
+    return;
+  }
+  ret = compress_to_fp(bitmap, record, name, mtime, subdir);
+  fclose(record);
+  result->subdir = strdup(subdir);
+  result->name = strdup(name);
+  if (ret != 0 || result->subdir == NULL || result->name == NULL) {
+    free(result->record);
+    result->record = NULL;
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *build_worker(void *arg) {
+  struct build_worker_args *args = arg;
+  uint8_t *bitmap = init_bitmap();
+  if (bitmap == NULL) {
+    return NULL;
+  }
+  for (int i = args->first; i < args->num_files; i += args->stride) {
+    build_file(args->paths[i], args->indexdir, bitmap, &args->results[i]);
+  }
+  free(bitmap);
+  return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Appends the records of results stored in subdir to its packfile and adds
+ * them to its index as one segment, training the subdirectory's dictionary
+ * from them if it has none yet. Later records for a name already appended
+ * are dropped.
+ *
+ * Returns the number of records added, or -1 on error.
+ */
+static long pack_results_in_subdir(char *subdir, struct build_result *results,
+    int num_results) {
+  long ret_val = -1;
+  // a content subdirectory sits within its month's subdirectory
+  char parent[PATH_MAX];
+  snprintf(parent, sizeof(parent), "%s", subdir);
+  mkdir(dirname(parent), 0777);
+  mkdir(subdir, 0777);
+  char *packfile_path = add_path_parts(subdir, PACKFILE_NAME);
+  char *lock_path = add_path_parts(subdir, PACKFILE_LOCK_NAME);
+  create_file_if_nonexistent(packfile_path);
+  struct index_entry *entries = malloc(num_results * sizeof(*entries));
+  if (entries == NULL) {
+    perror("Error: Memory not allocated");
+    goto OUT2;
+  }
+  uint64_t start = stats_clock();
+  int locked = lockfile_create(lock_path, BUILD_LOCK_RETRIES, 0);
+  add_stage_time(STAGE_LOCK_WAIT, start);
+  if (locked != 0) {
+    fprintf(stderr, "Error: could not lock packfile in %s\n", subdir);
+    goto OUT2;
+  }
+  FILE *packfile = fopen(packfile_path, "a");
+  if (packfile == NULL) {
+    perror("Error opening packfile");
+    goto OUT1;
+  }
+  struct dict_samples samples = {0};
+  int train = needs_dict(subdir);
+  int num_entries = 0;
+  for (int i = 0; i < num_results; i++) {
+    struct build_result *result = &results[i];
+    if (result->record == NULL || strcmp(result->subdir, subdir) != 0) {
+      continue;
+    }
+    int duplicate = 0;
+    for (int j = 0; j < i && !duplicate; j++) {
+      duplicate = results[j].record != NULL
+        && strcmp(results[j].subdir, subdir) == 0
+        && strcmp(results[j].name, result->name) == 0;
+    }
+    if (duplicate) {
+      continue;
+    }
+    long offset = write_data_to_packfile(result->record, result->record_len,
+                                         packfile);
+    if (offset < 0) {
+      continue;
+    }
+    entries[num_entries].hash = XXH64(result->name, strlen(result->name),
+                                      HASH_SEED);
+    entries[num_entries].packfile_offset = htobe64(offset);
+    num_entries++;
+    if (train) {
+      add_dict_sample(&samples, result->record, result->record_len);
+    }
+  }
+  if (train) {
+    train_dict(subdir, &samples);
+    free_dict_samples(&samples);
+  }
+  fflush(packfile);
+  fsync(fileno(packfile));
+  fclose(packfile);
+  if (num_entries == 0
+      || add_entries_to_index(entries, num_entries, subdir) == 0) {
+    ret_val = num_entries;
+  }
+
+  OUT1:
+    lockfile_remove(lock_path);
+  OUT2:
+    free(entries);
+    free(lock_path);
+    free(packfile_path);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Indexes the files at paths on num_threads threads and commits their
+ * bitmaps to the packfiles.
+ *
+ * Returns the number of files indexed, or -1 on error.
+ */
+static long build_chunk(char **paths, int num_files, char *indexdir,
+    int num_threads) {
+  long ret_val = -1;
+  struct build_result *results = calloc(num_files, sizeof(*results));
+  if (results == NULL) {
+    perror("Error: Memory not allocated");
+    return ret_val;
+  }
+  if (num_threads > num_files) {
+    num_threads = num_files;
+  }
+  pthread_t threads[num_threads];
+  struct build_worker_args args[num_threads];
+  int num_started = 0;
+  for (; num_started < num_threads; num_started++) {
+    args[num_started] = (struct build_worker_args) {
+      .paths = paths,
+      .results = results,
+      .num_files = num_files,
+      .first = num_started,
+      .stride = num_threads,
+      .indexdir = indexdir,
+    };
+    if (pthread_create(&threads[num_started], NULL, build_worker,
+                       &args[num_started]) != 0) {
+      perror("Error starting build thread");
+      break;
+    }
+  }
+  for (int t = 0; t < num_started; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  if (num_started < num_threads) {
+    goto OUT1;
+  }
+
+  ret_val = 0;
+  for (int i = 0; i < num_files; i++) {
+    if (results[i].record == NULL) {
+      continue;
+    }
+    // the first record of each subdirectory commits all of its records
+    int first_in_subdir = 1;
+    for (int j = 0; j < i && first_in_subdir; j++) {
+      first_in_subdir = results[j].record == NULL
+        || strcmp(results[j].subdir, results[i].subdir) != 0;
+    }
+    if (!first_in_subdir) {
+      continue;
+    }
+    long added = pack_results_in_subdir(results[i].subdir, results,
+                                        num_files);
+    if (added < 0) {
+      ret_val = -1;
+      goto OUT1;
+    }
+    ret_val += added;
+  }
+
+  OUT1:
+    for (int i = 0; i < num_files; i++) {
+      free(results[i].subdir);
+      free(results[i].name);
+      free(results[i].record);
+    }
+    free(results);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns a fingerprint of the sorted, resolved inputs of a build.
+ */
+static uint64_t fingerprint_inputs(struct path_list *inputs) {
+  uint64_t hash = HASH_SEED;
+  for (size_t i = 0; i < inputs->num_paths; i++) {
+    hash = XXH64(inputs->paths[i], strlen(inputs->paths[i]) + 1, hash);
+  }
+  return hash;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the checkpoint in indexdir into last_path if it was written by a build
+ * of the inputs with the given fingerprint.
+ *
+ * Returns 0 if it was, -1 otherwise.
+ */
+static int read_checkpoint(char *indexdir, uint64_t fingerprint,
+    char *last_path) {
+  char *path = add_path_parts(indexdir, BUILD_CHECKPOINT_NAME);
+  FILE *f = fopen(path, "r");
+  free(path);
+  if (f == NULL) {
+    return -1;
+  }
+  int ret_val = -1;
+  uint64_t saved;
+  if (fscanf(f, "%" SCNx64 "\n", &saved) == 1 && saved == fingerprint
+      && fgets(last_path, PATH_MAX, f) != NULL) {
+    last_path[strcspn(last_path, "\n")] = '\0';
+    ret_val = 0;
+  }
+  fclose(f);
+  return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Records that every path up to and including last_path has been committed.
+ */
+static int write_checkpoint(char *indexdir, uint64_t fingerprint,
+    char *last_path) {
+  char *tmp_path = add_path_parts(indexdir, TEMP_BUILD_CHECKPOINT_NAME);
+  char *path = add_path_parts(indexdir, BUILD_CHECKPOINT_NAME);
+  int ret_val = -1;
+  FILE *f = fopen(tmp_path, "w");
+  if (f == NULL) {
+    perrorf("Error writing checkpoint %s", tmp_path);
+    goto OUT1;
+  }
+  fprintf(f, "%016" PRIx64 "\n%s\n", fingerprint, last_path);
+  if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+    perrorf("Error writing checkpoint %s", path);
+    goto OUT1;
+  }
+  ret_val = 0;
+
+  OUT1:
+    free(tmp_path);
+    free(path);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Indexes every file in the inputs, files or directory trees, into indexdir on
+ * num_threads threads, resuming an interrupted build of the same inputs from
+ * its checkpoint.
+ *
+ * SIGINT and SIGTERM are blocked during the build; on either, it stops after
+ * committing the current chunk, leaving the checkpoint to resume from.
+ *
+ * Returns the number of files indexed, or -1 on error.
+ */
+long build_index(char **inputs, int num_inputs, char *indexdir,
+    int num_threads) {
+  long ret_val = -1;
+  char real_indexdir[PATH_MAX];
+  if (realpath(indexdir, real_indexdir) == NULL) {
+    perrorf("Error resolving index directory %s", indexdir);
+    return ret_val;
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  mode_t old_umask = umask(0);
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+  struct path_list roots = {0};
+  struct path_list files = {0};
+  for (int i = 0; i < num_inputs; i++) {
+    char root[PATH_MAX];
+    if (realpath(inputs[i], root) == NULL) {
+      perrorf("Error resolving %s", inputs[i]);
+      continue;
+    }
+    if (add_path(&roots, root) != 0) {
+      goto OUT1;
+    }
+  }
+  qsort(roots.paths, roots.num_paths, sizeof(char *), compare_paths);
+  uint64_t fingerprint = fingerprint_inputs(&roots);
+  for (size_t i = 0; i < roots.num_paths; i++) {
+    if (walk_path(&files, roots.paths[i], real_indexdir) != 0) {
+      goto OUT1;
+    }
+  }
+  qsort(files.paths, files.num_paths, sizeof(char *), compare_paths);
+
+  size_t start = 0;
+  char last_path[PATH_MAX];
+  if (read_checkpoint(real_indexdir, fingerprint, last_path) == 0) {
+    size_t low = 0, high = files.num_paths;
+    while (low < high) {
+      size_t mid = low + (high - low) / 2;
+      if (strcmp(files.paths[mid], last_path) <= 0) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    start = low;
+    fprintf(stderr, "Resuming build after %s\n", last_path);
+  }
+
+  long num_indexed = 0;
+  time_t last_progress = time(NULL);
+  int interrupted = 0;
+  for (size_t i = start; i < files.num_paths; i += BUILD_CHUNK_FILES) {
+    int num_files = files.num_paths - i < BUILD_CHUNK_FILES
+      ? files.num_paths - i : BUILD_CHUNK_FILES;
+    long indexed = build_chunk(files.paths + i, num_files, real_indexdir,
+                               num_threads);
+    if (indexed < 0) {
+      goto OUT1;
+    }
+    num_indexed += indexed;
+    if (write_checkpoint(real_indexdir, fingerprint,
+                         files.paths[i + num_files - 1]) != 0) {
+      goto OUT1;
+    }
+    time_t now = time(NULL);
+    if (now >= last_progress + BUILD_PROGRESS_SEC) {
+      fprintf(stderr, "Checked %zu of %zu files, indexed %ld\n",
+              i + num_files, files.num_paths, num_indexed);
+      last_progress = now;
+    }
+    struct timespec no_wait = {0, 0};
+    if (sigtimedwait(&signals, NULL, &no_wait) > 0) {
+      interrupted = 1;
+      break;
+    }
+  }
+  if (interrupted) {
+    fprintf(stderr, "Build interrupted, run it again to resume\n");
+  } else {
+    // a signal after the last chunk comes too late to stop anything
+    struct timespec no_wait = {0, 0};
+    while (sigtimedwait(&signals, NULL, &no_wait) > 0) {
+    }
+    char *checkpoint_path = add_path_parts(real_indexdir,
+                                           BUILD_CHECKPOINT_NAME);
+    remove(checkpoint_path);
+    free(checkpoint_path);
+  }
+  ret_val = num_indexed;
+
+  OUT1:
+    free_path_list(&roots);
+    free_path_list(&files);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    umask(old_umask);
+    return ret_val;
+}
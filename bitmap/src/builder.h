@@ -0,0 +1,25 @@
+#ifndef BUILDER_INCLUDED
+#define BUILDER_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#define BUILD_CHECKPOINT_NAME ".build_checkpoint"
+#define TEMP_BUILD_CHECKPOINT_NAME ".build_checkpoint.tmp"
+
+/* files indexed between two commits to the packfiles and the checkpoint */
+#define BUILD_CHUNK_FILES 256
+
+/* times lockfile_create retries a packfile lock held by a pack run */
+#define BUILD_LOCK_RETRIES 12
+
+/* how often the build reports its progress */
+#define BUILD_PROGRESS_SEC 10
+
+/*--------------------------------------------------------------------*/
+
+long build_index(char **inputs, int num_inputs, char *indexdir,
+    int num_threads);
+
+/*--------------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,102 @@
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "content.h"
+#include "util.h"
+#include "xxhash.h"
+#include "portable_endian.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * The same log content is often found under several paths: copies in support
+ * bundles, and rotated logs renamed from log.2.gz to log.3.gz. Bitmaps are
+ * normally stored under the file's real path and mtime, so each such path
+ * would be indexed again. Gzip files are instead stored by a name derived
+ * from their content, in the CONTENT_SUBDIR of the index subdirectory of the
+ * month they were last modified in. Renaming and copying with cp -p or tar
+ * keep the mtime, so they still share the entry, and entries age out with
+ * their month like those stored by path.
+ *
+ * The name combines the gzip trailer, the CRC32 and length of the
+ * uncompressed data, with the compressed size and a hash of the first
+ * CONTENT_HEAD_BYTES, which hold the gzip header. It costs one read at each
+ * end of the file, so content that is already indexed is never read in full.
+ */
+
+#define CONTENT_NAME_PREFIX "gzip:"
+
+#define GZIP_TRAILER_BYTES 8
+
+/* header and trailer of an empty gzip member */
+#define GZIP_MIN_BYTES 18
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Writes the content name of the gzip file open on fd to name, a buffer of
+ * CONTENT_NAME_MAX bytes. Reads at explicit offsets, so the file offset of fd
+ * is unchanged.
+ *
+ * Returns 0 upon success, -1 if the file is not gzip-compressed or could not
+ * be read.
+ */
+int gzip_content_name(int fd, char *name) {
+  struct stat s;
+  if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode)
+      || s.st_size < GZIP_MIN_BYTES) {
+    return -1;
+  }
+  uint8_t head[CONTENT_HEAD_BYTES];
+  ssize_t head_len = pread(fd, head, sizeof(head), 0);
+  if (head_len < GZIP_MIN_BYTES || head[0] != 0x1f || head[1] != 0x8b) {
+    return -1;
+  }
+  uint32_t trailer[2];
+  if (pread(fd, trailer, GZIP_TRAILER_BYTES, s.st_size - GZIP_TRAILER_BYTES)
+      != GZIP_TRAILER_BYTES) {
+    return -1;
+  }
+  uint32_t crc = le32toh(trailer[0]);
+  uint32_t uncompressed_size = le32toh(trailer[1]);
+  uint64_t head_hash = XXH64(head, head_len, HASH_SEED);
+  snprintf(name, CONTENT_NAME_MAX,
+           CONTENT_NAME_PREFIX "%" PRIx64 ":%08" PRIx32 ":%08" PRIx32
+           ":%016" PRIx64, (uint64_t) s.st_size, crc, uncompressed_size,
+           head_hash);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns 1 if the stored file name of length len is a content name rather
+ * than a path.
+ */
+int is_content_name(const char *name, size_t len) {
+  return len >= strlen(CONTENT_NAME_PREFIX)
+    && memcmp(name, CONTENT_NAME_PREFIX, strlen(CONTENT_NAME_PREFIX)) == 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Writes to path, a buffer of PATH_MAX bytes, the directory holding the
+ * bitmaps stored by content of files last modified at timestamp.
+ *
+ * Returns 0 upon success, -1 if the path is too long.
+ */
+int content_subdirectory_path(char *path, char *indexdir, int64_t timestamp) {
+  char index_subdir[PATH_MAX];
+  index_subdirectory_path(index_subdir, indexdir, timestamp);
+  if (snprintf(path, PATH_MAX, "%s/%s", index_subdir, CONTENT_SUBDIR)
+      >= PATH_MAX) {
+    return -1;
+  }
+  return 0;
+}
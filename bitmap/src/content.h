@@ -0,0 +1,31 @@
+#ifndef CONTENT_INCLUDED
+#define CONTENT_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*--------------------------------------------------------------------*/
+
+/* subdirectory of each month's index subdirectory holding the bitmaps stored
+ * by content */
+#define CONTENT_SUBDIR "content"
+
+/* bytes at the start of a file hashed into its content name */
+#define CONTENT_HEAD_BYTES 4096
+
+/* longest content name, including the terminating null byte */
+#define CONTENT_NAME_MAX 64
+
+/*--------------------------------------------------------------------*/
+
+int gzip_content_name(int fd, char *name);
+
+int is_content_name(const char *name, size_t len);
+
+int content_subdirectory_path(char *path, char *indexdir, int64_t timestamp);
+
+/*--------------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,664 @@
+#include <sys/stat.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+#include <zdict.h>
+
+#include "dict.h"
+#include "util.h"
+#include "stats.h"
+#include "portable_endian.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * Bitmaps of files from the same log family share most of their set bits, but
+ * zstd compresses each one on its own. The packer therefore trains a zstd
+ * dictionary per index subdirectory, stored in .zstd_dict: its content is the
+ * bitmap of the bits set in most sampled bitmaps, so that runs of a new bitmap
+ * matching it compress to back-references, with entropy tables fitted to the
+ * samples. Every frame compressed with it records its dictionary ID, so frames
+ * written before the directory had a dictionary stay readable.
+ *
+ * A dictionary is trained once per directory. If it does not pay off, an empty
+ * .zstd_dict records that, and bitmaps are compressed without one.
+ */
+
+/*--------------------------------------------------------------------*/
+
+/* most directories a process keeps dictionaries of at once */
+#define DICT_CACHE_SIZE 64
+
+/* room for the entropy tables ZDICT_finalizeDictionary adds to the content */
+#define DICT_HEADER_ROOM (16 * 1024)
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * The dictionary of one index directory, loaded once and shared by all threads
+ * of the process. A dict_id of 0 means the directory has no dictionary. The
+ * digested ZSTD_CDict and ZSTD_DDict are only built once needed, since most
+ * processes only compress or only decompress.
+ *
+ * Entries are reference counted, so one replaced in the cache stays usable by
+ * a compression still running with it.
+ */
+struct zstd_dict {
+  char *indexdir;
+  unsigned dict_id;
+  void *content;
+  size_t content_size;
+  ZSTD_CDict *cdict;
+  ZSTD_DDict *ddict;
+  dev_t file_dev;
+  ino_t file_ino;
+  struct timespec checked;
+  int refs;
+  struct zstd_dict *next;
+};
+
+static struct zstd_dict *dict_cache = NULL;
+static pthread_mutex_t dict_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The compression and decompression contexts of one thread, and a buffer for
+ * a compressed bitmap, reused for every bitmap instead of being set up per
+ * call.
+ */
+struct zstd_contexts {
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+  void *compressed;
+};
+
+static pthread_key_t contexts_key;
+static pthread_once_t contexts_key_once = PTHREAD_ONCE_INIT;
+
+/*--------------------------------------------------------------------*/
+
+static void free_contexts(void *arg) {
+  struct zstd_contexts *contexts = arg;
+  ZSTD_freeCCtx(contexts->cctx);
+  ZSTD_freeDCtx(contexts->dctx);
+  free(contexts->compressed);
+  free(contexts);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void create_contexts_key() {
+  pthread_key_create(&contexts_key, free_contexts);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the calling thread's zstd contexts, allocating the structure on
+ * first use. The contexts themselves are created by the callers that need
+ * them.
+ */
+static struct zstd_contexts *get_contexts() {
+  pthread_once(&contexts_key_once, create_contexts_key);
+  struct zstd_contexts *contexts = pthread_getspecific(contexts_key);
+  if (contexts == NULL) {
+    contexts = calloc(1, sizeof(*contexts));
+    if (contexts == NULL) {
+      perror("Error: Memory not allocated");
+      return NULL;
+    }
+    pthread_setspecific(contexts_key, contexts);
+  }
+  return contexts;
+}
+
+/*--------------------------------------------------------------------*/
+
+static ZSTD_CCtx *get_cctx() {
+  struct zstd_contexts *contexts = get_contexts();
+  if (contexts == NULL) {
+    return NULL;
+  }
+  if (contexts->cctx == NULL) {
+    contexts->cctx = ZSTD_createCCtx();
+  }
+  return contexts->cctx;
+}
+
+/*--------------------------------------------------------------------*/
+
+static ZSTD_DCtx *get_dctx() {
+  struct zstd_contexts *contexts = get_contexts();
+  if (contexts == NULL) {
+    return NULL;
+  }
+  if (contexts->dctx == NULL) {
+    contexts->dctx = ZSTD_createDCtx();
+  }
+  return contexts->dctx;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the calling thread's buffer of ZSTD_compressBound(SIZEOF_BITMAP)
+ * bytes for a compressed bitmap, or NULL if it could not be allocated.
+ */
+void *get_compression_buffer() {
+  struct zstd_contexts *contexts = get_contexts();
+  if (contexts == NULL) {
+    return NULL;
+  }
+  if (contexts->compressed == NULL) {
+    contexts->compressed = malloc(ZSTD_compressBound(SIZEOF_BITMAP));
+  }
+  return contexts->compressed;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Drops a reference to dict, freeing it once nothing uses it.
+ * Must be called with dict_cache_mutex held.
+ */
+static void put_dict(struct zstd_dict *dict) {
+  if (--dict->refs > 0) {
+    return;
+  }
+  ZSTD_freeCDict(dict->cdict);
+  ZSTD_freeDDict(dict->ddict);
+  free(dict->content);
+  free(dict->indexdir);
+  free(dict);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Removes the cached dictionary of indexdir, if any.
+ * Must be called with dict_cache_mutex held.
+ */
+static void evict_dict(char *indexdir) {
+  for (struct zstd_dict **d = &dict_cache; *d; d = &(*d)->next) {
+    if (strcmp((*d)->indexdir, indexdir) == 0) {
+      struct zstd_dict *evicted = *d;
+      *d = evicted->next;
+      put_dict(evicted);
+      return;
+    }
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the dictionary of indexdir. A missing or empty dictionary file gives a
+ * dictionary with dict_id 0.
+ */
+static struct zstd_dict *load_dict(char *indexdir) {
+  struct zstd_dict *dict = calloc(1, sizeof(*dict));
+  if (dict == NULL) {
+    perror("Error: Memory not allocated");
+    return NULL;
+  }
+  char *path = add_path_parts(indexdir, DICT_NAME);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      perrorf("Error opening dictionary %s", path);
+    }
+    goto OUT1;
+  }
+  struct stat s;
+  if (fstat(fd, &s) != 0) {
+    perrorf("Error in stat of dictionary %s", path);
+    goto OUT2;
+  }
+  dict->file_dev = s.st_dev;
+  dict->file_ino = s.st_ino;
+  if (s.st_size == 0) {
+    goto OUT2;
+  }
+  dict->content = malloc(s.st_size);
+  if (dict->content == NULL) {
+    perror("Error: Memory not allocated");
+    goto OUT2;
+  }
+  if (pread(fd, dict->content, s.st_size, 0) != s.st_size) {
+    perrorf("Error reading dictionary %s", path);
+    free(dict->content);
+    dict->content = NULL;
+    goto OUT2;
+  }
+  dict->content_size = s.st_size;
+  dict->dict_id = ZDICT_getDictID(dict->content, dict->content_size);
+
+  OUT2:
+    close(fd);
+  OUT1:
+    free(path);
+    dict->indexdir = strdup(indexdir);
+    dict->refs = 1;
+    return dict;
+}
+
+/*--------------------------------------------------------------------*/
+
+static int64_t elapsed_nsec(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L
+    + (to->tv_nsec - from->tv_nsec);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns 1 if the dictionary file of dict has been created or replaced since
+ * dict was loaded.
+ */
+static int dict_file_changed(struct zstd_dict *dict) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dict->indexdir, DICT_NAME);
+  struct stat s;
+  if (stat(path, &s) != 0) {
+    return dict->file_ino != 0;
+  }
+  return s.st_dev != dict->file_dev || s.st_ino != dict->file_ino;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the dictionary of indexdir, reusing the cached one unless its file
+ * has been replaced, which is checked at most every DICT_RECHECK_NSEC or now
+ * if recheck is set. Release it with release_dict.
+ */
+static struct zstd_dict *get_dict(char *indexdir, int recheck) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+  pthread_mutex_lock(&dict_cache_mutex);
+  int num_cached = 0;
+  struct zstd_dict *dict = NULL;
+  for (struct zstd_dict *d = dict_cache; d; d = d->next) {
+    if (strcmp(d->indexdir, indexdir) == 0) {
+      dict = d;
+      break;
+    }
+    num_cached++;
+  }
+  if (dict != NULL
+      && (recheck || elapsed_nsec(&dict->checked, &now) >= DICT_RECHECK_NSEC)) {
+    if (dict_file_changed(dict)) {
+      evict_dict(indexdir);
+      dict = NULL;
+    } else {
+      dict->checked = now;
+    }
+  }
+  if (dict == NULL) {
+    dict = load_dict(indexdir);
+    if (dict != NULL) {
+      if (num_cached >= DICT_CACHE_SIZE) {
+        // evict the least recently loaded dictionary, at the end of the list
+        struct zstd_dict **last = &dict_cache;
+        while ((*last)->next) {
+          last = &(*last)->next;
+        }
+        struct zstd_dict *evicted = *last;
+        *last = NULL;
+        put_dict(evicted);
+      }
+      dict->checked = now;
+      dict->next = dict_cache;
+      dict_cache = dict;
+    }
+  }
+  if (dict != NULL) {
+    dict->refs++;
+  }
+  pthread_mutex_unlock(&dict_cache_mutex);
+  return dict;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void release_dict(struct zstd_dict *dict) {
+  pthread_mutex_lock(&dict_cache_mutex);
+  put_dict(dict);
+  pthread_mutex_unlock(&dict_cache_mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+static ZSTD_CDict *get_cdict(struct zstd_dict *dict) {
+  pthread_mutex_lock(&dict_cache_mutex);
+  if (dict->cdict == NULL) {
+    dict->cdict = ZSTD_createCDict(dict->content, dict->content_size,
+                                   BITMAP_COMPRESSION_LEVEL);
+  }
+  pthread_mutex_unlock(&dict_cache_mutex);
+  return dict->cdict;
+}
+
+/*--------------------------------------------------------------------*/
+
+static ZSTD_DDict *get_ddict(struct zstd_dict *dict) {
+  pthread_mutex_lock(&dict_cache_mutex);
+  if (dict->ddict == NULL) {
+    dict->ddict = ZSTD_createDDict(dict->content, dict->content_size);
+  }
+  pthread_mutex_unlock(&dict_cache_mutex);
+  return dict->ddict;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Compresses the bitmap into dst with the dictionary of indexdir, if it has
+ * one, or without a dictionary if indexdir is NULL.
+ *
+ * Returns the compressed size or a zstd error code, to be checked with
+ * ZSTD_isError.
+ */
+size_t compress_bitmap(void *dst, size_t dst_capacity, uint8_t *bitmap,
+    char *indexdir) {
+  ZSTD_CCtx *cctx = get_cctx();
+  if (cctx == NULL) {
+    return (size_t) -ZSTD_error_memory_allocation;
+  }
+  struct zstd_dict *dict = indexdir ? get_dict(indexdir, 0) : NULL;
+  ZSTD_CDict *cdict = dict && dict->dict_id ? get_cdict(dict) : NULL;
+  size_t ret;
+  if (cdict != NULL) {
+    ret = ZSTD_compress_usingCDict(cctx, dst, dst_capacity, bitmap,
+                                   SIZEOF_BITMAP, cdict);
+  } else {
+    ret = ZSTD_compressCCtx(cctx, dst, dst_capacity, bitmap, SIZEOF_BITMAP,
+                            BITMAP_COMPRESSION_LEVEL);
+  }
+  if (dict != NULL) {
+    release_dict(dict);
+  }
+  return ret;
+}
+
+/*--------------------------------------------------------------------*/
+
+static size_t decompress_frame(uint8_t *bitmap, const void *src,
+    size_t src_size, char *indexdir) {
+  ZSTD_DCtx *dctx = get_dctx();
+  if (dctx == NULL) {
+    return (size_t) -ZSTD_error_memory_allocation;
+  }
+  unsigned dict_id = ZSTD_getDictID_fromFrame(src, src_size);
+  if (dict_id == 0) {
+    return ZSTD_decompressDCtx(dctx, bitmap, SIZEOF_BITMAP, src, src_size);
+  }
+  if (indexdir == NULL) {
+    return (size_t) -ZSTD_error_dictionary_wrong;
+  }
+  struct zstd_dict *dict = get_dict(indexdir, 0);
+  if (dict != NULL && dict->dict_id != dict_id) {
+    // the directory may have been recreated since the dictionary was cached
+    release_dict(dict);
+    dict = get_dict(indexdir, 1);
+  }
+  if (dict == NULL) {
+    return (size_t) -ZSTD_error_memory_allocation;
+  }
+  size_t ret;
+  ZSTD_DDict *ddict = dict->dict_id == dict_id ? get_ddict(dict) : NULL;
+  if (ddict != NULL) {
+    ret = ZSTD_decompress_usingDDict(dctx, bitmap, SIZEOF_BITMAP, src,
+                                     src_size, ddict);
+  } else {
+    ret = (size_t) -ZSTD_error_dictionary_wrong;
+  }
+  release_dict(dict);
+  return ret;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Decompresses a bitmap compressed by compress_bitmap for indexdir, choosing
+ * the dictionary by the ID recorded in the frame. No data at all stands for a
+ * saturated bitmap, which is not compressed, and sets every bit.
+ *
+ * Returns the decompressed size or a zstd error code, to be checked with
+ * ZSTD_isError.
+ */
+size_t decompress_bitmap(uint8_t *bitmap, const void *src, size_t src_size,
+    char *indexdir) {
+  if (src_size == 0) {
+    memset(bitmap, 0xff, SIZEOF_BITMAP);
+    return SIZEOF_BITMAP;
+  }
+  uint64_t start = stats_clock();
+  size_t ret = decompress_frame(bitmap, src, src_size, indexdir);
+  add_stage_time(STAGE_DECOMPRESS, start);
+  return ret;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns 1 if indexdir has not had a dictionary trained for it yet.
+ */
+int needs_dict(char *indexdir) {
+  char *path = add_path_parts(indexdir, DICT_NAME);
+  struct stat s;
+  int ret = stat(path, &s) != 0 && errno == ENOENT;
+  free(path);
+  return ret;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Decompresses the bitmap of a loose file record into samples, unless there
+ * are enough samples already.
+ *
+ * Returns 0 upon success or if the record was skipped, -1 on error.
+ */
+int add_dict_sample(struct dict_samples *samples, uint8_t *record,
+    size_t record_len) {
+  if (samples->num_samples >= DICT_MAX_SAMPLES) {
+    return 0;
+  }
+  if (samples->bitmaps == NULL) {
+    samples->bitmaps = malloc((size_t) DICT_MAX_SAMPLES * SIZEOF_BITMAP);
+    if (samples->bitmaps == NULL) {
+      perror("Error: Memory not allocated");
+      return -1;
+    }
+  }
+  uint16_t name_len;
+  memcpy(&name_len, record, sizeof(uint16_t));
+  name_len = be16toh(name_len);
+  size_t header_len = sizeof(uint16_t) + name_len + sizeof(int64_t)
+    + sizeof(uint32_t);
+  uint32_t compressed_size;
+  memcpy(&compressed_size, record + header_len - sizeof(uint32_t),
+         sizeof(uint32_t));
+  compressed_size = be32toh(compressed_size);
+  if (header_len + compressed_size > record_len) {
+    return -1;
+  }
+  uint8_t *compressed = record + header_len;
+  // saturated bitmaps are not compressed, so are no use to the dictionary
+  if (compressed_size == 0
+      || ZSTD_getDictID_fromFrame(compressed, compressed_size) != 0) {
+    return 0;
+  }
+  uint8_t *bitmap = samples->bitmaps
+    + (size_t) samples->num_samples * SIZEOF_BITMAP;
+  size_t s = decompress_bitmap(bitmap, compressed, compressed_size, NULL);
+  if (ZSTD_isError(s) || s != SIZEOF_BITMAP) {
+    return -1;
+  }
+  samples->num_samples++;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Sets the bits of content that are set in more than half of the bitmaps.
+ */
+static void majority_bitmap(uint8_t *bitmaps, int num_bitmaps,
+    uint8_t *content) {
+  memset(content, 0, SIZEOF_BITMAP);
+  for (size_t i = 0; i < SIZEOF_BITMAP; i++) {
+    int counts[8] = {0};
+    for (int b = 0; b < num_bitmaps; b++) {
+      uint8_t byte = bitmaps[(size_t) b * SIZEOF_BITMAP + i];
+      for (int bit = 0; bit < 8; bit++) {
+        counts[bit] += (byte >> bit) & 1;
+      }
+    }
+    for (int bit = 0; bit < 8; bit++) {
+      if (2 * counts[bit] > num_bitmaps) {
+        content[i] |= 1 << bit;
+      }
+    }
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Compressed size of the bitmaps, with dictionary dict if dict_size is not 0.
+ * Returns 0 on error.
+ */
+static size_t compressed_total(uint8_t *bitmaps, int num_bitmaps,
+    void *dict, size_t dict_size, void *buf, size_t buf_size) {
+  ZSTD_CCtx *cctx = get_cctx();
+  if (cctx == NULL) {
+    return 0;
+  }
+  size_t total = 0;
+  for (int b = 0; b < num_bitmaps; b++) {
+    size_t s = ZSTD_compress_usingDict(cctx, buf, buf_size,
+        bitmaps + (size_t) b * SIZEOF_BITMAP, SIZEOF_BITMAP,
+        dict, dict_size, BITMAP_COMPRESSION_LEVEL);
+    if (ZSTD_isError(s)) {
+      return 0;
+    }
+    total += s;
+  }
+  return total;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Trains a dictionary for indexdir from the sampled bitmaps and writes it to
+ * the dictionary file, or writes an empty one if the dictionary does not save
+ * DICT_MIN_SAVING_PERCENT on the last quarter of the samples, which are held
+ * out of training. Nothing is written with fewer than DICT_MIN_SAMPLES
+ * samples, so a later pack run tries again.
+ *
+ * Must be called with the packfile lock of indexdir held.
+ *
+ * Returns 0 upon success, -1 on error.
+ */
+int train_dict(char *indexdir, struct dict_samples *samples) {
+  if (samples->num_samples < DICT_MIN_SAMPLES) {
+    return 0;
+  }
+  int ret_val = -1;
+  int num_training = samples->num_samples - samples->num_samples / 4;
+  uint8_t *held_out = samples->bitmaps + (size_t) num_training * SIZEOF_BITMAP;
+  int num_held_out = samples->num_samples - num_training;
+  size_t sample_sizes[DICT_MAX_SAMPLES];
+  for (int b = 0; b < num_training; b++) {
+    sample_sizes[b] = SIZEOF_BITMAP;
+  }
+
+  size_t dict_capacity = SIZEOF_BITMAP + DICT_HEADER_ROOM;
+  size_t compressed_capacity = ZSTD_compressBound(SIZEOF_BITMAP);
+  uint8_t *content = malloc(SIZEOF_BITMAP);
+  void *dict = malloc(dict_capacity);
+  void *compressed = malloc(compressed_capacity);
+  char *tmpfile_path = add_path_parts(indexdir, TEMP_DICT_NAME);
+  char *path = add_path_parts(indexdir, DICT_NAME);
+  if (content == NULL || dict == NULL || compressed == NULL) {
+    perror("Error: Memory not allocated");
+    goto OUT1;
+  }
+
+  majority_bitmap(samples->bitmaps, num_training, content);
+  ZDICT_params_t params = {
+    .compressionLevel = BITMAP_COMPRESSION_LEVEL,
+  };
+  size_t dict_size = ZDICT_finalizeDictionary(dict, dict_capacity,
+      content, SIZEOF_BITMAP, samples->bitmaps, sample_sizes, num_training,
+      params);
+  if (ZDICT_isError(dict_size)) {
+    fprintf(stderr, "Error training dictionary: %s\n",
+            ZDICT_getErrorName(dict_size));
+    goto OUT1;
+  }
+  size_t plain = compressed_total(held_out, num_held_out, NULL, 0,
+                                  compressed, compressed_capacity);
+  size_t with_dict = compressed_total(held_out, num_held_out, dict, dict_size,
+                                      compressed, compressed_capacity);
+  if (plain == 0 || with_dict == 0) {
+    fprintf(stderr, "Error evaluating dictionary\n");
+    goto OUT1;
+  }
+  if (with_dict * 100 > plain * (100 - DICT_MIN_SAVING_PERCENT)) {
+    dict_size = 0;
+  }
+
+  FILE *file = fopen(tmpfile_path, "w");
+  if (file == NULL) {
+    perror("Error creating dictionary tempfile");
+    goto OUT1;
+  }
+  if (dict_size > 0 && fwrite(dict, dict_size, 1, file) != 1) {
+    perror("Error writing dictionary tempfile");
+    fclose(file);
+    goto OUT1;
+  }
+  fflush(file);
+  fsync(fileno(file));
+  if (fclose(file) != 0) {
+    perror("Error writing dictionary tempfile");
+    goto OUT1;
+  }
+  if (rename(tmpfile_path, path) != 0) {
+    perror("Error replacing dictionary");
+    goto OUT1;
+  }
+  // so this process compresses with the new dictionary right away
+  pthread_mutex_lock(&dict_cache_mutex);
+  evict_dict(indexdir);
+  pthread_mutex_unlock(&dict_cache_mutex);
+  ret_val = 0;
+
+  OUT1:
+    free(content);
+    free(dict);
+    free(compressed);
+    free(tmpfile_path);
+    free(path);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+void free_dict_samples(struct dict_samples *samples) {
+  free(samples->bitmaps);
+  samples->bitmaps = NULL;
+  samples->num_samples = 0;
+}
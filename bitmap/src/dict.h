@@ -0,0 +1,58 @@
+#ifndef DICT_INCLUDED
+#define DICT_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*--------------------------------------------------------------------*/
+
+#define DICT_NAME ".zstd_dict"
+#define TEMP_DICT_NAME ".zstd_dict.tmp"
+
+/* zstd compression level of every bitmap */
+#define BITMAP_COMPRESSION_LEVEL 8
+
+/* bitmaps a pack run needs to train a dictionary, and the most it keeps */
+#define DICT_MIN_SAMPLES 32
+#define DICT_MAX_SAMPLES 128
+
+/* a dictionary is only kept if it shrinks the held-out bitmaps this much */
+#define DICT_MIN_SAVING_PERCENT 2
+
+/* how long a cached dictionary is trusted before its file is checked */
+#define DICT_RECHECK_NSEC 1000000000L
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Bitmaps collected by the packer to train a dictionary from.
+ */
+struct dict_samples {
+  uint8_t *bitmaps;
+  int num_samples;
+};
+
+/*--------------------------------------------------------------------*/
+
+size_t compress_bitmap(void *dst, size_t dst_capacity, uint8_t *bitmap,
+    char *indexdir);
+
+size_t decompress_bitmap(uint8_t *bitmap, const void *src, size_t src_size,
+    char *indexdir);
+
+void *get_compression_buffer();
+
+int needs_dict(char *indexdir);
+
+int add_dict_sample(struct dict_samples *samples, uint8_t *record,
+    size_t record_len);
+
+int train_dict(char *indexdir, struct dict_samples *samples);
+
+void free_dict_samples(struct dict_samples *samples);
+
+/*--------------------------------------------------------------------*/
+
+#endif
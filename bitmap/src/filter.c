@@ -9,12 +9,19 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <immintrin.h>
-#include <lockfile.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "bitmap.h"
 #include "filter.h"
 #include "packfile.h"
+#include "snapshot.h"
+#include "looselog.h"
+#include "writebehind.h"
+#include "content.h"
+#include "service.h"
+#include "stats.h"
 #include "util.h"
 #include "xxhash.h"
 #include "portable_endian.h"
@@ -23,6 +30,110 @@
 
 #define BITMAP_CREATED 2
 
+/* how much of an input file prefetch_file asks the kernel to read ahead */
+#define PREFETCH_FILE_BYTES (4 * 1024 * 1024)
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * A file of a batch being filtered, resolved and waiting for its bitmap.
+ */
+struct batch_file {
+  char real_path[PATH_MAX];
+  char index_subdir[PATH_MAX];
+  int64_t mtime;
+  uint8_t *bitmap;
+  int pending;
+};
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Buffers start_filter reuses for every file a thread filters, so that a file
+ * whose bitmap is already packed is filtered without touching the heap. The
+ * zstd contexts are kept per thread alongside, by dict.c. start_filter_batch
+ * keeps its buffers here too, grown to the largest batch the thread has seen.
+ *
+ * The thread's connection to the index service is kept here too, along with
+ * the index it was made for (or last looked for), the process it belongs to
+ * and when to look for a service again after finding none.
+ */
+struct filter_context {
+  uint8_t *bitmap;
+  char real_path[PATH_MAX];
+  char index_subdir[PATH_MAX];
+  char content_dir[PATH_MAX];
+  char content_name[CONTENT_NAME_MAX];
+  int service_sock;
+  pid_t service_pid;
+  time_t service_retry;
+  char service_indexdir[PATH_MAX];
+  struct batch_file *batch_files;
+  uint8_t *batch_bitmaps;
+  char **batch_names;
+  int64_t *batch_mtimes;
+  uint8_t **batch_member_bitmaps;
+  int *batch_found;
+  int *batch_members;
+  int batch_capacity;
+};
+
+static pthread_key_t filter_context_key;
+static pthread_once_t filter_context_key_once = PTHREAD_ONCE_INIT;
+
+/*--------------------------------------------------------------------*/
+
+static void free_filter_context(void *arg) {
+  struct filter_context *context = arg;
+  if (context->service_sock != -1) {
+    close(context->service_sock);
+  }
+  free(context->batch_files);
+  free(context->batch_bitmaps);
+  free(context->batch_names);
+  free(context->batch_mtimes);
+  free(context->batch_member_bitmaps);
+  free(context->batch_found);
+  free(context->batch_members);
+  free(context->bitmap);
+  free(context);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void create_filter_context_key() {
+  pthread_key_create(&filter_context_key, free_filter_context);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the calling thread's filter context, creating it on first use.
+ */
+static struct filter_context *get_filter_context() {
+  pthread_once(&filter_context_key_once, create_filter_context_key);
+  struct filter_context *context = pthread_getspecific(filter_context_key);
+  if (context != NULL) {
+    return context;
+  }
+  context = calloc(1, sizeof(*context));
+  if (context == NULL) {
+    perror("Error: Memory not allocated");
+    return NULL;
+  }
+  context->bitmap = init_bitmap();
+  if (context->bitmap == NULL) {
+    free(context);
+    return NULL;
+  }
+  context->service_sock = -1;
+  context->service_pid = 0;
+  context->service_retry = 0;
+  context->service_indexdir[0] = '\0';
+  pthread_setspecific(filter_context_key, context);
+  return context;
+}
+
 /*--------------------------------------------------------------------*/
 
 /**
@@ -34,22 +145,19 @@
 int check_pack_files(char *filename, int64_t mtime, uint8_t *bitmap,
     char *dir){
   errno = 0;
-  uint8_t *read_bitmap = read_from_packfile(filename, mtime, dir);
-  if(read_bitmap == NULL) {
+  if (read_from_packfile_into(bitmap, filename, mtime, dir) != 0) {
     if (errno == ESTALE) {
       // retry once on stale NFS file handle
-      read_bitmap = read_from_packfile(filename, mtime, dir);
-      if (read_bitmap == NULL) {
+      if (read_from_packfile_into(bitmap, filename, mtime, dir) != 0) {
         if (errno == ESTALE) {
           perrorf("Error checking packfile for %s", filename);
         }
         return(-1);
       }
+      return 0;
     }
     return(-1);
   }
-  memcpy(bitmap, read_bitmap, SIZEOF_BITMAP);
-  free(read_bitmap);
   return 0;
 }
 
@@ -58,29 +166,26 @@ int check_pack_files(char *filename, int64_t mtime, uint8_t *bitmap,
 /**
  * Checks the loosefiles in the directory to see if the bitmap exists.
  *
- * If an entry with the given filename and mtime is found in a loose file, it
- * is applied to the given bitmap.
+ * If an entry with the given filename and mtime is found in a loose file or
+ * a loose log, it is applied to the given bitmap.
  */
 int check_loose_files(char *filename, int64_t mtime, uint8_t *bitmap, char *directory){
   int ret_val = -1;
   uint16_t orig_len;
   char hashed_filename[21];
   char tmp[27];
-  DIR *dir;
   FILE *possible;
 
   uint16_t len = strlen(filename);
   get_hash(filename, len, hashed_filename);
 
-  if ((dir = opendir(directory)) == NULL) {
-    perrorf("Error opening directory: %s", directory);
-    return ret_val;
-  }
+  // usually no loose file exists, which the snapshot answers without syscalls
+  int num_candidates = count_loose_candidates(directory, hashed_filename);
 
   int i = 0;
   char *tmp_real_path;
 
-  while(i < 1000){
+  while(i < num_candidates && i < 1000){
     sprintf(tmp, "%s_%.3d", hashed_filename, i);
     tmp_real_path = add_path_parts(directory, tmp);
 
@@ -90,14 +195,6 @@ int check_loose_files(char *filename, int64_t mtime, uint8_t *bitmap, char *dire
       break;
     }
 
-    char *lock_path = get_lock_path(directory, tmp);
-    int ret = lockfile_check(lock_path, 0);
-    free(lock_path);
-    if(ret == 0){
-      free(tmp_real_path);
-      break;
-    }
-
     if(remove_if_corrupted(possible, tmp_real_path)) {
       i++;
       free(tmp_real_path);
@@ -139,19 +236,98 @@ int check_loose_files(char *filename, int64_t mtime, uint8_t *bitmap, char *dire
     free(tmp_real_path);
     i++;
   }
-  closedir(dir);
-  return ret_val;
+  return check_loose_logs(filename, mtime, bitmap, directory);
 
   OUT1:
-    closedir(dir);
     free(tmp_real_path);
     fclose(possible);
+    if (ret_val != 0) {
+      return check_loose_logs(filename, mtime, bitmap, directory);
+    }
     return ret_val;
 
 }
 
 /*--------------------------------------------------------------------*/
 
+/**
+ * Finishes get_bitmap_for_file for a file found neither loose nor packed
+ * under its path: looks a gzip file up by its content name, and otherwise
+ * builds the bitmap from the file and stores it.
+ *
+ * Returns as get_bitmap_for_file does.
+ */
+static int find_or_build_bitmap(struct filter_context *context,
+    uint8_t *bitmap, char *real_path, int64_t mtime, char *index_subdir,
+    char *indexdir) {
+  int ret_val = 0;
+  int found;
+  uint64_t start;
+  int fd = open(real_path, O_RDONLY);
+  if (fd == -1) {
+    perrorf("Could not open file %s", real_path);
+    ret_val = 1;
+    goto OUT2;
+  }
+  // the content name is taken from the same open file the bitmap is built
+  // from, so a file replaced meanwhile cannot be stored under the wrong name
+  char *content_dir = context->content_dir;
+  char *content_name = context->content_name;
+  start = stats_clock();
+  int by_content = gzip_content_name(fd, content_name) == 0;
+  add_stage_time(STAGE_CONTENT_NAME, start);
+  if (by_content) {
+    content_subdirectory_path(content_dir, indexdir, mtime);
+    start = stats_clock();
+    found = check_loose_files(content_name, 0, bitmap, content_dir) == 0;
+    add_stage_time(STAGE_LOOSE_PROBE, start);
+    if (!found) {
+      start = stats_clock();
+      found = check_pack_files(content_name, 0, bitmap, content_dir) == 0;
+      add_stage_time(STAGE_PACKFILE_LOOKUP, start);
+    }
+    if (found) {
+      count_event(COUNTER_CONTENT_HITS);
+      close(fd);
+      goto OUT2;
+    }
+  }
+
+  FILE *file = fdopen(fd, "r");
+  if (file == NULL) {
+    perrorf("Could not open file %s", real_path);
+    close(fd);
+    ret_val = 1;
+    goto OUT2;
+  }
+  start = stats_clock();
+  memset(bitmap, 0, SIZEOF_BITMAP);
+  int ret = apply_file_to_bitmap(bitmap, file);
+  fclose(file);
+  add_stage_time(STAGE_BUILD, start);
+  if (ret != 0) {
+    ret_val = ret;
+    goto OUT2;
+  }
+  count_event(COUNTER_BITMAPS_BUILT);
+  start = stats_clock();
+  if (by_content) {
+    mkdir(index_subdir, 0777);
+    mkdir(content_dir, 0777);
+    store_bitmap(bitmap, content_name, 0, content_dir);
+  } else {
+    mkdir(index_subdir, 0777);
+    store_bitmap(bitmap, real_path, mtime, index_subdir);
+  }
+  add_stage_time(STAGE_STORE, start);
+  return BITMAP_CREATED;
+
+  OUT2:
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
 /**
  * Scans the file at filename and writes bits for its 4grams to bitmap.
  * Decompresses the file to read it if the file is gzip-compressed.
@@ -163,43 +339,123 @@ int check_loose_files(char *filename, int64_t mtime, uint8_t *bitmap, char *dire
  * Returns GZ_TRUNCATED if the given file was gzip-compressed and the
  * last read ended in the middle of the gzip stream.
  * Returns 3 if the given file does not exist.
+ *
+ * A gzip file not found under its path is looked up by its content name, and
+ * its bitmap is stored under that name only, so that copies and renamed
+ * rotations of it share one bitmap.
+ *
+ * Paths are resolved into the calling thread's filter context, so reading a
+ * cached bitmap allocates nothing.
  */
 int get_bitmap_for_file(uint8_t *bitmap, char *filename, char *indexdir) {
-  char *real_path = realpath(filename, NULL);
-  if (real_path == NULL) {
+  struct filter_context *context = get_filter_context();
+  if (context == NULL) {
+    return -1;
+  }
+  char *real_path = context->real_path;
+  char *index_subdir = context->index_subdir;
+  uint64_t start = stats_clock();
+  if (realpath(filename, real_path) == NULL) {
     return 3;
   }
   int64_t mtime = get_mtime(real_path);
-  char *index_subdir = get_index_subdirectory(indexdir, mtime);
+  add_stage_time(STAGE_RESOLVE, start);
+  index_subdirectory_path(index_subdir, indexdir, mtime);
   int ret_val = 0;
   //check loosefiles
-  if (check_loose_files(real_path, mtime, bitmap, index_subdir) == 0){
+  start = stats_clock();
+  int found = check_loose_files(real_path, mtime, bitmap, index_subdir) == 0;
+  add_stage_time(STAGE_LOOSE_PROBE, start);
+  if (found) {
+    count_event(COUNTER_LOOSE_HITS);
     goto OUT2;
   }
   // not in loosefiles so check packfiles
-  if(check_pack_files(real_path, mtime, bitmap, index_subdir) == 0){
+  start = stats_clock();
+  found = check_pack_files(real_path, mtime, bitmap, index_subdir) == 0;
+  add_stage_time(STAGE_PACKFILE_LOOKUP, start);
+  if (found) {
+    count_event(COUNTER_PACKFILE_HITS);
     goto OUT2;
   }
+  return find_or_build_bitmap(context, bitmap, real_path, mtime, index_subdir,
+                              indexdir);
 
-  FILE *file = fopen(real_path, "r");
-  if (file == NULL) {
-    perrorf("Could not open file %s", real_path);
-    ret_val = 1;
-    goto OUT2;
-  }
+  OUT2:
+    return ret_val;
+}
 
-  int ret = apply_file_to_bitmap(bitmap, file);
-  fclose(file);
-  if (ret != 0) {
-    ret_val = ret;
-    goto OUT2;
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the fraction of all possible ngrams that are set in the bitmap of
+ * filename, building the bitmap if it has none yet, or -1 if the file has no
+ * bitmap. The denser a bitmap, the likelier an absent ngram collides with a
+ * set bit and lets the file through the filter.
+ */
+double get_bitmap_density(char *filename, char *indexdir) {
+  struct filter_context *context = get_filter_context();
+  if (context == NULL) {
+    return -1;
   }
-  compress_to_file(bitmap, real_path, mtime, index_subdir);
-  return BITMAP_CREATED;
+  uint8_t *bitmap = context->bitmap;
+  int ret = get_bitmap_for_file(bitmap, filename, indexdir);
+  if (ret != 0 && ret != BITMAP_CREATED) {
+    return -1;
+  }
+  return (double) count_set_bits(bitmap) / POSSIBLE_NGRAMS;
+}
 
-  OUT2:
-    free(real_path);
-    return ret_val;
+/*--------------------------------------------------------------------*/
+
+/**
+ * Gets the ngram length and bits kept per character the library was built
+ * with, which decide how many ngrams collide in a bitmap.
+ */
+void get_ngram_config(int *ngram_chars, int *ngram_char_bits) {
+  *ngram_chars = NGRAM_CHARS;
+  *ngram_char_bits = NGRAM_CHAR_BITS;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Warms the caches get_bitmap_for_file will hit for filename, without reading
+ * anything into userspace.
+ *
+ * Resolves and stats the path, advises the kernel to read ahead the start of
+ * the file, and faults in the packfile index pages and packfile record for
+ * the file's entry. Meant to be run a few files ahead of the workers so that
+ * filesystem latency is hidden behind their compute.
+ *
+ * Returns 0 upon success, -1 if the file could not be opened.
+ */
+int prefetch_file(char *filename, char *indexdir) {
+  char real_path[PATH_MAX];
+  if (realpath(filename, real_path) == NULL) {
+    return -1;
+  }
+  int fd = open(real_path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat s;
+  if (fstat(fd, &s) != 0) {
+    close(fd);
+    return -1;
+  }
+  posix_fadvise(fd, 0, PREFETCH_FILE_BYTES, POSIX_FADV_WILLNEED);
+  char content_name[CONTENT_NAME_MAX];
+  int by_content = gzip_content_name(fd, content_name) == 0;
+  close(fd);
+
+  char index_subdir[PATH_MAX];
+  index_subdirectory_path(index_subdir, indexdir, s.st_mtime);
+  if (prefetch_from_packfile(real_path, index_subdir) != 0 && by_content) {
+    content_subdirectory_path(index_subdir, indexdir, s.st_mtime);
+    prefetch_from_packfile(content_name, index_subdir);
+  }
+  return 0;
 }
 
 /*--------------------------------------------------------------------*/
@@ -373,6 +629,72 @@ int should_filter_out_file(uint8_t *file_bitmap, struct intarrayarray filter) {
   return !contained;
 }
 
+/*--------------------------------------------------------------------*/
+
+static void close_service(struct filter_context *context) {
+  if (context->service_sock != -1) {
+    close(context->service_sock);
+    context->service_sock = -1;
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Asks the index service for indexdir, if one is running, whether filename
+ * matches ngram_filter.
+ *
+ * Returns 1 or 2 as start_filter does if the service knew the file, and
+ * SERVICE_UNKNOWN if it did not or there is no service to ask. Having found
+ * none, or lost the one it had, a thread only looks again after
+ * SERVICE_RETRY_SEC.
+ */
+static int filter_through_service(struct filter_context *context,
+    struct intarrayarray ngram_filter, char *filename, char *indexdir) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pid_t pid = getpid();
+  if (context->service_pid != pid
+      || strcmp(context->service_indexdir, indexdir) != 0) {
+    // a connection made before a fork belongs to the parent, which keeps
+    // its own descriptor for it, and one made for another index is of no use;
+    // drop it and look for this one's straight away
+    close_service(context);
+    context->service_pid = pid;
+    context->service_retry = 0;
+    snprintf(context->service_indexdir, PATH_MAX, "%s", indexdir);
+  }
+  if (context->service_sock == -1) {
+    if (now.tv_sec < context->service_retry) {
+      return SERVICE_UNKNOWN;
+    }
+    context->service_sock = connect_service(indexdir);
+    if (context->service_sock == -1) {
+      context->service_retry = now.tv_sec + SERVICE_RETRY_SEC;
+      return SERVICE_UNKNOWN;
+    }
+  }
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return SERVICE_UNKNOWN;
+  }
+  int8_t result;
+  uint64_t start = stats_clock();
+  int ret = query_service(context->service_sock, ngram_filter, &fd, 1,
+                          &result);
+  add_stage_time(STAGE_SERVICE, start);
+  close(fd);
+  if (ret != 0) {
+    close_service(context);
+    context->service_retry = now.tv_sec + SERVICE_RETRY_SEC;
+    return SERVICE_UNKNOWN;
+  }
+  if (result != SERVICE_UNKNOWN) {
+    count_event(COUNTER_SERVICE_ANSWERS);
+  }
+  return result;
+}
+
 /*--------------------------------------------------------------------*/
 /**
  * Function that is called by 4grep to start filtering using search strings
@@ -382,15 +704,30 @@ int should_filter_out_file(uint8_t *file_bitmap, struct intarrayarray filter) {
  * Returns -1 upon failure, 1 if bitmap is found and indices
  * match, 2 if bitmap found but does not match, 3 if no bitmap found and
  * matches, 4 if did not have bitmap and has no match.
+ *
+ * If an index service is running for indexdir it is asked first, and the
+ * index is only read here for files it does not know.
  */
 int start_filter(struct intarrayarray ngram_filter,
                  char *filename, char *indexdir){
 
   int ret = -1, MTCH = 1, NO_MTCH = 2;
+  uint64_t start = stats_clock();
   mode_t old_umask = umask(0);
 
   // now start filtering files
-  uint8_t *file_bitmap = init_bitmap();
+  struct filter_context *context = get_filter_context();
+  if (context == NULL) {
+    goto OUT1;
+  }
+  uint8_t *file_bitmap = context->bitmap;
+
+  int served = filter_through_service(context, ngram_filter, filename,
+                                      indexdir);
+  if (served != SERVICE_UNKNOWN) {
+    ret = served;
+    goto OUT1;
+  }
 
   int bitmap_ret = get_bitmap_for_file(file_bitmap, filename,
                                        indexdir);
@@ -409,7 +746,202 @@ int start_filter(struct intarrayarray ngram_filter,
     ret += BITMAP_CREATED;
 
   OUT1:
-    free(file_bitmap);
     umask(old_umask);
+    add_stage_time(STAGE_FILTER, start);
     return ret;
 }
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reallocates *buffer to size bytes, leaving it as it was on failure.
+ *
+ * Returns 0 upon success, -1 if memory could not be allocated.
+ */
+static int grow_buffer(void **buffer, size_t size) {
+  void *grown = realloc(*buffer, size);
+  if (grown == NULL) {
+    perror("Error: Memory not allocated");
+    return -1;
+  }
+  *buffer = grown;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Grows the batch buffers of the thread's filter context to hold num files.
+ *
+ * Returns 0 upon success, -1 if memory could not be allocated, in which case
+ * the buffers still hold batch_capacity files.
+ */
+static int reserve_batch(struct filter_context *context, int num) {
+  if (num <= context->batch_capacity) {
+    return 0;
+  }
+  if (grow_buffer((void **) &context->batch_files,
+                  num * sizeof(struct batch_file)) != 0
+      || grow_buffer((void **) &context->batch_bitmaps,
+                     (size_t) num * SIZEOF_BITMAP) != 0
+      || grow_buffer((void **) &context->batch_names,
+                     num * sizeof(char *)) != 0
+      || grow_buffer((void **) &context->batch_mtimes,
+                     num * sizeof(int64_t)) != 0
+      || grow_buffer((void **) &context->batch_member_bitmaps,
+                     num * sizeof(uint8_t *)) != 0
+      || grow_buffer((void **) &context->batch_found,
+                     num * sizeof(int)) != 0
+      || grow_buffer((void **) &context->batch_members,
+                     num * sizeof(int)) != 0) {
+    return -1;
+  }
+  context->batch_capacity = num;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Looks up the pending files of the batch that share the index subdirectory
+ * of files[first] in its packfile, all at once. Those found are no longer
+ * pending; the others are marked 2, for get_bitmap_for_file to finish.
+ */
+static void check_pack_files_batch(struct batch_file *files, int num,
+    int first, char **names, int64_t *mtimes, uint8_t **bitmaps, int *found,
+    int *members) {
+  char *index_subdir = files[first].index_subdir;
+  int num_members = 0;
+  for (int i = first; i < num; i++) {
+    if (files[i].pending == 1
+        && strcmp(files[i].index_subdir, index_subdir) == 0) {
+      names[num_members] = files[i].real_path;
+      mtimes[num_members] = files[i].mtime;
+      bitmaps[num_members] = files[i].bitmap;
+      members[num_members] = i;
+      num_members++;
+    }
+  }
+  uint64_t start = stats_clock();
+  errno = 0;
+  int ret = read_from_packfile_batch(names, mtimes, num_members, index_subdir,
+                                     bitmaps, found);
+  if (ret < 0 && errno == ESTALE) {
+    // retry once on stale NFS file handle
+    ret = read_from_packfile_batch(names, mtimes, num_members, index_subdir,
+                                   bitmaps, found);
+    if (ret < 0 && errno == ESTALE) {
+      perrorf("Error checking packfile in %s", index_subdir);
+    }
+  }
+  add_stage_time(STAGE_PACKFILE_LOOKUP, start);
+  for (int m = 0; m < num_members; m++) {
+    struct batch_file *file = &files[members[m]];
+    if (ret >= 0 && found[m]) {
+      count_event(COUNTER_PACKFILE_HITS);
+      file->pending = 0;
+    } else {
+      file->pending = 2;
+    }
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Filters a batch of files as start_filter does each of them, and writes the
+ * result for filenames[i] to results[i].
+ *
+ * The files that the index service does not answer for and that have no
+ * loose bitmap are grouped by the index subdirectory of their mtime, and
+ * each group is looked up in its packfile with one read_from_packfile_batch,
+ * which walks the index once for the group and reads the records in packfile
+ * order. Only the files left over are looked up by content name or have
+ * their bitmaps built, one at a time. The buffers of a batch are kept in
+ * the thread's filter context, so a batch of packed files is filtered
+ * without touching the heap.
+ *
+ * Returns 0, or -1 if the batch could not be set up.
+ */
+int start_filter_batch(struct intarrayarray ngram_filter, char **filenames,
+    int num, char *indexdir, int *results) {
+  if (num <= 0) {
+    return 0;
+  }
+  int ret_val = -1, MTCH = 1, NO_MTCH = 2;
+  uint64_t start = stats_clock();
+  mode_t old_umask = umask(0);
+  struct filter_context *context = get_filter_context();
+  if (context == NULL || reserve_batch(context, num) != 0) {
+    goto OUT1;
+  }
+  struct batch_file *files = context->batch_files;
+
+  for (int i = 0; i < num; i++) {
+    struct batch_file *file = &files[i];
+    file->bitmap = context->batch_bitmaps + (size_t) i * SIZEOF_BITMAP;
+    file->pending = 0;
+    results[i] = filter_through_service(context, ngram_filter, filenames[i],
+                                        indexdir);
+    if (results[i] != SERVICE_UNKNOWN) {
+      continue;
+    }
+    results[i] = -1;
+    uint64_t stage_start = stats_clock();
+    if (realpath(filenames[i], file->real_path) == NULL) {
+      file->real_path[0] = '\0';
+      continue;
+    }
+    file->mtime = get_mtime(file->real_path);
+    add_stage_time(STAGE_RESOLVE, stage_start);
+    index_subdirectory_path(file->index_subdir, indexdir, file->mtime);
+    stage_start = stats_clock();
+    int loose = check_loose_files(file->real_path, file->mtime, file->bitmap,
+                                  file->index_subdir) == 0;
+    add_stage_time(STAGE_LOOSE_PROBE, stage_start);
+    if (loose) {
+      count_event(COUNTER_LOOSE_HITS);
+    } else {
+      file->pending = 1;
+    }
+  }
+
+  for (int i = 0; i < num; i++) {
+    if (files[i].pending == 1) {
+      check_pack_files_batch(files, num, i, context->batch_names,
+                             context->batch_mtimes,
+                             context->batch_member_bitmaps,
+                             context->batch_found, context->batch_members);
+    }
+  }
+
+  for (int i = 0; i < num; i++) {
+    struct batch_file *file = &files[i];
+    if (results[i] != -1 || file->real_path[0] == '\0') {
+      continue;
+    }
+    int bitmap_ret = 0;
+    if (file->pending) {
+      bitmap_ret = find_or_build_bitmap(context, file->bitmap,
+                                        file->real_path, file->mtime,
+                                        file->index_subdir, indexdir);
+      if (bitmap_ret != 0 && bitmap_ret != BITMAP_CREATED) {
+        continue;
+      }
+    }
+    if (should_filter_out_file(file->bitmap, ngram_filter)) {
+      results[i] = NO_MTCH;
+    } else {
+      results[i] = MTCH;
+    }
+    if (bitmap_ret == BITMAP_CREATED) {
+      results[i] += BITMAP_CREATED;
+    }
+  }
+  ret_val = 0;
+
+  OUT1:
+    umask(old_umask);
+    add_stage_time(STAGE_FILTER, start);
+    return ret_val;
+}
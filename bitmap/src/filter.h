@@ -24,7 +24,22 @@ struct intarrayarray strings_to_filter_anded(char **index_strings,
 struct intarrayarray strings_to_filter_orred(char **index_strings,
                                         int num_index_strings);
 
+int get_bitmap_for_file(uint8_t *bitmap, char *filename, char *indexdir);
+
+double get_bitmap_density(char *filename, char *indexdir);
+
+void get_ngram_config(int *ngram_chars, int *ngram_char_bits);
+
+int prefetch_file(char *filename, char *indexdir);
+
 int should_filter_out_file(uint8_t *file_bitmap, struct intarrayarray filter);
+
+int start_filter(struct intarrayarray ngram_filter,
+                 char *filename, char *indexdir);
+
+int start_filter_batch(struct intarrayarray ngram_filter, char **filenames,
+    int num, char *indexdir, int *results);
+
 /*--------------------------------------------------------------------*/
 
 #endif
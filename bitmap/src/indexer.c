@@ -0,0 +1,501 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "indexer.h"
+#include "bitmap.h"
+#include "filter.h"
+#include "packfile.h"
+#include "util.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * A long-running indexer, so that searches find bitmaps already built for the
+ * logs they look at instead of paying for indexing them the first time.
+ *
+ * The main thread watches directory trees with inotify and queues each file
+ * closed after writing or moved into a tree. Worker threads at idle CPU and
+ * I/O priority take the files off the queue once they have been left alone for
+ * settle_msec, and build their bitmaps through get_bitmap_for_file as a search
+ * would. The main thread packs the index every pack_interval_sec.
+ */
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR \
+    | IN_DONT_FOLLOW)
+
+/* ioprio_set(2) has no glibc wrapper or header */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+/* enough for many events, each a struct inotify_event and a name */
+#define EVENT_BUFFER_SIZE (64 * 1024)
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * A file waiting to be indexed: it is left alone until due, and skipped if it
+ * was modified after event_time, as another event is then on its way.
+ */
+struct pending_file {
+  char *path;
+  struct timespec due;
+  struct timespec event_time;
+};
+
+struct indexer {
+  char indexdir[PATH_MAX];
+  size_t indexdir_len;
+  int inotify_fd;
+  char **watch_paths;
+  int num_watch_paths;
+  int settle_msec;
+  struct pending_file *queue;
+  size_t queue_head;
+  size_t queue_len;
+  long dropped;
+  int stopping;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+/*--------------------------------------------------------------------*/
+
+static void add_msec(struct timespec *t, long msec) {
+  t->tv_sec += msec / 1000;
+  t->tv_nsec += (msec % 1000) * 1000000L;
+  if (t->tv_nsec >= 1000000000L) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000L;
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+static int timespec_before(struct timespec *a, struct timespec *b) {
+  return a->tv_sec < b->tv_sec
+    || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns 1 if path is the index directory or inside it, whose files the
+ * indexer writes itself.
+ */
+static int in_indexdir(struct indexer *ix, char *path) {
+  return strncmp(path, ix->indexdir, ix->indexdir_len) == 0
+    && (path[ix->indexdir_len] == '/' || path[ix->indexdir_len] == '\0');
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Queues path to be indexed once it has been left alone for settle_msec.
+ * Drops it if the queue is full.
+ */
+static void queue_file(struct indexer *ix, char *path) {
+  if (in_indexdir(ix, path)) {
+    return;
+  }
+  struct pending_file pending;
+  clock_gettime(CLOCK_REALTIME, &pending.event_time);
+  clock_gettime(CLOCK_MONOTONIC, &pending.due);
+  add_msec(&pending.due, ix->settle_msec);
+  pending.path = strdup(path);
+  if (pending.path == NULL) {
+    perror("Error: Memory not allocated");
+    return;
+  }
+  pthread_mutex_lock(&ix->mutex);
+  if (ix->queue_len == INDEXER_QUEUE_SIZE) {
+    ix->dropped++;
+    pthread_mutex_unlock(&ix->mutex);
+    free(pending.path);
+    return;
+  }
+  ix->queue[(ix->queue_head + ix->queue_len) % INDEXER_QUEUE_SIZE] = pending;
+  ix->queue_len++;
+  pthread_cond_signal(&ix->cond);
+  pthread_mutex_unlock(&ix->mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Remembers the directory a watch descriptor stands for.
+ */
+static int set_watch_path(struct indexer *ix, int wd, char *path) {
+  if (wd >= ix->num_watch_paths) {
+    int num = wd + 1 > 2 * ix->num_watch_paths
+      ? wd + 1 : 2 * ix->num_watch_paths;
+    char **watch_paths = realloc(ix->watch_paths, num * sizeof(char *));
+    if (watch_paths == NULL) {
+      perror("Error: Memory not allocated");
+      return -1;
+    }
+    memset(watch_paths + ix->num_watch_paths, 0,
+           (num - ix->num_watch_paths) * sizeof(char *));
+    ix->watch_paths = watch_paths;
+    ix->num_watch_paths = num;
+  }
+  // a directory moved within the trees keeps its watch descriptor
+  free(ix->watch_paths[wd]);
+  ix->watch_paths[wd] = strdup(path);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Watches the directory tree at path, queueing the files already in it if
+ * scan_existing is set. Symbolic links are not followed.
+ */
+static void watch_tree(struct indexer *ix, char *path, int scan_existing) {
+  if (in_indexdir(ix, path)) {
+    return;
+  }
+  int wd = inotify_add_watch(ix->inotify_fd, path, WATCH_MASK);
+  if (wd == -1) {
+    if (errno == ENOSPC) {
+      fprintf(stderr, "Error watching %s: too many watches, see "
+              "/proc/sys/fs/inotify/max_user_watches\n", path);
+    } else if (errno != ENOENT && errno != ENOTDIR) {
+      perrorf("Error watching %s", path);
+    }
+    return;
+  }
+  if (set_watch_path(ix, wd, path) != 0) {
+    return;
+  }
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char child[PATH_MAX];
+    if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name)
+        >= sizeof(child)) {
+      continue;
+    }
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat s;
+      if (lstat(child, &s) != 0) {
+        continue;
+      }
+      type = S_ISDIR(s.st_mode) ? DT_DIR : S_ISREG(s.st_mode) ? DT_REG : 0;
+    }
+    if (type == DT_DIR) {
+      watch_tree(ix, child, scan_existing);
+    } else if (type == DT_REG && scan_existing) {
+      queue_file(ix, child);
+    }
+  }
+  closedir(dir);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Handles the inotify events in buf.
+ */
+static void handle_events(struct indexer *ix, char *buf, ssize_t len) {
+  struct inotify_event *event;
+  for (char *p = buf; p < buf + len;
+       p += sizeof(struct inotify_event) + event->len) {
+    event = (struct inotify_event *) p;
+    if (event->mask & IN_Q_OVERFLOW) {
+      fprintf(stderr, "Warning: inotify queue overflowed, some files were "
+              "not indexed\n");
+      continue;
+    }
+    if (event->wd < 0 || event->wd >= ix->num_watch_paths
+        || ix->watch_paths[event->wd] == NULL) {
+      continue;
+    }
+    if (event->mask & IN_IGNORED) {
+      // the directory was deleted or unmounted
+      free(ix->watch_paths[event->wd]);
+      ix->watch_paths[event->wd] = NULL;
+      continue;
+    }
+    if (event->len == 0 || event->name[0] == '.') {
+      continue;
+    }
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", ix->watch_paths[event->wd],
+                 event->name) >= sizeof(path)) {
+      continue;
+    }
+    if (event->mask & IN_ISDIR) {
+      if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        // files may have arrived before the new directory was watched
+        watch_tree(ix, path, 1);
+      }
+    } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+      queue_file(ix, path);
+    }
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Moves the calling thread to the lowest CPU priority and the idle I/O class,
+ * so that indexing only uses what searches and other work leave.
+ */
+static void lower_thread_priority() {
+  pid_t tid = syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, tid, INDEXER_NICE);
+#ifdef SYS_ioprio_set
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+          IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Indexes a file taken off the queue, unless it was modified after the event
+ * that queued it.
+ */
+static void index_pending_file(struct indexer *ix,
+    struct pending_file *pending, uint8_t *bitmap) {
+  struct stat s;
+  if (stat(pending->path, &s) != 0 || !S_ISREG(s.st_mode)) {
+    return;
+  }
+  if (timespec_before(&pending->event_time, &s.st_mtim)) {
+    return;
+  }
+  int ret = get_bitmap_for_file(bitmap, pending->path, ix->indexdir);
+  if (ret < 0) {
+    fprintf(stderr, "Error indexing %s\n", pending->path);
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *indexer_worker(void *arg) {
+  struct indexer *ix = arg;
+  lower_thread_priority();
+  uint8_t *bitmap = init_bitmap();
+  if (bitmap == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&ix->mutex);
+  while (!ix->stopping) {
+    if (ix->queue_len == 0) {
+      pthread_cond_wait(&ix->cond, &ix->mutex);
+      continue;
+    }
+    // files are queued in event order, so the head is due first
+    struct pending_file pending = ix->queue[ix->queue_head];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_before(&now, &pending.due)) {
+      pthread_cond_timedwait(&ix->cond, &ix->mutex, &pending.due);
+      continue;
+    }
+    ix->queue_head = (ix->queue_head + 1) % INDEXER_QUEUE_SIZE;
+    ix->queue_len--;
+    pthread_mutex_unlock(&ix->mutex);
+    index_pending_file(ix, &pending, bitmap);
+    free(pending.path);
+    pthread_mutex_lock(&ix->mutex);
+  }
+  pthread_mutex_unlock(&ix->mutex);
+  free(bitmap);
+  return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Watches the directory trees at roots and indexes files into indexdir as
+ * they are written, until the process receives SIGINT or SIGTERM.
+ *
+ * num_threads: indexing threads, run at idle priority
+ * settle_msec: how long a file must be left alone before it is indexed
+ * pack_interval_sec: how often loose bitmaps are packed
+ * scan_existing: whether to also index the files already in the trees
+ *
+ * SIGINT and SIGTERM are blocked while the indexer runs and taken through a
+ * signalfd, so files being indexed are finished and the index packed before
+ * returning. Files still queued are left for searches to index.
+ *
+ * Returns 0 upon success, -1 on error.
+ */
+int run_indexer(char **roots, int num_roots, char *indexdir, int num_threads,
+    int settle_msec, int pack_interval_sec, int scan_existing) {
+  int ret_val = -1;
+  struct indexer ix;
+  memset(&ix, 0, sizeof(ix));
+  if (realpath(indexdir, ix.indexdir) == NULL) {
+    perrorf("Error resolving index directory %s", indexdir);
+    return ret_val;
+  }
+  ix.indexdir_len = strlen(ix.indexdir);
+  ix.settle_msec = settle_msec;
+  ix.queue = malloc(INDEXER_QUEUE_SIZE * sizeof(struct pending_file));
+  pthread_t threads[num_threads];
+  int num_started = 0;
+  if (ix.queue == NULL) {
+    perror("Error: Memory not allocated");
+    return ret_val;
+  }
+  pthread_mutex_init(&ix.mutex, NULL);
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ix.cond, &condattr);
+  pthread_condattr_destroy(&condattr);
+
+  // block the signals before starting threads, so that all of them inherit
+  // the mask and the signals are only ever taken through the signalfd
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+  mode_t old_umask = umask(0);
+  int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  ix.inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (signal_fd == -1 || ix.inotify_fd == -1) {
+    perror("Error setting up indexer");
+    goto OUT1;
+  }
+
+  for (int i = 0; i < num_roots; i++) {
+    char root[PATH_MAX];
+    if (realpath(roots[i], root) == NULL || !is_dir(root)) {
+      fprintf(stderr, "Error: cannot watch %s\n", roots[i]);
+      goto OUT1;
+    }
+    watch_tree(&ix, root, scan_existing);
+  }
+  for (; num_started < num_threads; num_started++) {
+    if (pthread_create(&threads[num_started], NULL, indexer_worker,
+                       &ix) != 0) {
+      perror("Error starting indexer thread");
+      goto OUT1;
+    }
+  }
+
+  char *events = malloc(EVENT_BUFFER_SIZE);
+  if (events == NULL) {
+    perror("Error: Memory not allocated");
+    goto OUT1;
+  }
+  struct timespec next_pack;
+  clock_gettime(CLOCK_MONOTONIC, &next_pack);
+  next_pack.tv_sec += pack_interval_sec;
+  while (1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!timespec_before(&now, &next_pack)) {
+      pack_loose_files(ix.indexdir);
+      clock_gettime(CLOCK_MONOTONIC, &next_pack);
+      next_pack.tv_sec += pack_interval_sec;
+      continue;
+    }
+    int timeout_msec = (next_pack.tv_sec - now.tv_sec) * 1000
+      + (next_pack.tv_nsec - now.tv_nsec) / 1000000 + 1;
+    struct pollfd fds[2] = {
+      { .fd = ix.inotify_fd, .events = POLLIN },
+      { .fd = signal_fd, .events = POLLIN },
+    };
+    if (poll(fds, 2, timeout_msec) < 0 && errno != EINTR) {
+      perror("Error in indexer poll");
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      // take the signal, or it is delivered once the mask is restored
+      struct signalfd_siginfo info;
+      if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        perror("Error reading signal");
+      }
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      ssize_t len;
+      while ((len = read(ix.inotify_fd, events, EVENT_BUFFER_SIZE)) > 0) {
+        handle_events(&ix, events, len);
+      }
+    }
+  }
+  free(events);
+  ret_val = 0;
+
+  OUT1:
+    pthread_mutex_lock(&ix.mutex);
+    ix.stopping = 1;
+    pthread_cond_broadcast(&ix.cond);
+    pthread_mutex_unlock(&ix.mutex);
+    for (int i = 0; i < num_started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    if (ret_val == 0) {
+      pack_loose_files(ix.indexdir);
+    }
+    if (ix.dropped > 0) {
+      fprintf(stderr, "Warning: %ld files were not indexed, the indexer "
+              "queue was full\n", ix.dropped);
+    }
+    for (size_t i = 0; i < ix.queue_len; i++) {
+      free(ix.queue[(ix.queue_head + i) % INDEXER_QUEUE_SIZE].path);
+    }
+    for (int i = 0; i < ix.num_watch_paths; i++) {
+      free(ix.watch_paths[i]);
+    }
+    free(ix.watch_paths);
+    free(ix.queue);
+    if (ix.inotify_fd != -1) {
+      close(ix.inotify_fd);
+    }
+    if (signal_fd != -1) {
+      close(signal_fd);
+    }
+    pthread_cond_destroy(&ix.cond);
+    pthread_mutex_destroy(&ix.mutex);
+    umask(old_umask);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+#else
+
+int run_indexer(char **roots, int num_roots, char *indexdir, int num_threads,
+    int settle_msec, int pack_interval_sec, int scan_existing) {
+  fprintf(stderr, "Error: the indexer needs inotify, which is Linux only\n");
+  return -1;
+}
+
+#endif
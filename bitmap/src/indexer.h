@@ -0,0 +1,19 @@
+#ifndef INDEXER_INCLUDED
+#define INDEXER_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+/* most files waiting to be indexed; further events are dropped */
+#define INDEXER_QUEUE_SIZE 65536
+
+/* nice value of the indexing threads */
+#define INDEXER_NICE 19
+
+/*--------------------------------------------------------------------*/
+
+int run_indexer(char **roots, int num_roots, char *indexdir, int num_threads,
+    int settle_msec, int pack_interval_sec, int scan_existing);
+
+/*--------------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,1045 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <zstd.h>
+#include <zlib.h>
+
+#include "looselog.h"
+#include "bitmap.h"
+#include "snapshot.h"
+#include "util.h"
+#include "xxhash.h"
+#include "portable_endian.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * Loose logs are the alternative to writing every new bitmap to a loose file
+ * of its own: each process appends the records it would have written as
+ * loose files to a log of its own in the index subdirectory, each framed by
+ * LOOSE_LOG_MAGIC, its length and its crc32, so that a record torn by a crash
+ * is recognized. On NFS this trades the creation of an inode per bitmap for
+ * an append, and packing reads a few logs instead of a file per bitmap.
+ *
+ * An append holds a shared flock of the log, and a pack run an exclusive one
+ * while it merges the log into the packfile and then unlinks it. A writer
+ * that finds its log locked or no longer under its name moves on to a new
+ * log, so it never waits for a pack run. The name is what tells: on NFS, a
+ * log unlinked while another process of the same client has it open is only
+ * renamed to .nfsXXXX, and keeps a link count of 1.
+ *
+ * Readers keep an index of the records in each directory's logs in memory,
+ * refreshed like the snapshots of loose files.
+ */
+
+/* most directories a process keeps log indexes of at once */
+#define LOG_CACHE_SIZE 64
+
+/* logs a writer tries before giving up on an append */
+#define LOG_OPEN_ATTEMPTS 8
+
+/* the largest record body: a loose file record of the longest name */
+#define MAX_RECORD_SIZE (sizeof(uint16_t) + UINT16_MAX + sizeof(int64_t) \
+                         + sizeof(uint32_t) + ESTIMATED_ZSTD_SIZE)
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * The log a process appends to in one directory. The log belongs to the
+ * process with the given pid, so a forked child starts one of its own.
+ */
+struct log_writer {
+  char *directory;
+  char name[NAME_MAX + 1];
+  pid_t pid;
+  int fd;
+  int sequence;
+  struct log_writer *next;
+};
+
+/**
+ * A log known to a directory's index, of which the first indexed bytes have
+ * been read.
+ */
+struct log_file {
+  char *name;
+  ino_t ino;
+  off_t indexed;
+};
+
+/**
+ * A record in a log: the loose file record of length bytes at offset, past
+ * its header. An offset of 0 marks an empty slot.
+ */
+struct log_record {
+  uint64_t hash;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t log;
+};
+
+/**
+ * The records in the logs of one directory, as an open-addressed hash table
+ * keyed by filename hash, which may hold several records for one hash.
+ */
+struct dir_logs {
+  char *directory;
+  struct timespec dir_mtime;
+  struct timespec checked;
+  int racy;
+  struct log_file *logs;
+  int num_logs;
+  struct log_record *records;
+  size_t capacity;
+  size_t num_records;
+  struct dir_logs *next;
+};
+
+/**
+ * A record found for a lookup, copied out so that it can be read without
+ * holding the index's mutex.
+ */
+struct log_candidate {
+  char name[NAME_MAX + 1];
+  ino_t ino;
+  uint64_t offset;
+  uint32_t length;
+};
+
+static int logs_enabled = 0;
+static struct log_writer *writers = NULL;
+static pthread_mutex_t writers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dir_logs *indexes = NULL;
+static pthread_mutex_t indexes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Makes get_bitmap_for_file store new bitmaps in loose logs instead of loose
+ * files. Lookups always check both.
+ */
+void enable_loose_logs(int enabled) {
+  logs_enabled = enabled;
+}
+
+/*--------------------------------------------------------------------*/
+
+int loose_logs_enabled() {
+  return logs_enabled;
+}
+
+/*--------------------------------------------------------------------*/
+
+static int is_log_name(const char *name) {
+  return strncmp(name, LOOSE_LOG_PREFIX, strlen(LOOSE_LOG_PREFIX)) == 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Checks the header of a record, whose body follows, and returns the length
+ * and crc32 of the body in length and crc.
+ *
+ * Returns 0 upon success, -1 if the header is not that of a record.
+ */
+static int parse_record_header(const uint8_t *header, uint32_t *length,
+    uint32_t *crc) {
+  uint32_t fields[3];
+  memcpy(fields, header, sizeof(fields));
+  if (be32toh(fields[0]) != LOOSE_LOG_MAGIC
+      || be32toh(fields[1]) > MAX_RECORD_SIZE) {
+    return -1;
+  }
+  *length = be32toh(fields[1]);
+  *crc = be32toh(fields[2]);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Parses the body of a record, which is laid out as a loose file is.
+ * Returns 0 and points name, and compressed unless it is NULL, into body
+ * upon success, -1 if the body is malformed.
+ */
+static int parse_record_body(uint8_t *body, uint32_t length, char **name,
+    uint16_t *name_len, int64_t *mtime, uint8_t **compressed,
+    uint32_t *compressed_size) {
+  if (length < sizeof(uint16_t)) {
+    return -1;
+  }
+  uint16_t len;
+  memcpy(&len, body, sizeof(uint16_t));
+  len = be16toh(len);
+  size_t header_len = sizeof(uint16_t) + len + sizeof(int64_t)
+    + sizeof(uint32_t);
+  if (length < header_len) {
+    return -1;
+  }
+  int64_t t;
+  memcpy(&t, body + sizeof(uint16_t) + len, sizeof(int64_t));
+  uint32_t size;
+  memcpy(&size, body + header_len - sizeof(uint32_t), sizeof(uint32_t));
+  size = be32toh(size);
+  if (length != header_len + size) {
+    return -1;
+  }
+  *name = (char *) body + sizeof(uint16_t);
+  *name_len = len;
+  *mtime = be64toh(t);
+  if (compressed != NULL) {
+    *compressed = body + header_len;
+    *compressed_size = size;
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the writer of this process for directory, creating it if needed.
+ * Must be called with writers_mutex held.
+ */
+static struct log_writer *get_writer(char *directory) {
+  pid_t pid = getpid();
+  for (struct log_writer *w = writers; w; w = w->next) {
+    if (strcmp(w->directory, directory) == 0) {
+      if (w->pid != pid) {
+        // inherited from the parent, whose log is not ours to append to
+        if (w->fd != -1) {
+          close(w->fd);
+        }
+        w->fd = -1;
+        w->pid = pid;
+        w->sequence = 0;
+      }
+      return w;
+    }
+  }
+  struct log_writer *w = calloc(1, sizeof(*w));
+  if (w == NULL || (w->directory = strdup(directory)) == NULL) {
+    perror("Error: Memory not allocated");
+    free(w);
+    return NULL;
+  }
+  w->pid = pid;
+  w->fd = -1;
+  w->next = writers;
+  writers = w;
+  return w;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Stats the open log fd into s and checks that path still names it.
+ *
+ * Returns 1 if it does, 0 if the log was removed or replaced, -1 on error.
+ */
+static int is_linked_as(int fd, char *path, struct stat *s) {
+  if (fstat(fd, s) != 0) {
+    return -1;
+  }
+  struct stat named;
+  if (stat(path, &named) != 0) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  return named.st_dev == s->st_dev && named.st_ino == s->st_ino;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Opens the next log of this process in the writer's directory.
+ *
+ * Returns 0 upon success, -1 on error.
+ */
+static int open_next_log(struct log_writer *w) {
+  char host[HOST_NAME_MAX + 1];
+  if (gethostname(host, sizeof(host)) != 0) {
+    strcpy(host, "localhost");
+  }
+  host[HOST_NAME_MAX] = '\0';
+  if (w->fd != -1) {
+    close(w->fd);
+  }
+  w->sequence++;
+  snprintf(w->name, sizeof(w->name), LOOSE_LOG_PREFIX "%s.%d.%d", host,
+           (int) w->pid, w->sequence);
+  char *path = add_path_parts(w->directory, w->name);
+  w->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (w->fd == -1) {
+    perrorf("Error: Loose log not opened: %s", path);
+  }
+  free(path);
+  return w->fd == -1 ? -1 : 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Appends record to the writer's log with a single write, moving on to a new
+ * log if a pack run is merging or has merged the current one. Must be called
+ * with writers_mutex held, which makes this thread the log's only writer.
+ *
+ * Returns 0 and sets offset and ino to where the record went upon success,
+ * -1 on error.
+ */
+static int write_record(struct log_writer *w, char *record, size_t len,
+    off_t *offset, ino_t *ino) {
+  for (int attempt = 0; attempt < LOG_OPEN_ATTEMPTS; attempt++) {
+    if (w->fd == -1 && open_next_log(w) != 0) {
+      return -1;
+    }
+    if (flock(w->fd, LOCK_SH | LOCK_NB) != 0) {
+      if (errno != EWOULDBLOCK) {
+        perror("Error: Loose log not locked");
+        return -1;
+      }
+      close(w->fd);
+      w->fd = -1;
+      continue;
+    }
+    struct stat s;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", w->directory, w->name);
+    int linked = is_linked_as(w->fd, path, &s);
+    if (linked < 0) {
+      perror("Error: Loose log not read");
+      flock(w->fd, LOCK_UN);
+      return -1;
+    }
+    if (!linked) {
+      // merged into the packfile and removed
+      flock(w->fd, LOCK_UN);
+      close(w->fd);
+      w->fd = -1;
+      continue;
+    }
+    ssize_t written = write(w->fd, record, len);
+    if (written != (ssize_t) len) {
+      perror("Error: Loose log not written");
+      if (written > 0 && ftruncate(w->fd, s.st_size) != 0) {
+        // readers and the packer stop at the torn record, so move on
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+      }
+      flock(w->fd, LOCK_UN);
+      return -1;
+    }
+    flock(w->fd, LOCK_UN);
+    *offset = s.st_size;
+    *ino = s.st_ino;
+    return 0;
+  }
+  fprintf(stderr, "Error: No loose log to append to in %s\n", w->directory);
+  return -1;
+}
+
+/*--------------------------------------------------------------------*/
+
+static struct log_record *find_empty_slot(struct log_record *records,
+    size_t capacity, uint64_t hash) {
+  size_t i = hash & (capacity - 1);
+  while (records[i].offset != 0) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &records[i];
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Adds record to the index.
+ *
+ * Returns 0 upon success, -1 if memory could not be allocated.
+ */
+static int insert_record(struct dir_logs *d, struct log_record record) {
+  if (2 * (d->num_records + 1) > d->capacity) {
+    size_t capacity = d->capacity ? 2 * d->capacity : 64;
+    struct log_record *records = calloc(capacity, sizeof(*records));
+    if (records == NULL) {
+      perror("Error: Memory not allocated");
+      return -1;
+    }
+    for (size_t i = 0; i < d->capacity; i++) {
+      if (d->records[i].offset != 0) {
+        *find_empty_slot(records, capacity, d->records[i].hash) =
+          d->records[i];
+      }
+    }
+    free(d->records);
+    d->records = records;
+    d->capacity = capacity;
+  }
+  *find_empty_slot(d->records, d->capacity, record.hash) = record;
+  d->num_records++;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Adds a log named name to the index.
+ *
+ * Returns its position upon success, -1 if memory could not be allocated.
+ */
+static int add_log(struct dir_logs *d, const char *name) {
+  struct log_file *logs = realloc(d->logs, (d->num_logs + 1) * sizeof(*logs));
+  if (logs == NULL) {
+    perror("Error: Memory not allocated");
+    return -1;
+  }
+  d->logs = logs;
+  struct log_file *log = &d->logs[d->num_logs];
+  log->name = strdup(name);
+  if (log->name == NULL) {
+    perror("Error: Memory not allocated");
+    return -1;
+  }
+  log->ino = 0;
+  log->indexed = 0;
+  return d->num_logs++;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Forgets every log and record of the index.
+ */
+static void reset_dir_logs(struct dir_logs *d) {
+  for (int i = 0; i < d->num_logs; i++) {
+    free(d->logs[i].name);
+  }
+  free(d->logs);
+  d->logs = NULL;
+  d->num_logs = 0;
+  if (d->records != NULL) {
+    memset(d->records, 0, d->capacity * sizeof(*d->records));
+  }
+  d->num_records = 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Adds the logs in the index's directory that it does not know yet.
+ *
+ * Returns 1 if a log it knew is gone, merged by a pack run, so that its
+ * records must be dropped, 0 otherwise.
+ */
+static int list_logs(struct dir_logs *d) {
+  struct stat s;
+  if (stat(d->directory, &s) != 0) {
+    memset(&d->dir_mtime, 0, sizeof(d->dir_mtime));
+    d->racy = 1;
+    return d->num_logs > 0;
+  }
+  // see rebuild_snapshot
+  d->dir_mtime = s.st_mtim;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  d->racy = now.tv_sec - s.st_mtim.tv_sec < SNAPSHOT_RACY_SEC;
+
+  DIR *dir = opendir(d->directory);
+  if (dir == NULL) {
+    d->racy = 1;
+    return 0;
+  }
+  int known = d->num_logs;
+  int num_seen = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (!is_log_name(entry->d_name)) {
+      continue;
+    }
+    int i = 0;
+    while (i < known && strcmp(d->logs[i].name, entry->d_name) != 0) {
+      i++;
+    }
+    if (i < known) {
+      num_seen++;
+    } else if (add_log(d, entry->d_name) < 0) {
+      d->racy = 1;
+      break;
+    }
+  }
+  closedir(dir);
+  return num_seen < known;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Indexes the records appended to the ith log since it was last read, up to
+ * the first one that is incomplete or torn.
+ *
+ * Returns -1 if the log is gone or was replaced by another of its name, so
+ * that its records must be dropped, 0 otherwise.
+ */
+static int scan_log(struct dir_logs *d, int i) {
+  struct log_file *log = &d->logs[i];
+  char *path = add_path_parts(d->directory, log->name);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd == -1) {
+    return errno == ENOENT ? -1 : 0;
+  }
+  struct stat s;
+  if (fstat(fd, &s) != 0) {
+    close(fd);
+    return 0;
+  }
+  if (log->ino != 0 && log->ino != s.st_ino) {
+    close(fd);
+    return -1;
+  }
+  log->ino = s.st_ino;
+  uint8_t *body = NULL;
+  while (s.st_size - log->indexed >= LOOSE_LOG_HEADER_SIZE) {
+    uint8_t header[LOOSE_LOG_HEADER_SIZE];
+    uint32_t length, crc;
+    if (pread(fd, header, sizeof(header), log->indexed) != sizeof(header)
+        || parse_record_header(header, &length, &crc) != 0
+        || s.st_size - log->indexed - LOOSE_LOG_HEADER_SIZE < length) {
+      break;
+    }
+    uint8_t *tmp = realloc(body, length ? length : 1);
+    if (tmp == NULL) {
+      break;
+    }
+    body = tmp;
+    char *name;
+    uint16_t name_len;
+    int64_t mtime;
+    if (pread(fd, body, length, log->indexed + LOOSE_LOG_HEADER_SIZE)
+          != length
+        || crc32(0, body, length) != crc
+        || parse_record_body(body, length, &name, &name_len, &mtime, NULL,
+                             NULL) != 0) {
+      break;
+    }
+    struct log_record record = {
+      .hash = XXH64(name, name_len, HASH_SEED),
+      .offset = log->indexed + LOOSE_LOG_HEADER_SIZE,
+      .length = length,
+      .log = i,
+    };
+    if (insert_record(d, record) != 0) {
+      break;
+    }
+    log->indexed += LOOSE_LOG_HEADER_SIZE + length;
+  }
+  free(body);
+  close(fd);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the records appended to the index's logs since it was last
+ * refreshed, relisting the directory first if relist is set. If a pack run
+ * merged some of the logs meanwhile, the index is rebuilt from scratch.
+ */
+static void refresh_dir_logs(struct dir_logs *d, int relist) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int stale = relist && list_logs(d);
+    for (int i = 0; !stale && i < d->num_logs; i++) {
+      stale = scan_log(d, i) != 0;
+    }
+    if (!stale) {
+      return;
+    }
+    reset_dir_logs(d);
+    relist = 1;
+  }
+  d->racy = 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void free_dir_logs(struct dir_logs *d) {
+  reset_dir_logs(d);
+  free(d->records);
+  free(d->directory);
+  free(d);
+}
+
+/*--------------------------------------------------------------------*/
+
+static int64_t elapsed_nsec(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L
+    + (to->tv_nsec - from->tv_nsec);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the log index of directory, creating or refreshing it as needed.
+ * Like the snapshots of loose files, it is refreshed at most every
+ * SNAPSHOT_RECHECK_NSEC, and relisted only when the directory's mtime
+ * changes. Must be called with indexes_mutex held.
+ */
+static struct dir_logs *get_dir_logs(char *directory) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+  struct dir_logs **prev = &indexes;
+  int num_indexes = 0;
+  for (struct dir_logs *d = indexes; d; d = d->next) {
+    if (strcmp(d->directory, directory) == 0) {
+      if (elapsed_nsec(&d->checked, &now) >= SNAPSHOT_RECHECK_NSEC) {
+        struct stat s;
+        int relist = d->racy || stat(directory, &s) != 0
+          || s.st_mtim.tv_sec != d->dir_mtime.tv_sec
+          || s.st_mtim.tv_nsec != d->dir_mtime.tv_nsec;
+        refresh_dir_logs(d, relist);
+        d->checked = now;
+      }
+      return d;
+    }
+    num_indexes++;
+    if (d->next != NULL) {
+      prev = &d->next;
+    }
+  }
+
+  if (num_indexes >= LOG_CACHE_SIZE) {
+    // evict the least recently created index, at the end of the list
+    struct dir_logs *evicted = *prev;
+    *prev = NULL;
+    free_dir_logs(evicted);
+  }
+  struct dir_logs *d = calloc(1, sizeof(*d));
+  if (d == NULL || (d->directory = strdup(directory)) == NULL) {
+    perror("Error: Memory not allocated");
+    free(d);
+    return NULL;
+  }
+  refresh_dir_logs(d, 1);
+  d->checked = now;
+  d->next = indexes;
+  indexes = d;
+  return d;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Adds a record this process just appended to the index of directory, if it
+ * has one, so that the process finds it again before the index is next
+ * refreshed. Records the index has not caught up to are left to the refresh.
+ */
+static void note_log_record(char *directory, char *log_name, ino_t ino,
+    off_t offset, uint32_t length, uint64_t hash) {
+  pthread_mutex_lock(&indexes_mutex);
+  for (struct dir_logs *d = indexes; d; d = d->next) {
+    if (strcmp(d->directory, directory) != 0) {
+      continue;
+    }
+    int i = 0;
+    while (i < d->num_logs && strcmp(d->logs[i].name, log_name) != 0) {
+      i++;
+    }
+    if (i == d->num_logs && (offset != 0 || add_log(d, log_name) < 0)) {
+      break;
+    }
+    struct log_file *log = &d->logs[i];
+    if ((log->ino == 0 || log->ino == ino) && log->indexed == offset) {
+      struct log_record record = {
+        .hash = hash,
+        .offset = offset + LOOSE_LOG_HEADER_SIZE,
+        .length = length,
+        .log = i,
+      };
+      if (insert_record(d, record) == 0) {
+        log->ino = ino;
+        log->indexed = offset + LOOSE_LOG_HEADER_SIZE + length;
+      }
+    }
+    break;
+  }
+  pthread_mutex_unlock(&indexes_mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Compresses the bitmap into a record appended to this process's loose log
+ * in directory, for the file with the given name and mtime.
+ *
+ * Returns 0 upon success, -1 on error.
+ */
+int append_to_loose_log(uint8_t *bitmap, char *filename, int64_t mtime,
+    char *directory) {
+  char *record = NULL;
+  size_t record_len = 0;
+  FILE *fp = open_memstream(&record, &record_len);
+  if (fp == NULL) {
+    perror("Error: Memory not allocated");
+    return -1;
+  }
+  // room for the header, filled in once the body is written
+  uint8_t header[LOOSE_LOG_HEADER_SIZE] = {0};
+  int ret = -1;
+  if (fwrite(header, sizeof(header), 1, fp) == 1) {
+    ret = compress_to_fp(bitmap, fp, filename, mtime, directory);
+  }
+  if (fclose(fp) != 0) {
+    ret = -1;
+  }
+  if (ret != 0) {
+    free(record);
+    return -1;
+  }
+  uint32_t length = record_len - LOOSE_LOG_HEADER_SIZE;
+  uint32_t fields[3] = {
+    htobe32(LOOSE_LOG_MAGIC),
+    htobe32(length),
+    htobe32(crc32(0, (uint8_t *) record + LOOSE_LOG_HEADER_SIZE, length)),
+  };
+  memcpy(record, fields, sizeof(fields));
+
+  char log_name[NAME_MAX + 1];
+  off_t offset;
+  ino_t ino;
+  pthread_mutex_lock(&writers_mutex);
+  struct log_writer *w = get_writer(directory);
+  if (w != NULL) {
+    ret = write_record(w, record, record_len, &offset, &ino);
+    strcpy(log_name, w->name);
+  } else {
+    ret = -1;
+  }
+  pthread_mutex_unlock(&writers_mutex);
+  free(record);
+  if (ret == 0) {
+    note_log_record(directory, log_name, ino, offset, length,
+                    XXH64(filename, strlen(filename), HASH_SEED));
+  }
+  return ret;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the record of a lookup into bitmap if it is the one for filename and
+ * mtime. The record is checked again, as its log may have been merged and
+ * replaced by another of the same name since it was indexed.
+ *
+ * Returns 0 upon success, -1 otherwise.
+ */
+static int read_log_record(char *directory, struct log_candidate *c,
+    char *filename, size_t len, int64_t mtime, uint8_t *bitmap) {
+  char *path = add_path_parts(directory, c->name);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd == -1) {
+    // merged into the packfile meanwhile
+    return -1;
+  }
+  int ret_val = -1;
+  size_t record_len = LOOSE_LOG_HEADER_SIZE + c->length;
+  uint8_t *record = malloc(record_len);
+  struct stat s;
+  if (record == NULL || fstat(fd, &s) != 0 || s.st_ino != c->ino
+      || pread(fd, record, record_len, c->offset - LOOSE_LOG_HEADER_SIZE)
+         != (ssize_t) record_len) {
+    goto OUT;
+  }
+  uint32_t length, crc;
+  char *name;
+  uint16_t name_len;
+  int64_t record_mtime;
+  uint8_t *compressed;
+  uint32_t compressed_size;
+  uint8_t *body = record + LOOSE_LOG_HEADER_SIZE;
+  if (parse_record_header(record, &length, &crc) != 0
+      || length != c->length || crc32(0, body, length) != crc
+      || parse_record_body(body, length, &name, &name_len, &record_mtime,
+                           &compressed, &compressed_size) != 0
+      || name_len != len || memcmp(name, filename, len) != 0
+      || record_mtime != mtime) {
+    goto OUT;
+  }
+  size_t size = decompress_bitmap(bitmap, compressed, compressed_size,
+                                  directory);
+  if (ZSTD_isError(size)) {
+    fprintf(stderr, "Error in decompression of a record in %s/%s: %s\n",
+            directory, c->name, ZSTD_getErrorName(size));
+    goto OUT;
+  }
+  ret_val = 0;
+
+  OUT:
+    free(record);
+    close(fd);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Checks the loose logs in directory for a bitmap of the file with the given
+ * name and mtime, and reads it into bitmap if there is one.
+ *
+ * Usually a directory has no logs, which the index answers without system
+ * calls; logs appended to by other processes may be missed for up to
+ * SNAPSHOT_RECHECK_NSEC.
+ *
+ * Returns 0 if the bitmap was found, -1 otherwise.
+ */
+int check_loose_logs(char *filename, int64_t mtime, uint8_t *bitmap,
+    char *directory) {
+  size_t len = strlen(filename);
+  uint64_t hash = XXH64(filename, len, HASH_SEED);
+  struct log_candidate candidates[LOOSE_LOG_MAX_CANDIDATES];
+  int num_candidates = 0;
+  pthread_mutex_lock(&indexes_mutex);
+  struct dir_logs *d = get_dir_logs(directory);
+  if (d != NULL && d->num_records > 0) {
+    size_t i = hash & (d->capacity - 1);
+    while (d->records[i].offset != 0
+           && num_candidates < LOOSE_LOG_MAX_CANDIDATES) {
+      struct log_record *r = &d->records[i];
+      if (r->hash == hash) {
+        struct log_candidate *c = &candidates[num_candidates++];
+        struct log_file *log = &d->logs[r->log];
+        snprintf(c->name, sizeof(c->name), "%s", log->name);
+        c->ino = log->ino;
+        c->offset = r->offset;
+        c->length = r->length;
+      }
+      i = (i + 1) & (d->capacity - 1);
+    }
+  }
+  pthread_mutex_unlock(&indexes_mutex);
+
+  // later records for a path are further along its probe sequence
+  for (int i = num_candidates - 1; i >= 0; i--) {
+    if (read_log_record(directory, &candidates[i], filename, len, mtime,
+                        bitmap) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the number of loose logs in directory, or -1 on error.
+ */
+int count_loose_logs(char *directory) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    perrorf("Error in opening directory: %s", directory);
+    return -1;
+  }
+  int num_logs = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (is_log_name(entry->d_name)) {
+      num_logs++;
+    }
+  }
+  closedir(dir);
+  return num_logs;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns how many of the first size bytes of a log's data are whole,
+ * intact records, and counts them in num_records.
+ */
+static size_t intact_length(uint8_t *data, size_t size, int *num_records) {
+  size_t pos = 0;
+  *num_records = 0;
+  while (size - pos >= LOOSE_LOG_HEADER_SIZE) {
+    uint32_t length, crc;
+    if (parse_record_header(data + pos, &length, &crc) != 0
+        || size - pos - LOOSE_LOG_HEADER_SIZE < length
+        || crc32(0, data + pos + LOOSE_LOG_HEADER_SIZE, length) != crc) {
+      break;
+    }
+    pos += LOOSE_LOG_HEADER_SIZE + length;
+    (*num_records)++;
+  }
+  return pos;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Appends the intact records of a log's data to the packfile and their index
+ * entries to *entries.
+ *
+ * Returns 0 upon success, -1 on error.
+ */
+static int merge_log_data(uint8_t *data, size_t size, char *path,
+    FILE *packfile, struct index_entry **entries, int *num_entries,
+    struct dict_samples *samples) {
+  int num_records;
+  size_t end = intact_length(data, size, &num_records);
+  if (end < size) {
+    fprintf(stderr, "Dropping %zu bytes of torn records from %s\n",
+            size - end, path);
+  }
+  struct index_entry *grown = realloc(*entries,
+      (*num_entries + num_records + 1) * sizeof(struct index_entry));
+  if (grown == NULL) {
+    perror("Error: Memory not allocated");
+    return -1;
+  }
+  *entries = grown;
+  for (size_t pos = 0; pos < end; ) {
+    uint32_t length = 0, crc;
+    parse_record_header(data + pos, &length, &crc);
+    uint8_t *body = data + pos + LOOSE_LOG_HEADER_SIZE;
+    pos += LOOSE_LOG_HEADER_SIZE + length;
+    char *name;
+    uint16_t name_len;
+    int64_t mtime;
+    if (parse_record_body(body, length, &name, &name_len, &mtime, NULL,
+                          NULL) != 0) {
+      continue;
+    }
+    long offset = write_data_to_packfile(body, length, packfile);
+    if (offset < 0) {
+      return -1;
+    }
+    grown[*num_entries].hash = XXH64(name, name_len, HASH_SEED);
+    grown[*num_entries].packfile_offset = htobe64(offset);
+    (*num_entries)++;
+    if (samples != NULL) {
+      add_dict_sample(samples, body, length);
+    }
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Remembers a log being merged, locked by fd.
+ *
+ * Returns 0 upon success, -1 if memory could not be allocated.
+ */
+static int add_merged_log(struct merged_logs *merged, char *path, int fd) {
+  char **paths = realloc(merged->paths,
+                         (merged->num_logs + 1) * sizeof(char *));
+  if (paths != NULL) {
+    merged->paths = paths;
+  }
+  int *fds = realloc(merged->fds, (merged->num_logs + 1) * sizeof(int));
+  if (fds != NULL) {
+    merged->fds = fds;
+  }
+  if (paths == NULL || fds == NULL) {
+    perror("Error: Memory not allocated");
+    return -1;
+  }
+  merged->paths[merged->num_logs] = path;
+  merged->fds[merged->num_logs] = fd;
+  merged->num_logs++;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Appends the records of every loose log in directory to the packfile, and
+ * their index entries to *entries, which is grown to fit them. Their bitmaps
+ * are sampled into samples unless it is NULL.
+ *
+ * Each log is locked while it is read, which waits for an append in
+ * progress and makes later appends go to a new log, and stays locked in
+ * merged until release_merged_logs removes it, once the index holds its
+ * records. A torn record at the end of a log, left by a crash, is dropped.
+ *
+ * Returns 0 upon success, -1 on error, in which case the entries already
+ * added are still valid.
+ */
+int merge_loose_logs(char *directory, FILE *packfile,
+    struct index_entry **entries, int *num_entries,
+    struct dict_samples *samples, struct merged_logs *merged) {
+  memset(merged, 0, sizeof(*merged));
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    perrorf("Error in opening directory: %s", directory);
+    return -1;
+  }
+  int ret_val = -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (!is_log_name(entry->d_name)) {
+      continue;
+    }
+    char *path = add_path_parts(directory, entry->d_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat s;
+    uint8_t *data = NULL;
+    if (fd == -1 || flock(fd, LOCK_EX) != 0 || is_linked_as(fd, path, &s) != 1
+        || (data = malloc(s.st_size ? s.st_size : 1)) == NULL
+        || pread(fd, data, s.st_size, 0) != s.st_size) {
+      // gone, or left for the next pack run
+      free(data);
+      if (fd != -1) {
+        close(fd);
+      }
+      free(path);
+      continue;
+    }
+    if (add_merged_log(merged, path, fd) != 0) {
+      free(data);
+      close(fd);
+      free(path);
+      goto OUT;
+    }
+    int ret = merge_log_data(data, s.st_size, path, packfile, entries,
+                             num_entries, samples);
+    free(data);
+    if (ret != 0) {
+      goto OUT;
+    }
+  }
+  ret_val = 0;
+
+  OUT:
+    closedir(dir);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Unlocks the logs of a merge, removing them first if remove_logs is set.
+ */
+void release_merged_logs(struct merged_logs *merged, int remove_logs) {
+  for (int i = 0; i < merged->num_logs; i++) {
+    if (remove_logs) {
+      unlink(merged->paths[i]);
+    }
+    close(merged->fds[i]);
+    free(merged->paths[i]);
+  }
+  free(merged->paths);
+  free(merged->fds);
+  memset(merged, 0, sizeof(*merged));
+}
@@ -0,0 +1,58 @@
+#ifndef LOOSELOG_INCLUDED
+#define LOOSELOG_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "packfile.h"
+#include "dict.h"
+
+/*--------------------------------------------------------------------*/
+
+/* loose logs are named .log.<host>.<pid>.<n>, so the packer skips them */
+#define LOOSE_LOG_PREFIX ".log."
+
+/* every record in a loose log starts with this, then its length and crc */
+#define LOOSE_LOG_MAGIC 0x3467726c
+#define LOOSE_LOG_HEADER_SIZE 12
+
+/* most records for one filename hash a lookup tries, newest first */
+#define LOOSE_LOG_MAX_CANDIDATES 16
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * The loose logs of a directory that a pack run merged, held locked until
+ * they are removed or given back.
+ */
+struct merged_logs {
+  char **paths;
+  int *fds;
+  int num_logs;
+};
+
+/*--------------------------------------------------------------------*/
+
+void enable_loose_logs(int enabled);
+
+int loose_logs_enabled();
+
+int append_to_loose_log(uint8_t *bitmap, char *filename, int64_t mtime,
+    char *directory);
+
+int check_loose_logs(char *filename, int64_t mtime, uint8_t *bitmap,
+    char *directory);
+
+int count_loose_logs(char *directory);
+
+int merge_loose_logs(char *directory, FILE *packfile,
+    struct index_entry **entries, int *num_entries,
+    struct dict_samples *samples, struct merged_logs *merged);
+
+void release_merged_logs(struct merged_logs *merged, int remove_logs);
+
+/*--------------------------------------------------------------------*/
+
+#endif
@@ -8,7 +8,6 @@
 #include <string.h>
 #include <dirent.h>
 #include <stdint.h>
-#include <assert.h>
 #include <zstd.h>
 #include <errno.h>
 #include <lockfile.h>
@@ -19,18 +18,48 @@
 #include "util.h"
 #include "xxhash.h"
 #include "packfile.h"
+#include "segment.h"
+#include "bloom.h"
+#include "looselog.h"
+#include "uring.h"
+#include "dict.h"
+#include "content.h"
+#include "stats.h"
 #include "portable_endian.h"
 
 /*--------------------------------------------------------------------*/
 
-/** An entry in the index.
- * Note: in order to allow mmaping the index file, this struct stores
- * packfile_offset as big-endian!
- */
-struct index_entry {
-  uint64_t hash;
-  uint64_t packfile_offset;
-};
+/* enough to cover the header, name and compressed bitmap of one record */
+#define PREFETCH_RECORD_BYTES (64 * 1024)
+
+/* how much of a record read_from_packfile reads before parsing its header */
+#define RECORD_READ_SIZE 8192
+
+/* most files read_from_packfile_batch looks up in one pass over the index,
+ * and most records one pass reads before it reads them in packfile order */
+#define PACKFILE_BATCH_MAX 64
+#define BATCH_READS_MAX (4 * PACKFILE_BATCH_MAX)
+
+/* most packfiles a process keeps open at once */
+#define PACKFILE_CACHE_SIZE 64
+
+/* times a reader reopens an index whose packfile compaction is replacing */
+#define PACKFILE_OPEN_ATTEMPTS 3
+
+/* ranges at most this long are finished with a binary search */
+#define INTERPOLATION_CUTOFF 16
+
+/* interpolation steps tried before falling back to a binary search */
+#define INTERPOLATION_MAX_STEPS 8
+
+/* segments merged at once, and the size ratio between merge tiers */
+#define SEGMENT_MERGE_FANIN 4
+
+/* entries in a segment of the lowest merge tier, about one pack run */
+#define SEGMENT_TIER_ENTRIES 1000
+
+/* segments are folded into the base index once they hold 1/N of its size */
+#define BASE_MERGE_RATIO 2
 
 /*--------------------------------------------------------------------*/
 
@@ -86,6 +115,40 @@ int is_corrupted(FILE* loosefile) {
 
 /*--------------------------------------------------------------------*/
 
+/**
+ * Like is_corrupted, but checks a whole loose file already read into memory.
+ * Returns 0 if no error, returns EMPTY_FILE if loose file is empty,
+ * returns -1 if the file is corrupted.
+ */
+int is_buffer_corrupted(uint8_t *data, size_t size) {
+  uint16_t len;
+  uint32_t compressed_size;
+
+  if (size == 0) {
+    return EMPTY_FILE;
+  }
+  if (size < sizeof(uint16_t)) {
+    return(-1);
+  }
+  memcpy(&len, data, sizeof(uint16_t));
+  len = be16toh(len);
+  size_t size_offset = sizeof(uint16_t) + len + sizeof(int64_t);
+  if (size < size_offset + sizeof(uint32_t)) {
+    return(-1);
+  }
+  memcpy(&compressed_size, data + size_offset, sizeof(uint32_t));
+  compressed_size = be32toh(compressed_size);
+
+  if (size_offset + sizeof(uint32_t) + compressed_size != size) {
+    fprintf(stderr, "Corrupted file: l:%u, cs:%u, filesize:%llu\n",
+            len, compressed_size, (unsigned long long) size);
+    return(-1);
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
 /**
  * Returns 1 if file was detected as corrupted, deleted and should be skipped.
  * Returns 2 if file was empty and should be skipped, but wasn't deleted.
@@ -111,12 +174,41 @@ int remove_if_corrupted(FILE *file, char *file_path) {
 /**
  * Returns the index into the packfile index entries where the first entry with
  * the given hash is located, or -1 if the hash does not exist in the index.
+ *
+ * The hashes are uniformly distributed, so the position of a hash is well
+ * predicted by interpolating between the ends of the range. A few
+ * interpolation steps narrow a multi-million entry index down to a handful of
+ * entries, touching far fewer pages than a binary search would.
  */
 size_t find_hash_in_index(struct index_entry *index,
     size_t num_entries, uint64_t hash) {
 
   size_t left = 0;
   size_t right = num_entries - 1;
+  // the first entry with a hash >= hash, if any, lies in [left, right]
+  for (int step = 0; step < INTERPOLATION_MAX_STEPS
+       && right - left > INTERPOLATION_CUTOFF; step++) {
+    uint64_t low = index[left].hash;
+    uint64_t high = index[right].hash;
+    if (hash <= low) {
+      right = left;
+      break;
+    }
+    if (hash > high) {
+      left = right;
+      break;
+    }
+    size_t guess = left + (size_t) ((unsigned __int128) (hash - low)
+                                    * (right - left) / (high - low));
+    if (guess == right) {
+      guess--;
+    }
+    if (index[guess].hash < hash) {
+      left = guess + 1;
+    } else {
+      right = guess;
+    }
+  }
   while (left != right) {
     size_t middle = (right + left) / 2;
     if (index[middle].hash < hash) {
@@ -135,136 +227,705 @@ size_t find_hash_in_index(struct index_entry *index,
 /*--------------------------------------------------------------------*/
 
 /**
- * Calculates the number of existing entries in the packfile index based on the
- * size of the packfile index file.
+ * An open packfile together with its mmapped index segments.
  *
- * Returns -1 on error.
+ * Handles are cached per index directory for the life of the process and are
+ * reference counted, so a handle replaced in the cache stays usable by any
+ * lookup still running on it. A handle is valid while the file versioning the
+ * index, the manifest or for older directories the base index, is unchanged.
  */
-size_t get_num_index_entries(FILE *packfile_index) {
-  if (fseek(packfile_index, 0, SEEK_END) != 0) {
-    return(-1);
+struct packfile_handle {
+  char *indexdir;
+  int packfile_fd;
+  struct index_segment *segments;
+  int num_segments;
+  dev_t version_dev;
+  ino_t version_ino;
+  off_t version_size;
+  struct timespec version_mtime;
+  int refs;
+  struct packfile_handle *next;
+};
+
+static struct packfile_handle *packfile_cache = NULL;
+static pthread_mutex_t packfile_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Drops a reference to handle, closing it once nothing uses it.
+ * Must be called with packfile_cache_mutex held.
+ */
+static void put_packfile_handle(struct packfile_handle *handle) {
+  if (--handle->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < handle->num_segments; i++) {
+    unmap_index_segment(&handle->segments[i]);
   }
-  long index_size = ftell(packfile_index);
-  rewind(packfile_index);
-  return index_size / sizeof(struct index_entry);
+  free(handle->segments);
+  close(handle->packfile_fd);
+  free(handle->indexdir);
+  free(handle);
 }
 
 /*--------------------------------------------------------------------*/
 
 /**
- * Reads the data stored in the packfile with the given name.
- * Assumes the data is (the size of a) bitmap when decompressed.
+ * Removes the cached handle for indexdir, if any.
+ * Must be called with packfile_cache_mutex held.
+ */
+static void evict_packfile_handle(char *indexdir) {
+  for (struct packfile_handle **h = &packfile_cache; *h; h = &(*h)->next) {
+    if (strcmp((*h)->indexdir, indexdir) == 0) {
+      struct packfile_handle *evicted = *h;
+      *h = evicted->next;
+      put_packfile_handle(evicted);
+      return;
+    }
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+static int handle_matches_stat(struct packfile_handle *handle,
+    struct stat *s) {
+  return handle->version_dev == s->st_dev
+    && handle->version_ino == s->st_ino
+    && handle->version_size == s->st_size
+    && handle->version_mtime.tv_sec == s->st_mtim.tv_sec
+    && handle->version_mtime.tv_nsec == s->st_mtim.tv_nsec;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Opens the packfile and maps the index segments in indexdir, newest first
+ * with the base index last.
  *
- * filename: name of file to search for in the packfile
- * mtime: mtime of file to search for in the packfile
- * indexdir: index directory
+ * The index is opened before the packfile. The packer appends to the packfile
+ * before publishing new index entries, so their offsets are valid in a
+ * packfile opened after the index. Compaction instead renames a rewritten
+ * packfile into place, then the base index and last the manifest recording the
+ * new packfile's inode: a packfile whose inode differs from the manifest's
+ * belongs to another index, and the handle fails with ESTALE to be reopened.
+ * A segment removed by a concurrent merge is skipped; its entries are in the
+ * merged segment or base, and the manifest has changed, so the handle is
+ * reopened on the next lookup anyway. Every record read is still checked
+ * against its name and mtime.
  */
-uint8_t *read_from_packfile(char *filename, int64_t mtime, char *indexdir) {
-  
+static struct packfile_handle *open_packfile_handle(char *indexdir) {
+  struct index_manifest manifest;
+  if (read_index_manifest(indexdir, &manifest) != 0) {
+    memset(&manifest, 0, sizeof(manifest));
+  }
+  struct packfile_handle *handle = calloc(1, sizeof(*handle));
+  if (handle == NULL) {
+    perror("Error: Memory not allocated");
+    free_index_manifest(&manifest);
+    return NULL;
+  }
+  handle->packfile_fd = -1;
+  handle->segments = calloc(manifest.num_segments + 1,
+                            sizeof(struct index_segment));
+  if (handle->segments == NULL) {
+    perror("Error: Memory not allocated");
+    goto FAIL;
+  }
+  for (int i = manifest.num_segments - 1; i >= 0; i--) {
+    if (map_index_segment(indexdir, manifest.segments[i].name,
+                          &handle->segments[handle->num_segments]) == 0) {
+      handle->num_segments++;
+    }
+  }
+  if (map_base_index(indexdir, &handle->segments[handle->num_segments]) == 0) {
+    handle->num_segments++;
+  } else if (handle->num_segments == 0) {
+    goto FAIL;
+  }
+
   char *packfile_path = add_path_parts(indexdir, PACKFILE_NAME);
-  FILE *packfile = fopen(packfile_path, "r");
-  uint8_t *packed_file = NULL;
+  handle->packfile_fd = open(packfile_path, O_RDONLY);
   free(packfile_path);
-  if(packfile == NULL) {
+  if (handle->packfile_fd == -1) {
     if (errno != ENOENT) {
       perror("Error: could not open packfile");
     }
-    return(NULL);
+    goto FAIL;
   }
-  char *packfile_index_path = add_path_parts(indexdir, PACKFILE_INDEX_NAME);
-  FILE *packfile_index = fopen(packfile_index_path, "r");
-  free(packfile_index_path);
-  if(packfile_index == NULL) {
-    fclose(packfile);
-    if (errno != ENOENT)
-      perror("Error: could not open packfile index");
-    return(NULL);
+  struct stat packfile_stat;
+  if (manifest.packfile_ino != 0
+      && (fstat(handle->packfile_fd, &packfile_stat) != 0
+          || packfile_stat.st_ino != manifest.packfile_ino)) {
+    errno = ESTALE;
+    goto FAIL;
   }
+  free_index_manifest(&manifest);
+  handle->indexdir = strdup(indexdir);
+  handle->refs = 1;
+  return handle;
+
+  FAIL:
+    free_index_manifest(&manifest);
+    int saved_errno = errno;
+    for (int i = 0; i < handle->num_segments; i++) {
+      unmap_index_segment(&handle->segments[i]);
+    }
+    free(handle->segments);
+    if (handle->packfile_fd != -1) {
+      close(handle->packfile_fd);
+    }
+    free(handle);
+    errno = saved_errno;
+    return NULL;
+}
 
-  uint64_t hashed = XXH64(filename, strlen(filename), HASH_SEED);
-  size_t num_index_entries = get_num_index_entries(packfile_index);
-  if (num_index_entries <= 0)
-    goto OUT2;
-  size_t index_filesize = num_index_entries * sizeof(struct index_entry);
-  struct index_entry *index = mmap(NULL, index_filesize, PROT_READ,
-                                   MAP_PRIVATE, fileno(packfile_index), 0);
-  if(index == MAP_FAILED){
-    perror("Error: could not mmap packfile index");
-    goto OUT1;
+/*--------------------------------------------------------------------*/
+
+/**
+ * Stats the file that versions the index in indexdir: the manifest, or the
+ * base index in directories packed before there were manifests.
+ */
+static int stat_index_version(char *indexdir, struct stat *s) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", indexdir, INDEX_MANIFEST_NAME);
+  if (stat(path, s) == 0) {
+    return 0;
   }
-  size_t first_identical_hash_loc = find_hash_in_index(
-      index, num_index_entries, hashed);
-  if (first_identical_hash_loc == -1) {
-    goto OUT1;
+  if (errno != ENOENT) {
+    return -1;
   }
-  // now to see if any of the identical hashes map to the same filename
-  // we need to read the packfile for this
-  for (size_t i = first_identical_hash_loc; index[i].hash == hashed; i++) {
-    size_t offset = be64toh(index[i].packfile_offset);
-    uint16_t name_len;
-    fseek(packfile, offset, SEEK_SET);
-    if (fread(&name_len, sizeof(uint16_t), 1, packfile) != 1) {
-      perror("Error in packfile fread");
-      goto OUT1;
+  snprintf(path, sizeof(path), "%s/%s", indexdir, PACKFILE_INDEX_NAME);
+  return stat(path, s);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns a handle to the packfile in indexdir, reusing the cached one unless
+ * the index has since changed (detected by a change of inode, size or mtime of
+ * the file versioning it). Release it with release_packfile_handle.
+ *
+ * Returns NULL if there is no packfile, with errno set.
+ */
+static struct packfile_handle *get_packfile_handle(char *indexdir) {
+  struct stat version_stat;
+  int stat_ret = stat_index_version(indexdir, &version_stat);
+  int stat_errno = errno;
+
+  pthread_mutex_lock(&packfile_cache_mutex);
+  struct packfile_handle *handle = NULL;
+  for (struct packfile_handle *h = packfile_cache; h; h = h->next) {
+    if (strcmp(h->indexdir, indexdir) == 0) {
+      handle = h;
+      break;
     }
-    name_len = be16toh(name_len);
-    char packed_filename[name_len];
-    if (fread(packed_filename, name_len, 1, packfile) != 1) {
-      perror("Error in packfile fread");
-      goto OUT1;
+  }
+  if (handle != NULL && stat_ret == 0
+      && handle_matches_stat(handle, &version_stat)) {
+    handle->refs++;
+    pthread_mutex_unlock(&packfile_cache_mutex);
+    return handle;
+  }
+  if (handle != NULL) {
+    evict_packfile_handle(indexdir);
+  }
+  if (stat_ret != 0) {
+    pthread_mutex_unlock(&packfile_cache_mutex);
+    errno = stat_errno;
+    return NULL;
+  }
+
+  handle = open_packfile_handle(indexdir);
+  for (int attempt = 1; handle == NULL && errno == ESTALE
+       && attempt < PACKFILE_OPEN_ATTEMPTS; attempt++) {
+    if (stat_index_version(indexdir, &version_stat) != 0) {
+      break;
     }
-    if (strncmp(packed_filename, filename, name_len) != 0) {
-      continue;
+    handle = open_packfile_handle(indexdir);
+  }
+  if (handle != NULL) {
+    handle->version_dev = version_stat.st_dev;
+    handle->version_ino = version_stat.st_ino;
+    handle->version_size = version_stat.st_size;
+    handle->version_mtime = version_stat.st_mtim;
+    int num_cached = 0;
+    for (struct packfile_handle *h = packfile_cache; h; h = h->next) {
+      num_cached++;
     }
-    int64_t packed_mtime;
-    if (fread(&packed_mtime, sizeof(int64_t), 1, packfile) != 1) {
-      perror("Error in packfile fread");
-      goto OUT1;
+    if (num_cached >= PACKFILE_CACHE_SIZE) {
+      // evict the least recently opened handle, at the end of the list
+      struct packfile_handle **last = &packfile_cache;
+      while ((*last)->next) {
+        last = &(*last)->next;
+      }
+      struct packfile_handle *evicted = *last;
+      *last = NULL;
+      put_packfile_handle(evicted);
     }
-    packed_mtime = be64toh(packed_mtime);
-    if (packed_mtime != mtime) {
+    handle->refs++;
+    handle->next = packfile_cache;
+    packfile_cache = handle;
+  }
+  pthread_mutex_unlock(&packfile_cache_mutex);
+  return handle;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void release_packfile_handle(struct packfile_handle *handle) {
+  pthread_mutex_lock(&packfile_cache_mutex);
+  put_packfile_handle(handle);
+  pthread_mutex_unlock(&packfile_cache_mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Drops the cached handle for indexdir, so that the next lookup reopens the
+ * packfile. Used after a stale NFS file handle.
+ */
+void invalidate_packfile_handle(char *indexdir) {
+  pthread_mutex_lock(&packfile_cache_mutex);
+  evict_packfile_handle(indexdir);
+  pthread_mutex_unlock(&packfile_cache_mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the packfile record at offset and, if it was made for filename at
+ * mtime, decompresses its bitmap into bitmap, unless bitmap is NULL.
+ *
+ * One pread covers the header of the record and usually all of it; the rest
+ * of a longer record is read into the thread's compression buffer. The
+ * packfile is read, not mapped, so that a packfile replaced on another NFS
+ * client shows up as ESTALE, which drops the handle, rather than as a fault.
+ *
+ * Returns 1 if the record matches, 0 if it is another file's and -1 on error.
+ */
+static int read_packed_bitmap(struct packfile_handle *handle, uint64_t offset,
+    char *filename, size_t filename_len, int64_t mtime, uint8_t *bitmap) {
+  uint8_t record[RECORD_READ_SIZE];
+  ssize_t read_amount = pread(handle->packfile_fd, record, RECORD_READ_SIZE,
+                              offset);
+  if (read_amount < 0) {
+    if (errno == ESTALE) {
+      invalidate_packfile_handle(handle->indexdir);
+      errno = ESTALE;
+    } else {
+      perror("Error in packfile pread");
+    }
+    return -1;
+  }
+  size_t available = read_amount;
+  if (available < sizeof(uint16_t)) {
+    fprintf(stderr, "Error in packfile: truncated record\n");
+    return -1;
+  }
+  uint16_t name_len;
+  memcpy(&name_len, record, sizeof(uint16_t));
+  name_len = be16toh(name_len);
+  size_t header_len = sizeof(uint16_t) + name_len + sizeof(int64_t)
+    + sizeof(uint32_t);
+  if (available < header_len) {
+    fprintf(stderr, "Error in packfile: truncated record\n");
+    return -1;
+  }
+  if (name_len != filename_len
+      || memcmp(record + sizeof(uint16_t), filename, name_len) != 0) {
+    return 0;
+  }
+  int64_t packed_mtime;
+  memcpy(&packed_mtime, record + sizeof(uint16_t) + name_len,
+         sizeof(int64_t));
+  packed_mtime = be64toh(packed_mtime);
+  if (packed_mtime != mtime) {
+    return 0;
+  }
+  if (bitmap == NULL) {
+    return 1;
+  }
+  // we found an entry with the same filename!
+  // now we may read the file
+  uint32_t packed_file_len;
+  memcpy(&packed_file_len, record + header_len - sizeof(uint32_t),
+         sizeof(uint32_t));
+  packed_file_len = be32toh(packed_file_len);
+  if (packed_file_len > ESTIMATED_ZSTD_SIZE) {
+    fprintf(stderr, "Error in packfile: bad record length\n");
+    return -1;
+  }
+  const uint8_t *compressed_file = record + header_len;
+  size_t in_record = available - header_len;
+  if (in_record < packed_file_len) {
+    uint8_t *whole = get_compression_buffer();
+    if (whole == NULL) {
+      perror("Error: Memory not allocated");
+      return -1;
+    }
+    memcpy(whole, compressed_file, in_record);
+    size_t rest = packed_file_len - in_record;
+    read_amount = pread(handle->packfile_fd, whole + in_record, rest,
+                        offset + header_len + in_record);
+    if (read_amount != (ssize_t) rest) {
+      if (read_amount < 0 && errno == ESTALE) {
+        invalidate_packfile_handle(handle->indexdir);
+        errno = ESTALE;
+      } else {
+        fprintf(stderr, "Error in packfile: truncated record\n");
+      }
+      return -1;
+    }
+    compressed_file = whole;
+  }
+  // now decompress it
+  size_t s = decompress_bitmap(bitmap, compressed_file, packed_file_len,
+                               handle->indexdir);
+  if(ZSTD_isError(s) == 1){
+    fprintf(stderr, "Error in packfile decompression: %s\n",
+            ZSTD_getErrorName(s));
+    return -1;
+  }
+  return 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the bitmap stored in the packfile for the given name and mtime into
+ * bitmap, which is left undefined if there is none.
+ *
+ * With a NULL bitmap, only checks that the packfile holds one, reading the
+ * header of its record but not decompressing it.
+ *
+ * The packfile and its index segments stay open and mapped between calls, so
+ * a lookup costs a stat of the manifest, a search of each mapped segment,
+ * newest first, and a pread of the matching record. Each segment's bloom
+ * filter turns most files away before its entries are searched. Nothing is
+ * allocated once the packfile is open.
+ *
+ * Returns 0 if the bitmap was found, -1 otherwise, with errno set to ESTALE
+ * if the packfile handle went stale.
+ */
+int read_from_packfile_into(uint8_t *bitmap, char *filename, int64_t mtime,
+    char *indexdir) {
+  int ret_val = -1;
+  struct packfile_handle *handle = get_packfile_handle(indexdir);
+  if (handle == NULL) {
+    return ret_val;
+  }
+  size_t filename_len = strlen(filename);
+  uint64_t hashed = XXH64(filename, filename_len, HASH_SEED);
+  for (int seg = 0; seg < handle->num_segments; seg++) {
+    struct index_segment *segment = &handle->segments[seg];
+    size_t first_identical_hash_loc = find_hash_in_segment(segment, hashed);
+    if (first_identical_hash_loc == -1) {
       continue;
     }
-    uint32_t packed_file_len;
-    // we found an entry with the same filename!
-    // now we may read the file
-    if (fread(&packed_file_len, sizeof(uint32_t), 1, packfile) != 1) {
-      perror("Error in packfile fread");
-      goto OUT1;
+    // now to see if any of the identical hashes map to the same filename
+    // we need to read the packfile for this
+    struct index_entry *index = segment->entries;
+    for (size_t i = first_identical_hash_loc;
+         i < segment->num_entries && index[i].hash == hashed; i++) {
+      int ret = read_packed_bitmap(handle, be64toh(index[i].packfile_offset),
+                                   filename, filename_len, mtime, bitmap);
+      if (ret != 0) {
+        ret_val = ret == 1 ? 0 : -1;
+        goto OUT1;
+      }
     }
-    packed_file_len = be32toh(packed_file_len);
-    uint8_t compressed_file[packed_file_len];
-    if (fread(&compressed_file, packed_file_len, 1, packfile) != 1) {
-      perror("Error in packfile fread");
-      goto OUT1;
+  }
+
+  OUT1:
+    release_packfile_handle(handle);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the data stored in the packfile with the given name.
+ * Assumes the data is (the size of a) bitmap when decompressed.
+ *
+ * filename: name of file to search for in the packfile
+ * mtime: mtime of file to search for in the packfile
+ * indexdir: index directory
+ *
+ * Returns a newly allocated bitmap, or NULL if there is none.
+ */
+uint8_t *read_from_packfile(char *filename, int64_t mtime, char *indexdir) {
+  uint8_t *packed_file = malloc(SIZEOF_BITMAP);
+  if (packed_file == NULL){
+    perror("Error: Memory not allocated");
+    return NULL;
+  }
+  if (read_from_packfile_into(packed_file, filename, mtime, indexdir) != 0) {
+    int saved_errno = errno;
+    free(packed_file);
+    errno = saved_errno;
+    return NULL;
+  }
+  return packed_file;
+}
+
+/*--------------------------------------------------------------------*/
+
+/** A name in a batch lookup, by the hash it is indexed under. */
+struct batch_probe {
+  uint64_t hash;
+  int i;
+};
+
+/** A packfile record a batch lookup has to read, for the ith name. */
+struct batch_read {
+  uint64_t offset;
+  int i;
+};
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Sorts probes by hash. Batches are small, and unlike qsort, which may
+ * allocate a merge buffer, an insertion sort keeps lookups off the heap.
+ */
+static void sort_batch_probes(struct batch_probe *probes, int num) {
+  for (int i = 1; i < num; i++) {
+    struct batch_probe probe = probes[i];
+    int j = i;
+    for (; j > 0 && probes[j - 1].hash > probe.hash; j--) {
+      probes[j] = probes[j - 1];
     }
-    // now decompress it
-    packed_file = malloc(SIZEOF_BITMAP);
-    if (packed_file == NULL){
-      perror("Error: Memory not allocated");
-      goto OUT1;
+    probes[j] = probe;
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Sorts reads by packfile offset, like sort_batch_probes.
+ */
+static void sort_batch_reads(struct batch_read *reads, size_t num) {
+  for (size_t i = 1; i < num; i++) {
+    struct batch_read read = reads[i];
+    size_t j = i;
+    for (; j > 0 && reads[j - 1].offset > read.offset; j--) {
+      reads[j] = reads[j - 1];
     }
+    reads[j] = read;
+  }
+}
 
-    size_t s = ZSTD_decompress(packed_file, SIZEOF_BITMAP,
-        compressed_file, packed_file_len);
-    if(ZSTD_isError(s) == 1){
-      fprintf(stderr, "Error in packfile decompression: %s\n",
-              ZSTD_getErrorName(s));
-      free(packed_file);
-      packed_file = NULL;
-      goto OUT1;
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the position of the first of the sorted entries at or after pos
+ * whose hash is not below hash, or num_entries if there is none.
+ *
+ * Gallops forward from pos in doubling steps before searching the last step,
+ * so advancing over a short gap costs a few comparisons and a long one
+ * logarithmically many.
+ */
+static size_t gallop_to_hash(struct index_entry *entries, size_t num_entries,
+    size_t pos, uint64_t hash) {
+  size_t hi = pos;
+  size_t step = 1;
+  while (hi < num_entries && entries[hi].hash < hash) {
+    pos = hi + 1;
+    hi += step;
+    step *= 2;
+  }
+  if (hi > num_entries) {
+    hi = num_entries;
+  }
+  while (pos < hi) {
+    size_t mid = pos + (hi - pos) / 2;
+    if (entries[mid].hash < hash) {
+      pos = mid + 1;
+    } else {
+      hi = mid;
     }
   }
+  return pos;
+}
 
-  OUT1:
-    if (munmap(index, index_filesize) == -1) {
-      perror("Error in packfile index munmap");
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the packfile records of reads, in the order they lie in the packfile,
+ * into the bitmaps of the names they were found for, skipping names already
+ * found.
+ *
+ * Returns the number of names found, -1 on error.
+ */
+static int read_batch_records(struct packfile_handle *handle,
+    struct batch_read *reads, size_t num_reads, char **filenames,
+    size_t *name_lens, int64_t *mtimes, uint8_t **bitmaps, int *found) {
+  int num_found = 0;
+  sort_batch_reads(reads, num_reads);
+  for (size_t r = 0; r < num_reads; r++) {
+    int i = reads[r].i;
+    if (found[i]) {
+      continue;
     }
-  OUT2:
-    fclose(packfile);
-    fclose(packfile_index);
-    return packed_file;
+    int ret = read_packed_bitmap(handle, reads[r].offset, filenames[i],
+                                 name_lens[i], mtimes[i], bitmaps[i]);
+    if (ret < 0) {
+      return -1;
+    }
+    if (ret == 1) {
+      found[i] = 1;
+      num_found++;
+    }
+  }
+  return num_found;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Looks up at most PACKFILE_BATCH_MAX files, as read_from_packfile_batch
+ * does, in buffers on the stack.
+ *
+ * Returns the number of files found, -1 on error.
+ */
+static int read_batch_chunk(struct packfile_handle *handle, char **filenames,
+    int64_t *mtimes, int num, uint8_t **bitmaps, int *found) {
+  struct batch_probe probes[PACKFILE_BATCH_MAX];
+  size_t name_lens[PACKFILE_BATCH_MAX];
+  struct batch_read reads[BATCH_READS_MAX];
+  int num_found = 0;
+  for (int i = 0; i < num; i++) {
+    name_lens[i] = strlen(filenames[i]);
+    probes[i].hash = XXH64(filenames[i], name_lens[i], HASH_SEED);
+    probes[i].i = i;
+  }
+  sort_batch_probes(probes, num);
+
+  for (int seg = 0; seg < handle->num_segments && num_found < num; seg++) {
+    struct index_segment *segment = &handle->segments[seg];
+    struct index_entry *index = segment->entries;
+    size_t num_reads = 0;
+    size_t pos = 0;
+    for (int p = 0; p < num && pos < segment->num_entries; p++) {
+      uint64_t hashed = probes[p].hash;
+      if (found[probes[p].i]) {
+        continue;
+      }
+      if (segment->filter != NULL
+          && !bloom_may_contain(segment->filter, segment->num_blocks, hashed)) {
+        continue;
+      }
+      pos = gallop_to_hash(index, segment->num_entries, pos, hashed);
+      for (size_t e = pos; e < segment->num_entries && index[e].hash == hashed;
+           e++) {
+        if (num_reads == BATCH_READS_MAX) {
+          // many entries share hashes; read what there is and go on
+          int ret = read_batch_records(handle, reads, num_reads, filenames,
+                                       name_lens, mtimes, bitmaps, found);
+          if (ret < 0) {
+            return -1;
+          }
+          num_found += ret;
+          num_reads = 0;
+        }
+        reads[num_reads].offset = be64toh(index[e].packfile_offset);
+        reads[num_reads].i = probes[p].i;
+        num_reads++;
+      }
+    }
+    int ret = read_batch_records(handle, reads, num_reads, filenames,
+                                 name_lens, mtimes, bitmaps, found);
+    if (ret < 0) {
+      return -1;
+    }
+    num_found += ret;
+  }
+  return num_found;
+}
+
+/*--------------------------------------------------------------------*/
 
+/**
+ * Looks up a batch of files in the packfile of one index directory, as
+ * read_from_packfile_into does for each of them. Sets found[i] to 1 if the
+ * bitmap for filenames[i] at mtimes[i] was read into bitmaps[i], or only
+ * found if bitmaps[i] is NULL, and to 0 otherwise.
+ *
+ * The names are hashed and sorted, and each index segment is walked once,
+ * newest first, in a merge-join against them; then the matching records are
+ * read in the order they lie in the packfile, so that a batch costs one pass
+ * over the index and a forward sweep of the packfile instead of a search and
+ * a scattered read per file. Larger batches are looked up
+ * PACKFILE_BATCH_MAX files at a time, and nothing is allocated once the
+ * packfile is open.
+ *
+ * Returns the number of files found, -1 on error, with errno set to ESTALE
+ * if the packfile handle went stale.
+ */
+int read_from_packfile_batch(char **filenames, int64_t *mtimes, int num,
+    char *indexdir, uint8_t **bitmaps, int *found) {
+  for (int i = 0; i < num; i++) {
+    found[i] = 0;
+  }
+  if (num <= 0) {
+    return 0;
+  }
+  struct packfile_handle *handle = get_packfile_handle(indexdir);
+  if (handle == NULL) {
+    return -1;
+  }
+  int num_found = 0;
+  for (int first = 0; first < num; first += PACKFILE_BATCH_MAX) {
+    int chunk = num - first < PACKFILE_BATCH_MAX ? num - first
+                                                 : PACKFILE_BATCH_MAX;
+    int ret = read_batch_chunk(handle, filenames + first, mtimes + first,
+                               chunk, bitmaps + first, found + first);
+    if (ret < 0) {
+      num_found = -1;
+      break;
+    }
+    num_found += ret;
+  }
+  release_packfile_handle(handle);
+  return num_found;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Warms the page cache for a later read_from_packfile of the same entry.
+ *
+ * Runs the same index search as read_from_packfile, so exactly the index pages
+ * that lookup will touch are faulted in, then advises the kernel to read ahead
+ * the packfile records the matching index entries point at. Nothing is
+ * decompressed.
+ *
+ * Returns 0 if a matching hash was found, -1 otherwise.
+ */
+int prefetch_from_packfile(char *filename, char *indexdir) {
+  int ret_val = -1;
+  struct packfile_handle *handle = get_packfile_handle(indexdir);
+  if (handle == NULL) {
+    return ret_val;
+  }
+  uint64_t hashed = XXH64(filename, strlen(filename), HASH_SEED);
+  for (int seg = 0; seg < handle->num_segments; seg++) {
+    struct index_segment *segment = &handle->segments[seg];
+    size_t first_identical_hash_loc = find_hash_in_segment(segment, hashed);
+    if (first_identical_hash_loc == -1) {
+      continue;
+    }
+    struct index_entry *index = segment->entries;
+    for (size_t i = first_identical_hash_loc;
+         i < segment->num_entries && index[i].hash == hashed; i++) {
+      posix_fadvise(handle->packfile_fd, be64toh(index[i].packfile_offset),
+                    PREFETCH_RECORD_BYTES, POSIX_FADV_WILLNEED);
+    }
+    ret_val = 0;
+  }
+  release_packfile_handle(handle);
+  return ret_val;
 }
 
 /*--------------------------------------------------------------------*/
@@ -304,16 +965,7 @@ long write_data_to_packfile(void *data, size_t size, FILE *packfile) {
  * Returns the offset into the packfile at which the new file is written.
  */
 long add_file_to_packfile(char *filename, char *indexdir, FILE *packfile) {
-  char tmp[27];
   int ret_val = -1;
-  sprintf(tmp, ".%s.lock", filename);
-  char *lock_path = add_path_parts(indexdir, tmp);
-  int ret = lockfile_check(lock_path, 0);
-  free(lock_path);
-  if(ret == 0){
-    return ret_val;
-  }
-
   char *file_path = add_path_parts(indexdir, filename);
   FILE *f = fopen(file_path, "r");
   if (f == NULL) {
@@ -376,6 +1028,7 @@ int count_loose_files(char *dir_path) {
   while ((entry = readdir(dir))) {
     if (strcmp(entry->d_name, PACKFILE_NAME) == 0
         || strcmp(entry->d_name, PACKFILE_INDEX_NAME) == 0
+        || strcmp(entry->d_name, CONTENT_SUBDIR) == 0
         || entry->d_name[0] == '.' ) {
       continue;
     }
@@ -450,15 +1103,6 @@ void *read_file(void *args) {
   result->error = 0;
 
   char *path = add_path_parts(indexdir, filename);
-  char tmp[27];
-  sprintf(tmp, ".%s.lock", filename);
-  char *lock_path = add_path_parts(indexdir, tmp);
-  int ret = lockfile_check(lock_path, 0);
-  free(lock_path);
-  if(ret == 0){
-    goto OUT4;
-  }
-
   FILE *file = fopen(path, "r");
   if (file == NULL) {
     result->error = errno;
@@ -541,9 +1185,80 @@ struct read_file_result *read_files_in_parallel(char **filenames, int num,
   return results;
 }
 
+/**
+ * Reads many files with a few batches of io_uring operations instead of a
+ * thread per file. Follows the same rules as read_file: corrupted files are
+ * removed.
+ *
+ * Returns NULL if io_uring is not available, in which case the caller should
+ * use read_files_in_parallel.
+ */
+struct read_file_result *read_files_batched(char **filenames, int num,
+    char *indexdir) {
+  if (!uring_available()) {
+    return NULL;
+  }
+  struct read_file_result *results =
+    malloc(num * sizeof(struct read_file_result));
+  struct uring_read_result *reads = malloc(num * sizeof(*reads));
+  char **paths = malloc(num * sizeof(char *));
+  if (results == NULL || reads == NULL || paths == NULL) {
+    free(results);
+    results = NULL;
+    goto OUT2;
+  }
+  for (int i = 0; i < num; i++) {
+    paths[i] = add_path_parts(indexdir, filenames[i]);
+  }
+  if (uring_read_files(paths, num, reads) != 0) {
+    free(results);
+    results = NULL;
+    goto OUT1;
+  }
+
+  for (int i = 0; i < num; i++) {
+    results[i].error = 0;
+    results[i].data = NULL;
+    results[i].length = 0;
+  }
+  for (int r = 0; r < num; r++) {
+    struct read_file_result *result = &results[r];
+    if (reads[r].error != 0) {
+      result->error = reads[r].error;
+      continue;
+    }
+    int corrupt_status = is_buffer_corrupted(reads[r].data, reads[r].length);
+    if (corrupt_status != 0) {
+      // see remove_if_corrupted for why empty files are kept
+      if (corrupt_status != EMPTY_FILE) {
+        remove(paths[r]);
+        result->error = -1;
+      } else {
+        result->error = -2;
+      }
+      free(reads[r].data);
+      continue;
+    }
+    result->data = reads[r].data;
+    result->length = reads[r].length;
+  }
+
+  OUT1:
+    for (int i = 0; i < num; i++) {
+      free(paths[i]);
+    }
+  OUT2:
+    free(reads);
+    free(paths);
+    return results;
+}
+
+/*--------------------------------------------------------------------*/
+
 /**
  * Appends all file data from results to the packfile, writing the new index
- * entries to new_entries.
+ * entries to new_entries. If samples is not NULL, the bitmaps packed are also
+ * collected there to train a dictionary from.
  */
 int write_to_packfile(
     struct read_file_result *results,
@@ -552,7 +1267,8 @@ int write_to_packfile(
     char *added_file_paths[],
     FILE *packfile,
     char *indexdir,
-    char *filenames[]) {
+    char *filenames[],
+    struct dict_samples *samples) {
   int files_added = 0;
   for (int i = 0; i < num_results; i++) {
     struct read_file_result result = results[i];
@@ -566,6 +1282,9 @@ int write_to_packfile(
       new_entries[files_added].packfile_offset = htobe64(offset);
       added_file_paths[files_added] = add_path_parts(indexdir, filenames[i]);
       files_added++;
+      if (samples != NULL) {
+        add_dict_sample(samples, result.data, result.length);
+      }
     } else {
       if (result.error > 0 && result.error != EACCES) {
         fprintf(stderr, "Error reading file %s: %s\n", filenames[i],
@@ -581,12 +1300,13 @@ int write_to_packfile(
 }
 
 /**
- * Adds num_loose loose files to the packfile.
+ * Adds num_loose loose files to the packfile, sampling their bitmaps into
+ * samples unless it is NULL.
  * Returns a pointer to index entries for the now-packed files.
  */
 struct index_entry *add_loose_files_to_packfile(
     int *num_loose, char *indexdir, char *file_paths[],
-    FILE *packfile, char* lock_path) {
+    FILE *packfile, char* lock_path, struct dict_samples *samples) {
   static const int parallel_reads = 50;
 
   struct index_entry *new_entries = malloc(
@@ -613,6 +1333,7 @@ struct index_entry *add_loose_files_to_packfile(
     if (entry != NULL) {
       if (strcmp(entry->d_name, PACKFILE_NAME) == 0
           || strcmp(entry->d_name, PACKFILE_INDEX_NAME) == 0
+          || strcmp(entry->d_name, CONTENT_SUBDIR) == 0
           || entry->d_name[0] == '.') {
         continue;
       }
@@ -630,11 +1351,15 @@ struct index_entry *add_loose_files_to_packfile(
     int enough_files = entry == NULL || files_added + buffer_size == *num_loose;
     if (buffer_full || enough_files) {
       // read some files
-      struct read_file_result *results = read_files_in_parallel(
+      struct read_file_result *results = read_files_batched(
           filenames_buffer, buffer_size, indexdir);
+      if (results == NULL) {
+        results = read_files_in_parallel(
+            filenames_buffer, buffer_size, indexdir);
+      }
       files_added += write_to_packfile(
           results, buffer_size, new_entries + files_added, file_paths +
-          files_added, packfile, indexdir, filenames_buffer);
+          files_added, packfile, indexdir, filenames_buffer, samples);
       for (int i = 0; i < buffer_size; i++) {
         free(filenames_buffer[i]);
         free(results[i].data);
@@ -676,56 +1401,274 @@ void two_finger_merge(struct index_entry *arr1, int arr1size,
 /*--------------------------------------------------------------------*/
 
 /**
- * Adds all of the new index entries to the packfile index.
- * Re-sorts as needed.
+ * Merges the entries of the segment with the given name in indexdir, or of
+ * the base index if name is NULL, into the sorted array *entries.
+ *
+ * Returns 0 upon success, -1 on error.
  */
-int add_entries_to_index(struct index_entry *new_entries,
-    int num_new_entries, char *indexdir) {
-  // read old index into new index buffer
+static int merge_segment_entries(char *indexdir, char *name,
+    struct index_entry **entries, size_t *num_entries) {
+  struct index_segment segment;
+  int ret = name == NULL ? map_base_index(indexdir, &segment)
+                         : map_index_segment(indexdir, name, &segment);
+  if (ret != 0) {
+    if (name == NULL && errno == ENOENT) {
+      // nothing packed here before
+      return 0;
+    }
+    perrorf("Error reading index segment in %s", indexdir);
+    return -1;
+  }
+  struct index_entry *merged = malloc((*num_entries + segment.num_entries + 1)
+                                      * sizeof(struct index_entry));
+  if (merged == NULL) {
+    perror("Error: Memory not allocated");
+    unmap_index_segment(&segment);
+    return -1;
+  }
+  two_finger_merge(*entries, *num_entries, segment.entries,
+                   segment.num_entries, merged);
+  free(*entries);
+  *entries = merged;
+  *num_entries += segment.num_entries;
+  unmap_index_segment(&segment);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the base index and every segment listed in manifest into one sorted
+ * array, returned in *entries.
+ *
+ * Returns 0 upon success, -1 on error.
+ */
+static int load_index_entries(char *indexdir, struct index_manifest *manifest,
+    struct index_entry **entries, size_t *num_entries) {
+  *entries = NULL;
+  *num_entries = 0;
+  if (merge_segment_entries(indexdir, NULL, entries, num_entries) != 0) {
+    goto FAIL;
+  }
+  for (int i = 0; i < manifest->num_segments; i++) {
+    if (merge_segment_entries(indexdir, manifest->segments[i].name, entries,
+                              num_entries) != 0) {
+      goto FAIL;
+    }
+  }
+  return 0;
+
+  FAIL:
+    free(*entries);
+    *entries = NULL;
+    return -1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Replaces the base index in indexdir, and its filter, with the given entries.
+ */
+static int replace_base_index(char *indexdir, struct index_entry *entries,
+    size_t num_entries) {
   int ret_val = -1;
-  char *packfile_index_path = add_path_parts(
-      indexdir, PACKFILE_INDEX_NAME);
-  create_file_if_nonexistent(packfile_index_path);
-  FILE *packfile_index = fopen(packfile_index_path, "r");
-  if (packfile_index == NULL) {
-    perror("Error opening packfile index");
+  char *packfile_index_path = add_path_parts(indexdir, PACKFILE_INDEX_NAME);
+  char *tmpfile_path = add_path_parts(indexdir, TEMP_PACKFILE_INDEX_NAME);
+  if (write_new_index(entries, num_entries, tmpfile_path) != 0) {
+    goto OUT1;
+  }
+  // the filter names the index it belongs to, so it can go in first
+  write_index_filter(entries, num_entries, tmpfile_path, indexdir);
+  retire_index_file(indexdir, PACKFILE_INDEX_NAME);
+  if (rename(tmpfile_path, packfile_index_path) != 0) {
+    perror("Error replacing packfile index");
+    goto OUT1;
+  }
+  ret_val = 0;
+
+  OUT1:
+    free(tmpfile_path);
     free(packfile_index_path);
     return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Removes the segment files no longer listed in a manifest, keeping them
+ * retired for readers that still have them mapped.
+ */
+static void delete_segments(char *indexdir, struct manifest_segment *segments,
+    int num_segments) {
+  for (int i = 0; i < num_segments; i++) {
+    char *path = add_path_parts(indexdir, segments[i].name);
+    retire_index_file(indexdir, segments[i].name);
+    unlink(path);
+    free(path);
   }
+}
 
-  size_t num_existing = get_num_index_entries(packfile_index);
-  size_t new_index_length = num_existing + num_new_entries;
-  struct index_entry *new_index = malloc(new_index_length *
-                                         sizeof(struct index_entry));
-  struct index_entry *old_index = malloc(num_existing *
-                                         sizeof(struct index_entry));
-  int read_amount = fread(old_index, sizeof(struct index_entry),
-      num_existing, packfile_index);
-  fclose(packfile_index);
+/*--------------------------------------------------------------------*/
 
-  if (read_amount < 0) {
-    perror("Error reading index file");
-    goto OUT1;
+static int segment_tier(uint64_t num_entries) {
+  int tier = 0;
+  for (uint64_t limit = SEGMENT_TIER_ENTRIES * SEGMENT_MERGE_FANIN;
+       num_entries >= limit; limit *= SEGMENT_MERGE_FANIN) {
+    tier++;
+  }
+  return tier;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Merges the segments of manifest by size tier: whenever SEGMENT_MERGE_FANIN
+ * segments share a tier they are replaced by one segment of the next tier.
+ * Once the segments hold 1/BASE_MERGE_RATIO as many entries as the base
+ * index, they are all folded into it instead. Every entry is thus rewritten
+ * a logarithmic number of times, and lookups have few segments to check.
+ *
+ * The merged segments are moved to *obsolete, to be deleted once the updated
+ * manifest is written.
+ */
+static void merge_index_segments(char *indexdir,
+    struct index_manifest *manifest, struct manifest_segment **obsolete,
+    int *num_obsolete) {
+  char *packfile_index_path = add_path_parts(indexdir, PACKFILE_INDEX_NAME);
+  struct stat index_stat;
+  uint64_t base_entries = 0;
+  if (stat(packfile_index_path, &index_stat) == 0) {
+    base_entries = index_stat.st_size / sizeof(struct index_entry);
+  }
+  free(packfile_index_path);
+  uint64_t segment_entries = 0;
+  for (int i = 0; i < manifest->num_segments; i++) {
+    segment_entries += manifest->segments[i].num_entries;
+  }
+
+  *obsolete = malloc((manifest->num_segments + 1) * sizeof(**obsolete));
+  *num_obsolete = 0;
+  if (*obsolete == NULL) {
+    perror("Error: Memory not allocated");
+    return;
   }
-  assert(read_amount == num_existing);
-  
+
+  if (segment_entries * BASE_MERGE_RATIO >= base_entries) {
+    struct index_entry *entries;
+    size_t num_entries;
+    if (load_index_entries(indexdir, manifest, &entries, &num_entries) != 0) {
+      return;
+    }
+    if (replace_base_index(indexdir, entries, num_entries) == 0) {
+      memcpy(*obsolete, manifest->segments,
+             manifest->num_segments * sizeof(**obsolete));
+      *num_obsolete = manifest->num_segments;
+      manifest->num_segments = 0;
+    }
+    free(entries);
+    return;
+  }
+
+  for (int tier = 0; manifest->num_segments >= SEGMENT_MERGE_FANIN;) {
+    int in_tier = 0;
+    for (int i = 0; i < manifest->num_segments; i++) {
+      in_tier += segment_tier(manifest->segments[i].num_entries) == tier;
+    }
+    if (in_tier < SEGMENT_MERGE_FANIN) {
+      if (++tier > segment_tier(segment_entries)) {
+        break;
+      }
+      continue;
+    }
+    struct index_entry *entries = NULL;
+    size_t num_entries = 0;
+    for (int i = 0; i < manifest->num_segments; i++) {
+      if (segment_tier(manifest->segments[i].num_entries) == tier
+          && merge_segment_entries(indexdir, manifest->segments[i].name,
+                                   &entries, &num_entries) != 0) {
+        free(entries);
+        return;
+      }
+    }
+    struct index_manifest merged = *manifest;
+    merged.segments = malloc(manifest->num_segments * sizeof(*merged.segments));
+    if (merged.segments == NULL) {
+      perror("Error: Memory not allocated");
+      free(entries);
+      return;
+    }
+    merged.num_segments = 0;
+    int num_replaced = 0;
+    struct manifest_segment replaced[manifest->num_segments];
+    for (int i = 0; i < manifest->num_segments; i++) {
+      if (segment_tier(manifest->segments[i].num_entries) == tier) {
+        replaced[num_replaced++] = manifest->segments[i];
+      } else {
+        merged.segments[merged.num_segments++] = manifest->segments[i];
+      }
+    }
+    int ret = add_index_segment(indexdir, &merged, entries, num_entries);
+    free(entries);
+    if (ret != 0) {
+      free(merged.segments);
+      return;
+    }
+    free(manifest->segments);
+    *manifest = merged;
+    struct manifest_segment *grown = realloc(*obsolete,
+        (*num_obsolete + num_replaced) * sizeof(**obsolete));
+    if (grown == NULL) {
+      // the replaced segments are just left behind
+      perror("Error: Memory not allocated");
+      return;
+    }
+    *obsolete = grown;
+    memcpy(*obsolete + *num_obsolete, replaced,
+           num_replaced * sizeof(**obsolete));
+    *num_obsolete += num_replaced;
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Adds all of the new index entries to the packfile index.
+ *
+ * The new entries are written as a new segment, so the cost of a pack run
+ * stays proportional to the number of files it packed, then segments are
+ * merged as needed.
+ *
+ * Returns 0 upon success, -1 if the new entries could not be added.
+ */
+int add_entries_to_index(struct index_entry *new_entries,
+    int num_new_entries, char *indexdir) {
   qsort(new_entries, num_new_entries, sizeof(struct index_entry),
       compare_index_entries);
-  two_finger_merge(old_index, num_existing, new_entries, num_new_entries,
-                   new_index);
-  char *tmpfile_path = add_path_parts(indexdir,
-                                      TEMP_PACKFILE_INDEX_NAME);
-  write_new_index(new_index, new_index_length, tmpfile_path);
-  rename(tmpfile_path, packfile_index_path);
-
-  free(tmpfile_path);
+  struct index_manifest manifest;
+  if (read_index_manifest(indexdir, &manifest) != 0) {
+    return -1;
+  }
+  int ret_val = -1;
+  struct manifest_segment *obsolete = NULL;
+  int num_obsolete = 0;
+  delete_retired_index_files(indexdir);
+  if (add_index_segment(indexdir, &manifest, new_entries,
+                        num_new_entries) != 0) {
+    goto OUT1;
+  }
+  merge_index_segments(indexdir, &manifest, &obsolete, &num_obsolete);
+  if (write_index_manifest(indexdir, &manifest) != 0) {
+    goto OUT1;
+  }
+  // readers of the previous manifest may still open these; they then
+  // miss entries until they notice the new manifest on their next lookup,
+  // while those that have them mapped keep reading the retired files
+  delete_segments(indexdir, obsolete, num_obsolete);
   ret_val = 0;
-  goto OUT1;
 
   OUT1:
-    free(packfile_index_path);
-    free(new_index);
-    free(old_index);
+    free(obsolete);
+    free_index_manifest(&manifest);
     return ret_val;
 }
 
@@ -748,12 +1691,16 @@ void *delete_files_thread_work(void *args) {
 /**
  * Delete the files that were in directory but now in packfile.
  *
- * Files are deleted in parallel across 50 threads.
+ * Files are deleted in one batch of io_uring operations when available,
+ * otherwise in parallel across 50 threads.
  */
 void delete_loose_files(char *file_paths[], int num_loose){
   if (num_loose == 0) {
     return;
   }
+  if (uring_unlink_files(file_paths, num_loose) == 0) {
+    return;
+  }
   int num_threads = num_loose > 50 ? 50 : num_loose;
   pthread_t threads[num_threads];
   int base_files_per_thread = num_loose / num_threads;
@@ -788,7 +1735,8 @@ void delete_loose_files(char *file_paths[], int num_loose){
 
 /**
  * Scans the index directory for files not in the packfile.
- * Each found file is read, inserted into the packfile, and deleted.
+ * Each found file is read, inserted into the packfile, and deleted, and so
+ * is each loose log, a record at a time.
  * The packfile index is updated as well.
  */
 int pack_loose_files_in_subdir(char *index_subdir) {
@@ -801,7 +1749,9 @@ int pack_loose_files_in_subdir(char *index_subdir) {
   create_file_if_nonexistent(packfile_path);
 
   char *packfile_lock = add_path_parts(index_subdir, PACKFILE_LOCK_NAME);
+  uint64_t start = stats_clock();
   int ret = lockfile_create(packfile_lock, 0, 0);
+  add_stage_time(STAGE_LOCK_WAIT, start);
   if(ret != 0){
     free(packfile_lock);
     free(packfile_path);
@@ -817,20 +1767,44 @@ int pack_loose_files_in_subdir(char *index_subdir) {
     return(ret_val);
   }
 
+  delete_abandoned_loose_files(index_subdir);
   // figure our how many loose files there are
   int num_loose = count_loose_files(index_subdir);
-  char *file_paths[num_loose];
+  if (num_loose < 0) {
+    num_loose = 0;
+  }
+  char *file_paths[num_loose + 1];
 
-  if (num_loose == 0) {
+  if (num_loose == 0 && count_loose_logs(index_subdir) <= 0) {
     goto OUT1;
   }
-  struct index_entry *new_entries = add_loose_files_to_packfile(
-      &num_loose, index_subdir, file_paths, packfile, packfile_lock);
+  // the first pack run with enough bitmaps trains the directory's dictionary
+  struct dict_samples samples = {0};
+  int train = needs_dict(index_subdir);
+  struct index_entry *new_entries = NULL;
+  if (num_loose > 0) {
+    new_entries = add_loose_files_to_packfile(
+        &num_loose, index_subdir, file_paths, packfile, packfile_lock,
+        train ? &samples : NULL);
+    if (new_entries == NULL) {
+      num_loose = 0;
+    }
+  }
+  // records of loose logs follow those of the loose files
+  int num_entries = num_loose;
+  struct merged_logs logs;
+  if (merge_loose_logs(index_subdir, packfile, &new_entries, &num_entries,
+                       train ? &samples : NULL, &logs) != 0) {
+    release_merged_logs(&logs, 0);
+  }
+  if (train) {
+    train_dict(index_subdir, &samples);
+    free_dict_samples(&samples);
+  }
 
-  if (new_entries == NULL){
-    goto OUT1;
-  } else if (num_loose == 0) {
+  if (num_entries == 0) {
     free(new_entries);
+    release_merged_logs(&logs, 0);
     goto OUT1;
   }
 
@@ -838,9 +1812,12 @@ int pack_loose_files_in_subdir(char *index_subdir) {
   int fd = fileno(packfile);
   fsync(fd);
 
-  add_entries_to_index(new_entries, num_loose, index_subdir);
+  int added = add_entries_to_index(new_entries, num_entries, index_subdir);
   free(new_entries);
-  delete_loose_files(file_paths, num_loose);
+  if (added == 0) {
+    delete_loose_files(file_paths, num_loose);
+  }
+  release_merged_logs(&logs, added == 0);
   for (int i = 0; i < num_loose; i++) {
     free(file_paths[i]);
   }
@@ -870,6 +1847,11 @@ int pack_loose_files(char *indexdir) {
     char *path = add_path_parts(indexdir, entry->d_name);
     if (is_dir(path)) {
       pack_loose_files_in_subdir(path);
+      char *content_dir = add_path_parts(path, CONTENT_SUBDIR);
+      if (is_dir(content_dir)) {
+        pack_loose_files_in_subdir(content_dir);
+      }
+      free(content_dir);
     }
     free(path);
   }
@@ -877,3 +1859,338 @@ int pack_loose_files(char *indexdir) {
 
   return 0;
 }
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * The header fields of a record in a mapped packfile.
+ */
+struct packed_record {
+  char *name;
+  uint16_t name_len;
+  int64_t mtime;
+  size_t length;
+};
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Parses the header of the record at offset in the mapped packfile.
+ *
+ * Returns 0 upon success, -1 if the record is malformed or runs past the end
+ * of the packfile.
+ */
+static int parse_packed_record(uint8_t *packfile, size_t packfile_size,
+    uint64_t offset, struct packed_record *record) {
+  size_t header_len = sizeof(uint16_t);
+  if (offset > packfile_size || packfile_size - offset < header_len) {
+    return -1;
+  }
+  uint16_t name_len;
+  memcpy(&name_len, packfile + offset, sizeof(uint16_t));
+  name_len = be16toh(name_len);
+  header_len += name_len + sizeof(int64_t) + sizeof(uint32_t);
+  if (packfile_size - offset < header_len) {
+    return -1;
+  }
+  int64_t mtime;
+  memcpy(&mtime, packfile + offset + sizeof(uint16_t) + name_len,
+         sizeof(int64_t));
+  uint32_t compressed_len;
+  memcpy(&compressed_len, packfile + offset + header_len - sizeof(uint32_t),
+         sizeof(uint32_t));
+  compressed_len = be32toh(compressed_len);
+  if (compressed_len > ESTIMATED_ZSTD_SIZE
+      || packfile_size - offset - header_len < compressed_len) {
+    return -1;
+  }
+  record->name = (char *) packfile + offset + sizeof(uint16_t);
+  record->name_len = name_len;
+  record->mtime = be64toh(mtime);
+  record->length = header_len + compressed_len;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns whether the file a record was made for has been deleted or
+ * modified since, so that no lookup can ever match the record again.
+ */
+static int record_is_stale(struct packed_record *record) {
+  char path[PATH_MAX];
+  if (record->name_len >= PATH_MAX
+      || is_content_name(record->name, record->name_len)) {
+    // any path could share a bitmap stored by content
+    return 0;
+  }
+  memcpy(path, record->name, record->name_len);
+  path[record->name_len] = '\0';
+  struct stat s;
+  if (stat(path, &s) != 0) {
+    return errno == ENOENT || errno == ENOTDIR;
+  }
+  return s.st_mtime != record->mtime;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Decides which of the index entries in a run of identical hashes to keep,
+ * setting keep[i] for entry i of the run. Of several entries for one path
+ * only the newest is kept; with drop_missing, entries for files since deleted
+ * or modified go as well.
+ */
+static void select_records_to_keep(struct index_entry *run, size_t run_len,
+    uint8_t *packfile, size_t packfile_size, int drop_missing,
+    struct packed_record *records, int *keep) {
+  for (size_t i = 0; i < run_len; i++) {
+    keep[i] = parse_packed_record(packfile, packfile_size,
+        be64toh(run[i].packfile_offset), &records[i]) == 0;
+  }
+  for (size_t i = 0; i < run_len; i++) {
+    if (!keep[i]) {
+      continue;
+    }
+    for (size_t j = 0; j < run_len; j++) {
+      if (j == i || !keep[j] || records[j].name_len != records[i].name_len
+          || memcmp(records[j].name, records[i].name,
+                    records[i].name_len) != 0) {
+        continue;
+      }
+      // ties go to the entry packed last
+      if (records[j].mtime > records[i].mtime
+          || (records[j].mtime == records[i].mtime
+              && be64toh(run[j].packfile_offset)
+                 > be64toh(run[i].packfile_offset))) {
+        keep[i] = 0;
+        break;
+      }
+    }
+    if (keep[i] && drop_missing && record_is_stale(&records[i])) {
+      keep[i] = 0;
+    }
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Rewrites the packfile and index in index_subdir without the entries that
+ * can no longer be looked up: older entries for a path that was re-indexed,
+ * malformed records and, if drop_missing is set, entries for files that were
+ * deleted or modified since they were indexed.
+ *
+ * All index segments are folded into the new base index. Runs under the
+ * packfile lock. The manifest is first made to record the inode of the old
+ * packfile, if it does not yet. The new packfile then replaces the old one
+ * before the new base index does, and the manifest recording the new inode
+ * comes last, so a reader that mapped either index and opened the other
+ * packfile sees an inode that does not match its manifest, and reopens (see
+ * open_packfile_handle).
+ *
+ * Returns the number of entries dropped, or -1 on error or if the packfile is
+ * locked.
+ */
+long compact_packfile_in_subdir(char *index_subdir, int drop_missing) {
+  long ret_val = -1;
+  mode_t old_umask = umask(0);
+  char *packfile_lock = add_path_parts(index_subdir, PACKFILE_LOCK_NAME);
+  if (lockfile_create(packfile_lock, 0, 0) != 0) {
+    free(packfile_lock);
+    umask(old_umask);
+    return ret_val;
+  }
+  char *packfile_path = add_path_parts(index_subdir, PACKFILE_NAME);
+  char *tmp_packfile_path = add_path_parts(index_subdir,
+                                           TEMP_PACKFILE_NAME);
+  struct index_manifest manifest;
+  memset(&manifest, 0, sizeof(manifest));
+  struct index_entry *index = NULL;
+  uint8_t *packfile = MAP_FAILED;
+  struct index_entry *new_index = NULL;
+  int *keep = NULL;
+  FILE *new_packfile = NULL;
+  struct stat packfile_stat;
+  size_t num_entries = 0;
+
+  int packfile_fd = open(packfile_path, O_RDONLY);
+  if (packfile_fd == -1) {
+    if (errno == ENOENT) {
+      // nothing packed here yet
+      ret_val = 0;
+    } else {
+      perrorf("Error opening packfile in %s", index_subdir);
+    }
+    goto OUT1;
+  }
+  delete_retired_index_files(index_subdir);
+  if (read_index_manifest(index_subdir, &manifest) != 0
+      || load_index_entries(index_subdir, &manifest, &index,
+                            &num_entries) != 0) {
+    goto OUT1;
+  }
+  if (fstat(packfile_fd, &packfile_stat) != 0) {
+    perror("Error in stat of packfile");
+    goto OUT1;
+  }
+  if (num_entries == 0 || packfile_stat.st_size == 0) {
+    ret_val = 0;
+    goto OUT1;
+  }
+  packfile = mmap(NULL, packfile_stat.st_size, PROT_READ, MAP_PRIVATE,
+                  packfile_fd, 0);
+  if (packfile == MAP_FAILED) {
+    perror("Error mapping packfile");
+    goto OUT1;
+  }
+  keep = malloc(num_entries * sizeof(int));
+  if (keep == NULL) {
+    perror("Error: Memory not allocated");
+    goto OUT1;
+  }
+  // entries for the same path share a hash, so they sit next to each other
+  size_t num_kept = 0;
+  for (size_t run = 0; run < num_entries;) {
+    size_t run_len = 1;
+    while (run + run_len < num_entries
+           && index[run + run_len].hash == index[run].hash) {
+      run_len++;
+    }
+    struct packed_record *records = malloc(run_len * sizeof(*records));
+    if (records == NULL) {
+      perror("Error: Memory not allocated");
+      goto OUT1;
+    }
+    select_records_to_keep(&index[run], run_len, packfile,
+                           packfile_stat.st_size, drop_missing, records,
+                           &keep[run]);
+    free(records);
+    for (size_t i = run; i < run + run_len; i++) {
+      num_kept += keep[i];
+    }
+    run += run_len;
+  }
+  if (num_kept == num_entries) {
+    ret_val = 0;
+    goto OUT1;
+  }
+  if (manifest.packfile_ino != packfile_stat.st_ino) {
+    manifest.packfile_ino = packfile_stat.st_ino;
+    if (write_index_manifest(index_subdir, &manifest) != 0) {
+      goto OUT1;
+    }
+  }
+
+  new_index = malloc(num_entries * sizeof(struct index_entry));
+  new_packfile = fopen(tmp_packfile_path, "w");
+  if (new_index == NULL || new_packfile == NULL) {
+    perror("Error creating packfile tempfile");
+    goto OUT1;
+  }
+  size_t new_index_length = 0;
+  uint64_t new_offset = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    struct packed_record record;
+    if (!keep[i] || parse_packed_record(packfile, packfile_stat.st_size,
+          be64toh(index[i].packfile_offset), &record) != 0) {
+      continue;
+    }
+    if (fwrite(record.name - sizeof(uint16_t), record.length, 1,
+               new_packfile) != 1) {
+      perror("Error writing packfile tempfile");
+      goto OUT1;
+    }
+    new_index[new_index_length].hash = index[i].hash;
+    new_index[new_index_length].packfile_offset = htobe64(new_offset);
+    new_offset += record.length;
+    new_index_length++;
+  }
+  struct stat new_packfile_stat;
+  if (fflush(new_packfile) != 0 || fsync(fileno(new_packfile)) != 0
+      || fstat(fileno(new_packfile), &new_packfile_stat) != 0) {
+    perror("Error writing packfile tempfile");
+    goto OUT1;
+  }
+
+  if (rename(tmp_packfile_path, packfile_path) != 0) {
+    perror("Error replacing packfile");
+    goto OUT1;
+  }
+  if (replace_base_index(index_subdir, new_index, new_index_length) != 0) {
+    goto OUT1;
+  }
+  // the base now holds every entry, so no segment is needed any more
+  struct index_manifest emptied = manifest;
+  emptied.num_segments = 0;
+  emptied.packfile_ino = new_packfile_stat.st_ino;
+  write_index_manifest(index_subdir, &emptied);
+  delete_segments(index_subdir, manifest.segments, manifest.num_segments);
+  invalidate_packfile_handle(index_subdir);
+  ret_val = num_entries - new_index_length;
+
+  OUT1:
+    if (new_packfile != NULL) {
+      fclose(new_packfile);
+      unlink(tmp_packfile_path);
+    }
+    free(new_index);
+    free(keep);
+    if (packfile != MAP_FAILED) {
+      munmap(packfile, packfile_stat.st_size);
+    }
+    free(index);
+    free_index_manifest(&manifest);
+    if (packfile_fd != -1) {
+      close(packfile_fd);
+    }
+    free(tmp_packfile_path);
+    free(packfile_path);
+    lockfile_remove(packfile_lock);
+    free(packfile_lock);
+    umask(old_umask);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Compacts the packfile in every subdirectory of indexdir and in its content
+ * subdirectory, skipping those that are locked by a packer.
+ *
+ * Returns the total number of entries dropped, or -1 if indexdir could not be
+ * read.
+ */
+long compact_packfiles(char *indexdir, int drop_missing) {
+  DIR *dir = opendir(indexdir);
+  if (dir == NULL){
+    perrorf("Error in opening directory: %s", indexdir);
+    return(-1);
+  }
+  long dropped = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.' ) {
+      continue;
+    }
+    char *path = add_path_parts(indexdir, entry->d_name);
+    if (is_dir(path)) {
+      long ret = compact_packfile_in_subdir(path, drop_missing);
+      if (ret > 0) {
+        dropped += ret;
+      }
+      char *content_dir = add_path_parts(path, CONTENT_SUBDIR);
+      if (is_dir(content_dir)) {
+        ret = compact_packfile_in_subdir(content_dir, drop_missing);
+        if (ret > 0) {
+          dropped += ret;
+        }
+      }
+      free(content_dir);
+    }
+    free(path);
+  }
+  closedir(dir);
+
+  return dropped;
+}
@@ -8,22 +8,66 @@
 
 #define PACKFILE_NAME "packfile"
 #define PACKFILE_INDEX_NAME "packfile_index"
+#define TEMP_PACKFILE_NAME ".packfile.tmp"
 #define TEMP_PACKFILE_INDEX_NAME ".packfile_index.tmp"
 #define PACKFILE_LOCK_NAME ".packfile.lock"
+#define PACKFILE_FILTER_NAME ".packfile_filter"
+#define TEMP_PACKFILE_FILTER_NAME ".packfile_filter.tmp"
 #define EMPTY_FILE 1
 
 /*--------------------------------------------------------------------*/
 
+/** An entry in the index.
+ * Note: in order to allow mmaping the index file, this struct stores
+ * packfile_offset as big-endian!
+ */
+struct index_entry {
+  uint64_t hash;
+  uint64_t packfile_offset;
+};
+
+/*--------------------------------------------------------------------*/
+
 int is_corrupted(FILE* loosefile);
 
+int is_buffer_corrupted(uint8_t *data, size_t size);
+
+int compare_index_entries(const void *a, const void *b);
+
+size_t find_hash_in_index(struct index_entry *index,
+    size_t num_entries, uint64_t hash);
+
+int read_from_packfile_into(uint8_t *bitmap, char *filename, int64_t mtime,
+    char *indexdir);
+
 uint8_t *read_from_packfile(char *filename, int64_t mtime, char *store);
 
+int read_from_packfile_batch(char **filenames, int64_t *mtimes, int num,
+    char *indexdir, uint8_t **bitmaps, int *found);
+
+int prefetch_from_packfile(char *filename, char *indexdir);
+
+int create_file_if_nonexistent(char *path);
+
+int count_loose_files(char *dir_path);
+
+long write_data_to_packfile(void *data, size_t size, FILE *packfile);
+
+int add_entries_to_index(struct index_entry *new_entries,
+    int num_new_entries, char *indexdir);
+
+void invalidate_packfile_handle(char *indexdir);
+
 int pack_loose_files(char *indexdir);
 
 int pack_loose_files_in_subdir(char *index_subdir);
 
 int remove_if_corrupted(FILE *file, char *file_path);
 
+long compact_packfile_in_subdir(char *index_subdir, int drop_missing);
+
+long compact_packfiles(char *indexdir, int drop_missing);
+
 /*--------------------------------------------------------------------*/
 
 #endif
@@ -0,0 +1,526 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "segment.h"
+#include "packfile.h"
+#include "bloom.h"
+#include "util.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * The packfile index of a directory is a set of sorted runs of entries:
+ *
+ *   packfile_index      the base, with its bloom filter in .packfile_filter
+ *   .segment_NNNNNNNN   immutable delta segments, each holding the entries of
+ *                       one pack run (or a merge of several), its own bloom
+ *                       filter included
+ *   .packfile_manifest  the list of live delta segments, and the inode of the
+ *                       packfile once compaction has rewritten it
+ *
+ * The packer writes a new segment per run instead of rewriting the base, and
+ * merges segments by size tier, folding them into the base once they hold a
+ * good fraction of its entries. Every file here is replaced by rename, so a
+ * reader sees either the old or the new version of each.
+ *
+ * Readers keep the index files mapped between lookups and only notice they
+ * were replaced by a stat of the manifest, which NFS may answer from its
+ * attribute cache. A file a reader on another host still has mapped must not
+ * lose its inode meanwhile, or touching the mapping faults. So replaced and
+ * merged files are first linked aside as .retired.<name>.<n>, and a later
+ * pack run removes them once they have been retired for RETIRED_GRACE_SEC.
+ *
+ * The packer only appends to the packfile, so index offsets stay valid in it,
+ * but compaction renames a rewritten packfile into place. The inode it records
+ * in the manifest, on the magic line where older readers ignore it, lets a
+ * reader tell a packfile that does not belong to the index it mapped.
+ */
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Header of the bloom filter stored next to the base index.
+ * The filter is only used with the index file it was built for, identified by
+ * inode and size, so a filter and index replaced one after the other are never
+ * mixed up.
+ */
+struct filter_header {
+  char magic[8];
+  uint64_t index_ino;
+  uint64_t index_size;
+  uint64_t num_blocks;
+};
+
+#define FILTER_MAGIC "4gfilt1"
+
+/**
+ * Header of a delta segment, followed by its bloom filter blocks and then its
+ * sorted entries.
+ */
+struct segment_header {
+  char magic[8];
+  uint64_t num_entries;
+  uint64_t num_blocks;
+};
+
+#define SEGMENT_MAGIC "4gsegm1"
+
+#define MANIFEST_MAGIC "4grep-manifest 1"
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Keeps the index file name in indexdir alive under a retired name, before it
+ * is replaced or removed, until delete_retired_index_files finds its grace
+ * period over.
+ *
+ * Returns 0 upon success or if there is no such file, -1 on error, in which
+ * case the file is replaced or removed all the same.
+ */
+int retire_index_file(char *indexdir, char *name) {
+  char path[PATH_MAX];
+  char retired_path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", indexdir, name);
+  for (int n = 0; n < RETIRED_MAX_COPIES; n++) {
+    snprintf(retired_path, sizeof(retired_path), "%s/%s%s.%d", indexdir,
+             RETIRED_PREFIX, name, n);
+    if (link(path, retired_path) == 0) {
+      return 0;
+    }
+    if (errno == ENOENT) {
+      return 0;
+    }
+    if (errno != EEXIST) {
+      break;
+    }
+  }
+  perrorf("Error retiring %s", path);
+  return -1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Removes the retired index files in indexdir whose grace period is over.
+ * Linking a file aside changes its ctime, so that is when it was retired.
+ * Must be called with the packfile locked.
+ */
+void delete_retired_index_files(char *indexdir) {
+  DIR *dir = opendir(indexdir);
+  if (dir == NULL) {
+    return;
+  }
+  time_t now = time(NULL);
+  char path[PATH_MAX];
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (strncmp(entry->d_name, RETIRED_PREFIX, strlen(RETIRED_PREFIX)) != 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", indexdir, entry->d_name);
+    struct stat s;
+    if (stat(path, &s) == 0 && now - s.st_ctime >= RETIRED_GRACE_SEC) {
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Maps the bloom filter in indexdir into segment, if one exists that was built
+ * for the base index the segment has mapped. Lookups work without a filter, so
+ * any problem just leaves it unset.
+ */
+static void map_base_filter(char *indexdir, struct index_segment *segment,
+    struct stat *index_stat) {
+  char *filter_path = add_path_parts(indexdir, PACKFILE_FILTER_NAME);
+  int fd = open(filter_path, O_RDONLY);
+  free(filter_path);
+  if (fd == -1) {
+    return;
+  }
+  struct stat filter_stat;
+  if (fstat(fd, &filter_stat) != 0
+      || filter_stat.st_size < sizeof(struct filter_header)) {
+    close(fd);
+    return;
+  }
+  struct filter_header *filter = mmap(NULL, filter_stat.st_size, PROT_READ,
+                                      MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (filter == MAP_FAILED) {
+    return;
+  }
+  if (memcmp(filter->magic, FILTER_MAGIC, sizeof(filter->magic)) != 0
+      || filter->index_ino != index_stat->st_ino
+      || filter->index_size != index_stat->st_size
+      || filter->num_blocks == 0
+      || filter->num_blocks > (filter_stat.st_size - sizeof(*filter))
+                              / BLOOM_BLOCK_BYTES) {
+    munmap(filter, filter_stat.st_size);
+    return;
+  }
+  segment->filter_map = filter;
+  segment->filter_map_size = filter_stat.st_size;
+  segment->filter = (uint8_t *) (filter + 1);
+  segment->num_blocks = filter->num_blocks;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Maps the base packfile index in indexdir, and its filter if it has one.
+ *
+ * Returns 0 upon success, -1 with errno set if the index could not be mapped.
+ */
+int map_base_index(char *indexdir, struct index_segment *segment) {
+  memset(segment, 0, sizeof(*segment));
+  char *index_path = add_path_parts(indexdir, PACKFILE_INDEX_NAME);
+  int fd = open(index_path, O_RDONLY);
+  free(index_path);
+  if (fd == -1) {
+    if (errno != ENOENT)
+      perror("Error: could not open packfile index");
+    return -1;
+  }
+  struct stat index_stat;
+  if (fstat(fd, &index_stat) != 0) {
+    perror("Error: could not stat packfile index");
+    close(fd);
+    return -1;
+  }
+  segment->num_entries = index_stat.st_size / sizeof(struct index_entry);
+  if (segment->num_entries > 0) {
+    segment->map_size = segment->num_entries * sizeof(struct index_entry);
+    segment->map = mmap(NULL, segment->map_size, PROT_READ, MAP_PRIVATE, fd,
+                        0);
+    if (segment->map == MAP_FAILED) {
+      perror("Error: could not mmap packfile index");
+      segment->map = NULL;
+      close(fd);
+      return -1;
+    }
+    segment->entries = segment->map;
+  }
+  close(fd);
+  map_base_filter(indexdir, segment, &index_stat);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Maps the delta segment with the given name in indexdir.
+ *
+ * Returns 0 upon success, -1 with errno set if the segment could not be mapped
+ * or is malformed.
+ */
+int map_index_segment(char *indexdir, char *name,
+    struct index_segment *segment) {
+  memset(segment, 0, sizeof(*segment));
+  char *path = add_path_parts(indexdir, name);
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat s;
+  if (fstat(fd, &s) != 0 || s.st_size < sizeof(struct segment_header)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  struct segment_header *header = mmap(NULL, s.st_size, PROT_READ,
+                                       MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    return -1;
+  }
+  size_t filter_size = header->num_blocks * BLOOM_BLOCK_BYTES;
+  if (memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) != 0
+      || header->num_blocks == 0
+      || header->num_blocks > s.st_size / BLOOM_BLOCK_BYTES
+      || header->num_entries > s.st_size / sizeof(struct index_entry)
+      || sizeof(*header) + filter_size
+         + header->num_entries * sizeof(struct index_entry) != s.st_size) {
+    munmap(header, s.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+  segment->map = header;
+  segment->map_size = s.st_size;
+  segment->filter = (uint8_t *) (header + 1);
+  segment->num_blocks = header->num_blocks;
+  segment->entries = (struct index_entry *) (segment->filter + filter_size);
+  segment->num_entries = header->num_entries;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+void unmap_index_segment(struct index_segment *segment) {
+  if (segment->map != NULL) {
+    munmap(segment->map, segment->map_size);
+  }
+  if (segment->filter_map != NULL) {
+    munmap(segment->filter_map, segment->filter_map_size);
+  }
+  memset(segment, 0, sizeof(*segment));
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the location of the first entry with the given hash in the segment,
+ * or -1 if there is none. The segment's bloom filter answers most misses
+ * without touching its entries.
+ */
+size_t find_hash_in_segment(struct index_segment *segment, uint64_t hash) {
+  if (segment->num_entries == 0) {
+    return -1;
+  }
+  if (segment->filter != NULL
+      && !bloom_may_contain(segment->filter, segment->num_blocks, hash)) {
+    return -1;
+  }
+  return find_hash_in_index(segment->entries, segment->num_entries, hash);
+}
+
+/*--------------------------------------------------------------------*/
+
+static uint8_t *build_filter(struct index_entry *entries, size_t num_entries,
+    uint64_t num_blocks) {
+  uint8_t *blocks = calloc(num_blocks, BLOOM_BLOCK_BYTES);
+  if (blocks == NULL) {
+    perror("Error: Memory not allocated");
+    return NULL;
+  }
+  for (size_t i = 0; i < num_entries; i++) {
+    bloom_add(blocks, num_blocks, entries[i].hash);
+  }
+  return blocks;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Writes a bloom filter over the hashes in index to the filter file in
+ * indexdir, tagged with the inode and size of the index file at index_path
+ * that is about to replace the current base index.
+ */
+int write_index_filter(struct index_entry *index, size_t num_entries,
+    char *index_path, char *indexdir) {
+  int ret_val = -1;
+  struct stat index_stat;
+  if (stat(index_path, &index_stat) != 0) {
+    perror("Error in stat of new index");
+    return ret_val;
+  }
+  struct filter_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FILTER_MAGIC, sizeof(header.magic));
+  header.index_ino = index_stat.st_ino;
+  header.index_size = index_stat.st_size;
+  header.num_blocks = bloom_num_blocks(num_entries);
+  uint8_t *blocks = build_filter(index, num_entries, header.num_blocks);
+  if (blocks == NULL) {
+    return ret_val;
+  }
+
+  char *tmpfile_path = add_path_parts(indexdir, TEMP_PACKFILE_FILTER_NAME);
+  char *filter_path = add_path_parts(indexdir, PACKFILE_FILTER_NAME);
+  FILE *file = fopen(tmpfile_path, "w");
+  if (file == NULL) {
+    perror("Error creating filter tempfile");
+    goto OUT1;
+  }
+  if (fwrite(&header, sizeof(header), 1, file) != 1
+      || fwrite(blocks, BLOOM_BLOCK_BYTES, header.num_blocks, file)
+         != header.num_blocks) {
+    perror("Error writing filter tempfile");
+    fclose(file);
+    goto OUT1;
+  }
+  fclose(file);
+  retire_index_file(indexdir, PACKFILE_FILTER_NAME);
+  if (rename(tmpfile_path, filter_path) != 0) {
+    perror("Error replacing filter");
+    goto OUT1;
+  }
+  ret_val = 0;
+
+  OUT1:
+    free(tmpfile_path);
+    free(filter_path);
+    free(blocks);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the manifest in indexdir. A directory without a manifest has no delta
+ * segments.
+ *
+ * Returns 0 upon success, -1 if the manifest could not be read.
+ */
+int read_index_manifest(char *indexdir, struct index_manifest *manifest) {
+  memset(manifest, 0, sizeof(*manifest));
+  char *path = add_path_parts(indexdir, INDEX_MANIFEST_NAME);
+  FILE *file = fopen(path, "r");
+  free(path);
+  if (file == NULL) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  char line[128];
+  if (fgets(line, sizeof(line), file) == NULL
+      || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0
+      || fscanf(file, "next %" SCNu64 "\n", &manifest->next_segment) != 1) {
+    fprintf(stderr, "Error: malformed index manifest in %s\n", indexdir);
+    fclose(file);
+    return -1;
+  }
+  sscanf(line + strlen(MANIFEST_MAGIC), " packfile %" SCNu64,
+         &manifest->packfile_ino);
+  char name[INDEX_SEGMENT_NAME_MAX];
+  uint64_t num_entries;
+  while (fscanf(file, "%31s %" SCNu64 "\n", name, &num_entries) == 2) {
+    struct manifest_segment *segments = realloc(manifest->segments,
+        (manifest->num_segments + 1) * sizeof(*segments));
+    if (segments == NULL) {
+      perror("Error: Memory not allocated");
+      fclose(file);
+      free_index_manifest(manifest);
+      return -1;
+    }
+    manifest->segments = segments;
+    strcpy(segments[manifest->num_segments].name, name);
+    segments[manifest->num_segments].num_entries = num_entries;
+    manifest->num_segments++;
+  }
+  fclose(file);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Replaces the manifest in indexdir with the given one.
+ */
+int write_index_manifest(char *indexdir, struct index_manifest *manifest) {
+  int ret_val = -1;
+  char *tmpfile_path = add_path_parts(indexdir, TEMP_INDEX_MANIFEST_NAME);
+  char *path = add_path_parts(indexdir, INDEX_MANIFEST_NAME);
+  FILE *file = fopen(tmpfile_path, "w");
+  if (file == NULL) {
+    perror("Error creating manifest tempfile");
+    goto OUT1;
+  }
+  fprintf(file, "%s", MANIFEST_MAGIC);
+  if (manifest->packfile_ino != 0) {
+    fprintf(file, " packfile %" PRIu64, manifest->packfile_ino);
+  }
+  fprintf(file, "\nnext %" PRIu64 "\n", manifest->next_segment);
+  for (int i = 0; i < manifest->num_segments; i++) {
+    fprintf(file, "%s %" PRIu64 "\n", manifest->segments[i].name,
+            manifest->segments[i].num_entries);
+  }
+  if (fclose(file) != 0) {
+    perror("Error writing manifest tempfile");
+    goto OUT1;
+  }
+  if (rename(tmpfile_path, path) != 0) {
+    perror("Error replacing manifest");
+    goto OUT1;
+  }
+  ret_val = 0;
+
+  OUT1:
+    free(tmpfile_path);
+    free(path);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+void free_index_manifest(struct index_manifest *manifest) {
+  free(manifest->segments);
+  manifest->segments = NULL;
+  manifest->num_segments = 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Writes the sorted entries to a new delta segment in indexdir and appends it
+ * to manifest. The manifest itself is not written.
+ *
+ * Returns 0 upon success, -1 on error.
+ */
+int add_index_segment(char *indexdir, struct index_manifest *manifest,
+    struct index_entry *entries, size_t num_entries) {
+  int ret_val = -1;
+  struct manifest_segment *segments = realloc(manifest->segments,
+      (manifest->num_segments + 1) * sizeof(*segments));
+  if (segments == NULL) {
+    perror("Error: Memory not allocated");
+    return ret_val;
+  }
+  manifest->segments = segments;
+  struct manifest_segment *segment = &segments[manifest->num_segments];
+  snprintf(segment->name, sizeof(segment->name), "%s%08" PRIu64,
+           INDEX_SEGMENT_PREFIX, manifest->next_segment);
+  segment->num_entries = num_entries;
+
+  struct segment_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+  header.num_entries = num_entries;
+  header.num_blocks = bloom_num_blocks(num_entries);
+  uint8_t *blocks = build_filter(entries, num_entries, header.num_blocks);
+  if (blocks == NULL) {
+    return ret_val;
+  }
+  char *tmpfile_path = add_path_parts(indexdir, TEMP_INDEX_SEGMENT_NAME);
+  char *path = add_path_parts(indexdir, segment->name);
+  FILE *file = fopen(tmpfile_path, "w");
+  if (file == NULL) {
+    perror("Error creating segment tempfile");
+    goto OUT1;
+  }
+  if (fwrite(&header, sizeof(header), 1, file) != 1
+      || fwrite(blocks, BLOOM_BLOCK_BYTES, header.num_blocks, file)
+         != header.num_blocks
+      || fwrite(entries, sizeof(struct index_entry), num_entries, file)
+         != num_entries) {
+    perror("Error writing segment tempfile");
+    fclose(file);
+    goto OUT1;
+  }
+  if (fclose(file) != 0 || rename(tmpfile_path, path) != 0) {
+    perror("Error writing segment");
+    goto OUT1;
+  }
+  manifest->num_segments++;
+  manifest->next_segment++;
+  ret_val = 0;
+
+  OUT1:
+    free(tmpfile_path);
+    free(path);
+    free(blocks);
+    return ret_val;
+}
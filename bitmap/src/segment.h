@@ -0,0 +1,91 @@
+#ifndef SEGMENT_INCLUDED
+#define SEGMENT_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "packfile.h"
+
+/*--------------------------------------------------------------------*/
+
+#define INDEX_MANIFEST_NAME ".packfile_manifest"
+#define TEMP_INDEX_MANIFEST_NAME ".packfile_manifest.tmp"
+#define INDEX_SEGMENT_PREFIX ".segment_"
+#define TEMP_INDEX_SEGMENT_NAME ".segment.tmp"
+
+/* longest segment file name, including the terminating null byte */
+#define INDEX_SEGMENT_NAME_MAX 32
+
+/* replaced index files are kept as .retired.<name>.<n> for readers on other
+ * hosts that may still have them mapped, for well over the longest time NFS
+ * caches attributes, after which those readers have seen the new manifest */
+#define RETIRED_PREFIX ".retired."
+#define RETIRED_GRACE_SEC (10 * 60)
+#define RETIRED_MAX_COPIES 1000
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * A sorted run of index entries mapped into memory: either the base
+ * packfile_index with its separate filter file, or a delta segment, which
+ * carries its filter in the same file.
+ */
+struct index_segment {
+  struct index_entry *entries;
+  size_t num_entries;
+  const uint8_t *filter;
+  uint64_t num_blocks;
+  void *map;
+  size_t map_size;
+  void *filter_map;
+  size_t filter_map_size;
+};
+
+struct manifest_segment {
+  char name[INDEX_SEGMENT_NAME_MAX];
+  uint64_t num_entries;
+};
+
+/**
+ * The delta segments of an index directory, oldest first, and the inode of
+ * the packfile the index refers to, or 0 if compaction never rewrote it.
+ */
+struct index_manifest {
+  uint64_t next_segment;
+  int num_segments;
+  struct manifest_segment *segments;
+  uint64_t packfile_ino;
+};
+
+/*--------------------------------------------------------------------*/
+
+int map_base_index(char *indexdir, struct index_segment *segment);
+
+int map_index_segment(char *indexdir, char *name,
+    struct index_segment *segment);
+
+void unmap_index_segment(struct index_segment *segment);
+
+int retire_index_file(char *indexdir, char *name);
+
+void delete_retired_index_files(char *indexdir);
+
+size_t find_hash_in_segment(struct index_segment *segment, uint64_t hash);
+
+int write_index_filter(struct index_entry *index, size_t num_entries,
+    char *index_path, char *indexdir);
+
+int read_index_manifest(char *indexdir, struct index_manifest *manifest);
+
+int write_index_manifest(char *indexdir, struct index_manifest *manifest);
+
+void free_index_manifest(struct index_manifest *manifest);
+
+int add_index_segment(char *indexdir, struct index_manifest *manifest,
+    struct index_entry *entries, size_t num_entries);
+
+/*--------------------------------------------------------------------*/
+
+#endif
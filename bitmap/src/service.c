@@ -0,0 +1,749 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "service.h"
+#include "bitmap.h"
+#include "filter.h"
+#include "content.h"
+#include "util.h"
+#include "xxhash.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * A local service answering filter queries from memory, so that searches on a
+ * shared host do not each cold-open the packed index over NFS.
+ *
+ * The service listens on an abstract Unix socket named after the index
+ * directory. A client sends the ngram filter and the files to check as open
+ * file descriptors (SCM_RIGHTS), so it can only ask about files it can open,
+ * and the service takes their paths and mtimes from the descriptors. Each file
+ * is answered from an LRU cache of decompressed bitmaps, or from the index on
+ * a miss, through the same packfile handles every lookup in this process
+ * shares. Files the index does not hold are answered SERVICE_UNKNOWN and left
+ * to the client, which indexes them as usual.
+ */
+
+#ifdef __linux__
+
+#include <sys/signalfd.h>
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * A request is this header, the length of each filter row, then the ngram
+ * indices of all rows, in native byte order. The reply is one result byte per
+ * file.
+ */
+struct service_request {
+  uint32_t magic;
+  uint32_t num_files;
+  uint32_t num_rows;
+  uint32_t num_ngrams;
+};
+
+struct cached_bitmap {
+  uint64_t hash;
+  int64_t mtime;
+  char *path;
+  uint8_t *bitmap;
+  struct cached_bitmap *chain_next;
+  struct cached_bitmap *lru_prev;
+  struct cached_bitmap *lru_next;
+};
+
+struct service {
+  char indexdir[PATH_MAX];
+  struct cached_bitmap **buckets;
+  size_t num_buckets;
+  struct cached_bitmap *lru_head;
+  struct cached_bitmap *lru_tail;
+  size_t num_cached;
+  size_t max_cached;
+  long lookups;
+  long hits;
+  int client_fds[SERVICE_MAX_CLIENTS];
+  int num_clients;
+  pthread_mutex_t mutex;
+  pthread_cond_t clients_done;
+};
+
+struct service_client {
+  struct service *service;
+  int sock;
+  int slot;
+  uint8_t *bitmap;
+  char real_path[PATH_MAX];
+  char index_subdir[PATH_MAX];
+  char content_dir[PATH_MAX];
+  char content_name[CONTENT_NAME_MAX];
+};
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Fills addr with the abstract socket address of the service for indexdir,
+ * which must be a real path.
+ */
+static socklen_t service_address(char *indexdir, struct sockaddr_un *addr) {
+  char hash[17];
+  get_hash(indexdir, strlen(indexdir), hash);
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                     "4grep.%s", hash);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void unlink_lru(struct service *service, struct cached_bitmap *entry) {
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    service->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    service->lru_tail = entry->lru_prev;
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+static void push_lru(struct service *service, struct cached_bitmap *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = service->lru_head;
+  if (service->lru_head != NULL) {
+    service->lru_head->lru_prev = entry;
+  } else {
+    service->lru_tail = entry;
+  }
+  service->lru_head = entry;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void free_cached_bitmap(struct cached_bitmap *entry) {
+  free(entry->path);
+  free(entry->bitmap);
+  free(entry);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the cached bitmap of path at mtime and marks it most recently used,
+ * or NULL. Must be called with the service mutex held.
+ */
+static struct cached_bitmap *find_cached_bitmap(struct service *service,
+    uint64_t hash, char *path, int64_t mtime) {
+  struct cached_bitmap *entry =
+    service->buckets[hash & (service->num_buckets - 1)];
+  for (; entry != NULL; entry = entry->chain_next) {
+    if (entry->hash == hash && entry->mtime == mtime
+        && strcmp(entry->path, path) == 0) {
+      unlink_lru(service, entry);
+      push_lru(service, entry);
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Drops the least recently used bitmap. Must be called with the service mutex
+ * held.
+ */
+static void evict_cached_bitmap(struct service *service) {
+  struct cached_bitmap *entry = service->lru_tail;
+  struct cached_bitmap **link =
+    &service->buckets[entry->hash & (service->num_buckets - 1)];
+  while (*link != entry) {
+    link = &(*link)->chain_next;
+  }
+  *link = entry->chain_next;
+  unlink_lru(service, entry);
+  service->num_cached--;
+  free_cached_bitmap(entry);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Adds a copy of bitmap to the cache, evicting the least recently used one if
+ * it is full.
+ */
+static void cache_bitmap(struct service *service, uint64_t hash, char *path,
+    int64_t mtime, uint8_t *bitmap) {
+  struct cached_bitmap *entry = malloc(sizeof(*entry));
+  if (entry == NULL) {
+    return;
+  }
+  entry->hash = hash;
+  entry->mtime = mtime;
+  entry->path = strdup(path);
+  entry->bitmap = malloc(SIZEOF_BITMAP);
+  if (entry->path == NULL || entry->bitmap == NULL) {
+    free_cached_bitmap(entry);
+    return;
+  }
+  memcpy(entry->bitmap, bitmap, SIZEOF_BITMAP);
+
+  pthread_mutex_lock(&service->mutex);
+  if (find_cached_bitmap(service, hash, path, mtime) != NULL) {
+    // another client read the same file meanwhile
+    pthread_mutex_unlock(&service->mutex);
+    free_cached_bitmap(entry);
+    return;
+  }
+  if (service->num_cached == service->max_cached) {
+    evict_cached_bitmap(service);
+  }
+  struct cached_bitmap **bucket =
+    &service->buckets[hash & (service->num_buckets - 1)];
+  entry->chain_next = *bucket;
+  *bucket = entry;
+  push_lru(service, entry);
+  service->num_cached++;
+  pthread_mutex_unlock(&service->mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the bitmap of the file open at fd from the index, as
+ * get_bitmap_for_file would, but without ever building one.
+ *
+ * Returns 0 upon success, -1 if the index does not hold it.
+ */
+static int read_indexed_bitmap(struct service_client *client, int fd,
+    int64_t mtime) {
+  char *indexdir = client->service->indexdir;
+  index_subdirectory_path(client->index_subdir, indexdir, mtime);
+  if (check_loose_files(client->real_path, mtime, client->bitmap,
+                        client->index_subdir) == 0
+      || check_pack_files(client->real_path, mtime, client->bitmap,
+                          client->index_subdir) == 0) {
+    return 0;
+  }
+  if (gzip_content_name(fd, client->content_name) != 0) {
+    return -1;
+  }
+  if (content_subdirectory_path(client->content_dir, indexdir, mtime) != 0) {
+    return -1;
+  }
+  if (check_loose_files(client->content_name, 0, client->bitmap,
+                        client->content_dir) == 0
+      || check_pack_files(client->content_name, 0, client->bitmap,
+                          client->content_dir) == 0) {
+    return 0;
+  }
+  return -1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the answer for the file a client sent as fd: 1 if it matches the
+ * filter, 2 if it does not, SERVICE_UNKNOWN if its bitmap is not indexed.
+ */
+static int8_t answer_file(struct service_client *client, int fd,
+    struct intarrayarray filter) {
+  struct service *service = client->service;
+  struct stat s;
+  if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode)) {
+    return SERVICE_UNKNOWN;
+  }
+  char fd_path[64];
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+  ssize_t len = readlink(fd_path, client->real_path, PATH_MAX - 1);
+  if (len <= 0 || len == PATH_MAX - 1) {
+    return SERVICE_UNKNOWN;
+  }
+  client->real_path[len] = '\0';
+  int64_t mtime = s.st_mtime;
+  uint64_t hash = XXH64(client->real_path, len, mtime);
+
+  pthread_mutex_lock(&service->mutex);
+  service->lookups++;
+  struct cached_bitmap *cached =
+    find_cached_bitmap(service, hash, client->real_path, mtime);
+  if (cached != NULL) {
+    service->hits++;
+    int filtered = should_filter_out_file(cached->bitmap, filter);
+    pthread_mutex_unlock(&service->mutex);
+    return filtered ? 2 : 1;
+  }
+  pthread_mutex_unlock(&service->mutex);
+
+  if (read_indexed_bitmap(client, fd, mtime) != 0) {
+    return SERVICE_UNKNOWN;
+  }
+  cache_bitmap(service, hash, client->real_path, mtime, client->bitmap);
+  return should_filter_out_file(client->bitmap, filter) ? 2 : 1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Checks a request of len bytes and points the rows of filter into it.
+ *
+ * Returns the number of files it asks about, or -1 if it is malformed.
+ */
+static int parse_request(uint8_t *message, size_t len,
+    struct intarrayarray *filter) {
+  struct service_request request;
+  if (len < sizeof(request)) {
+    return -1;
+  }
+  memcpy(&request, message, sizeof(request));
+  if (request.magic != SERVICE_MAGIC
+      || request.num_files == 0 || request.num_files > SERVICE_MAX_FILES
+      || request.num_rows == 0 || request.num_rows > SERVICE_MAX_ROWS
+      || request.num_ngrams > SERVICE_MAX_MESSAGE / sizeof(uint32_t)
+      || len != sizeof(request)
+                + (request.num_rows + request.num_ngrams) * sizeof(uint32_t)) {
+    return -1;
+  }
+  uint32_t *row_lengths = (uint32_t *) (message + sizeof(request));
+  int *ngrams = (int *) (row_lengths + request.num_rows);
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < request.num_rows; i++) {
+    if (row_lengths[i] > request.num_ngrams - total) {
+      return -1;
+    }
+    filter->rows[i].length = row_lengths[i];
+    filter->rows[i].data = ngrams + total;
+    total += row_lengths[i];
+  }
+  if (total != request.num_ngrams) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < total; i++) {
+    if (ngrams[i] < 0 || ngrams[i] >= POSSIBLE_NGRAMS) {
+      return -1;
+    }
+  }
+  filter->num_rows = request.num_rows;
+  return request.num_files;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *serve_client(void *arg) {
+  struct service_client *client = arg;
+  struct service *service = client->service;
+  uint8_t *message = malloc(SERVICE_MAX_MESSAGE);
+  client->bitmap = init_bitmap();
+  if (message == NULL || client->bitmap == NULL) {
+    goto OUT1;
+  }
+  struct intarray rows[SERVICE_MAX_ROWS];
+  struct intarrayarray filter = {.num_rows = 0, .rows = rows};
+  while (1) {
+    union {
+      char buf[CMSG_SPACE(SERVICE_MAX_FILES * sizeof(int))];
+      struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = message, .iov_len = SERVICE_MAX_MESSAGE};
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t len = recvmsg(client->sock, &msg, MSG_CMSG_CLOEXEC);
+    if (len <= 0) {
+      break;
+    }
+    int fds[SERVICE_MAX_FILES];
+    int num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (int i = 0; i < n; i++) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        if (num_fds < SERVICE_MAX_FILES) {
+          fds[num_fds++] = fd;
+        } else {
+          close(fd);
+        }
+      }
+    }
+    int num_files = -1;
+    if (!(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+      num_files = parse_request(message, len, &filter);
+    }
+    int8_t results[SERVICE_MAX_FILES];
+    if (num_files == num_fds) {
+      for (int i = 0; i < num_files; i++) {
+        results[i] = answer_file(client, fds[i], filter);
+      }
+    }
+    for (int i = 0; i < num_fds; i++) {
+      close(fds[i]);
+    }
+    if (num_files != num_fds) {
+      break;
+    }
+    if (send(client->sock, results, num_files, MSG_NOSIGNAL) != num_files) {
+      break;
+    }
+  }
+
+  OUT1:
+    close(client->sock);
+    pthread_mutex_lock(&service->mutex);
+    service->client_fds[client->slot] = -1;
+    service->num_clients--;
+    pthread_cond_signal(&service->clients_done);
+    pthread_mutex_unlock(&service->mutex);
+    free(client->bitmap);
+    free(client);
+    free(message);
+    return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Starts a thread serving a newly accepted connection, or turns it away if
+ * the service is busy.
+ */
+static void accept_client(struct service *service, int sock) {
+  struct service_client *client = malloc(sizeof(*client));
+  if (client == NULL) {
+    perror("Error: Memory not allocated");
+    close(sock);
+    return;
+  }
+  client->service = service;
+  client->sock = sock;
+  client->bitmap = NULL;
+  pthread_mutex_lock(&service->mutex);
+  int slot = 0;
+  while (slot < SERVICE_MAX_CLIENTS && service->client_fds[slot] != -1) {
+    slot++;
+  }
+  if (slot == SERVICE_MAX_CLIENTS) {
+    pthread_mutex_unlock(&service->mutex);
+    free(client);
+    close(sock);
+    return;
+  }
+  client->slot = slot;
+  service->client_fds[slot] = sock;
+  service->num_clients++;
+  pthread_mutex_unlock(&service->mutex);
+
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, serve_client, client) != 0) {
+    perror("Error starting service thread");
+    pthread_mutex_lock(&service->mutex);
+    service->client_fds[slot] = -1;
+    service->num_clients--;
+    pthread_mutex_unlock(&service->mutex);
+    free(client);
+    close(sock);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Serves filter queries for the index in indexdir, keeping up to cache_bytes
+ * of decompressed bitmaps in memory, until the process receives SIGINT or
+ * SIGTERM.
+ *
+ * Returns 0 upon success, -1 on error, including when a service for indexdir
+ * is already running.
+ */
+int run_service(char *indexdir, size_t cache_bytes) {
+  int ret_val = -1;
+  int listen_sock = -1;
+  int signal_fd = -1;
+  struct service *service = calloc(1, sizeof(*service));
+  if (service == NULL) {
+    perror("Error: Memory not allocated");
+    return ret_val;
+  }
+  if (realpath(indexdir, service->indexdir) == NULL) {
+    perrorf("Error resolving index directory %s", indexdir);
+    free(service);
+    return ret_val;
+  }
+  service->max_cached = cache_bytes / SIZEOF_BITMAP;
+  if (service->max_cached == 0) {
+    service->max_cached = 1;
+  }
+  service->num_buckets = 1;
+  while (service->num_buckets < service->max_cached) {
+    service->num_buckets *= 2;
+  }
+  service->buckets = calloc(service->num_buckets, sizeof(*service->buckets));
+  if (service->buckets == NULL) {
+    perror("Error: Memory not allocated");
+    free(service);
+    return ret_val;
+  }
+  for (int i = 0; i < SERVICE_MAX_CLIENTS; i++) {
+    service->client_fds[i] = -1;
+  }
+  pthread_mutex_init(&service->mutex, NULL);
+  pthread_cond_init(&service->clients_done, NULL);
+
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+  signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  if (signal_fd == -1) {
+    perror("Error setting up service");
+    goto OUT1;
+  }
+
+  struct sockaddr_un addr;
+  socklen_t addr_len = service_address(service->indexdir, &addr);
+  listen_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_sock == -1) {
+    perror("Error creating service socket");
+    goto OUT1;
+  }
+  if (bind(listen_sock, (struct sockaddr *) &addr, addr_len) != 0) {
+    if (errno == EADDRINUSE) {
+      fprintf(stderr, "Error: a service is already running for %s\n",
+              service->indexdir);
+    } else {
+      perror("Error binding service socket");
+    }
+    goto OUT1;
+  }
+  if (listen(listen_sock, SOMAXCONN) != 0) {
+    perror("Error listening on service socket");
+    goto OUT1;
+  }
+
+  while (1) {
+    struct pollfd fds[2] = {
+      { .fd = listen_sock, .events = POLLIN },
+      { .fd = signal_fd, .events = POLLIN },
+    };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Error in service poll");
+      goto OUT1;
+    }
+    if (fds[1].revents & POLLIN) {
+      // take the signal, or it is delivered once the mask is restored
+      struct signalfd_siginfo info;
+      if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        perror("Error reading signal");
+      }
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      int sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+      if (sock != -1) {
+        accept_client(service, sock);
+      }
+    }
+  }
+  ret_val = 0;
+
+  OUT1:
+    if (listen_sock != -1) {
+      close(listen_sock);
+    }
+    // wake the clients up and wait for their threads to finish
+    pthread_mutex_lock(&service->mutex);
+    for (int i = 0; i < SERVICE_MAX_CLIENTS; i++) {
+      if (service->client_fds[i] != -1) {
+        shutdown(service->client_fds[i], SHUT_RDWR);
+      }
+    }
+    while (service->num_clients > 0) {
+      pthread_cond_wait(&service->clients_done, &service->mutex);
+    }
+    pthread_mutex_unlock(&service->mutex);
+    if (ret_val == 0) {
+      fprintf(stderr, "Served %ld lookups, %ld from memory\n",
+              service->lookups, service->hits);
+    }
+    while (service->lru_tail != NULL) {
+      evict_cached_bitmap(service);
+    }
+    if (signal_fd != -1) {
+      close(signal_fd);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    pthread_cond_destroy(&service->clients_done);
+    pthread_mutex_destroy(&service->mutex);
+    free(service->buckets);
+    free(service);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Connects to the service for the index in indexdir.
+ *
+ * Only a service run by this user, the owner of the index or root is
+ * trusted, as anyone on the host can take the socket name and answer anything.
+ *
+ * Returns the connected socket, or -1 if no service is running.
+ */
+int connect_service(char *indexdir) {
+  char real_indexdir[PATH_MAX];
+  if (realpath(indexdir, real_indexdir) == NULL) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t addr_len = service_address(real_indexdir, &addr);
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    return -1;
+  }
+  if (connect(sock, (struct sockaddr *) &addr, addr_len) != 0) {
+    close(sock);
+    return -1;
+  }
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  struct stat s;
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0
+      || stat(real_indexdir, &s) != 0
+      || (cred.uid != getuid() && cred.uid != s.st_uid && cred.uid != 0)) {
+    close(sock);
+    return -1;
+  }
+  struct timeval timeout = {.tv_sec = SERVICE_TIMEOUT_SEC, .tv_usec = 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  return sock;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Asks the service connected at sock about the num_files files open at fds,
+ * storing one answer per file in results: 1 if it matches filter, 2 if it
+ * does not, SERVICE_UNKNOWN if the service does not hold its bitmap.
+ *
+ * A query too large for the service is answered SERVICE_UNKNOWN for every file
+ * without being sent.
+ *
+ * Returns 0 upon success, -1 if the service did not answer.
+ */
+int query_service(int sock, struct intarrayarray filter, int *fds,
+    int num_files, int8_t *results) {
+  memset(results, SERVICE_UNKNOWN, num_files);
+  size_t num_ngrams = 0;
+  for (int i = 0; i < filter.num_rows; i++) {
+    num_ngrams += filter.rows[i].length;
+  }
+  size_t len = sizeof(struct service_request)
+    + (filter.num_rows + num_ngrams) * sizeof(uint32_t);
+  if (num_files < 1 || num_files > SERVICE_MAX_FILES
+      || filter.num_rows < 1 || filter.num_rows > SERVICE_MAX_ROWS
+      || len > SERVICE_MAX_MESSAGE) {
+    return 0;
+  }
+
+  uint32_t message[SERVICE_MAX_MESSAGE / sizeof(uint32_t)];
+  struct service_request request = {
+    .magic = SERVICE_MAGIC,
+    .num_files = num_files,
+    .num_rows = filter.num_rows,
+    .num_ngrams = num_ngrams,
+  };
+  memcpy(message, &request, sizeof(request));
+  uint32_t *row_lengths = message + sizeof(request) / sizeof(uint32_t);
+  uint32_t *ngrams = row_lengths + filter.num_rows;
+  for (int i = 0; i < filter.num_rows; i++) {
+    row_lengths[i] = filter.rows[i].length;
+    memcpy(ngrams, filter.rows[i].data, filter.rows[i].length * sizeof(int));
+    ngrams += filter.rows[i].length;
+  }
+
+  union {
+    char buf[CMSG_SPACE(SERVICE_MAX_FILES * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = message, .iov_len = len};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = CMSG_SPACE(num_files * sizeof(int)),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(num_files * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, num_files * sizeof(int));
+  if (sendmsg(sock, &msg, MSG_NOSIGNAL) != len) {
+    return -1;
+  }
+  if (recv(sock, results, num_files, 0) != num_files) {
+    return -1;
+  }
+  for (int i = 0; i < num_files; i++) {
+    if (results[i] != 1 && results[i] != 2) {
+      results[i] = SERVICE_UNKNOWN;
+    }
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+#else
+
+int run_service(char *indexdir, size_t cache_bytes) {
+  fprintf(stderr, "Error: the service needs abstract Unix sockets, which "
+          "are Linux only\n");
+  return -1;
+}
+
+int connect_service(char *indexdir) {
+  return -1;
+}
+
+int query_service(int sock, struct intarrayarray filter, int *fds,
+    int num_files, int8_t *results) {
+  return -1;
+}
+
+#endif
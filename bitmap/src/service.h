@@ -0,0 +1,45 @@
+#ifndef SERVICE_INCLUDED
+#define SERVICE_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include "util.h"
+
+/*--------------------------------------------------------------------*/
+
+/* first word of every request, so stray connections are refused */
+#define SERVICE_MAGIC 0x34677270
+
+/* limits of one request; larger queries are answered without the service */
+#define SERVICE_MAX_FILES 64
+#define SERVICE_MAX_ROWS 64
+#define SERVICE_MAX_MESSAGE (64 * 1024)
+
+/* connections served at once; further clients are turned away */
+#define SERVICE_MAX_CLIENTS 256
+
+/* how long a client waits on the service, and before trying it again */
+#define SERVICE_TIMEOUT_SEC 5
+#define SERVICE_RETRY_SEC 10
+
+/* bitmaps the service keeps in memory unless told otherwise */
+#define SERVICE_DEFAULT_CACHE_BYTES (1024L * 1024 * 1024)
+
+/* answer for a file whose bitmap the index does not hold; the others are
+ * start_filter's 1 (matches) and 2 (does not match) */
+#define SERVICE_UNKNOWN 0
+
+/*--------------------------------------------------------------------*/
+
+int run_service(char *indexdir, size_t cache_bytes);
+
+int connect_service(char *indexdir);
+
+int query_service(int sock, struct intarrayarray filter, int *fds,
+    int num_files, int8_t *results);
+
+/*--------------------------------------------------------------------*/
+
+#endif
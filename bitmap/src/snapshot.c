@@ -0,0 +1,291 @@
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "snapshot.h"
+
+/*--------------------------------------------------------------------*/
+
+/* most directories a process keeps snapshots of at once */
+#define SNAPSHOT_CACHE_SIZE 64
+
+/* length of a loose file name: 16 hex digits, '_' and a 3 digit suffix */
+#define LOOSE_NAME_LEN 20
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * The loose files for one filename hash: the suffixes _000 up to count - 1
+ * may exist. A count of 0 marks an empty slot.
+ */
+struct loose_entry {
+  uint64_t hash;
+  int count;
+};
+
+/**
+ * The loose file names in one index subdirectory, as an open-addressed hash
+ * set keyed by filename hash.
+ */
+struct dir_snapshot {
+  char *directory;
+  struct timespec dir_mtime;
+  struct timespec checked;
+  int racy;
+  struct loose_entry *entries;
+  size_t capacity;
+  size_t num_entries;
+  struct dir_snapshot *next;
+};
+
+static struct dir_snapshot *snapshots = NULL;
+static pthread_mutex_t snapshots_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Parses a loose file name of the form HASH_NNN.
+ *
+ * Returns 0 and sets hash and suffix upon success, -1 if name is not a loose
+ * file name.
+ */
+static int parse_loose_name(const char *name, uint64_t *hash, int *suffix) {
+  if (strlen(name) != LOOSE_NAME_LEN || name[16] != '_') {
+    return -1;
+  }
+  uint64_t h = 0;
+  for (int i = 0; i < 16; i++) {
+    char c = name[i];
+    int digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else {
+      return -1;
+    }
+    h = (h << 4) | digit;
+  }
+  int n = 0;
+  for (int i = 17; i < LOOSE_NAME_LEN; i++) {
+    if (name[i] < '0' || name[i] > '9') {
+      return -1;
+    }
+    n = n * 10 + name[i] - '0';
+  }
+  *hash = h;
+  *suffix = n;
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+static struct loose_entry *find_slot(struct loose_entry *entries,
+    size_t capacity, uint64_t hash) {
+  size_t i = hash & (capacity - 1);
+  while (entries[i].count != 0 && entries[i].hash != hash) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &entries[i];
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Records that the loose file with the given hash and suffix exists.
+ *
+ * Returns 0 upon success, -1 if memory could not be allocated.
+ */
+static int snapshot_insert(struct dir_snapshot *snap, uint64_t hash,
+    int suffix) {
+  if (2 * (snap->num_entries + 1) > snap->capacity) {
+    size_t capacity = snap->capacity ? 2 * snap->capacity : 64;
+    struct loose_entry *entries = calloc(capacity, sizeof(*entries));
+    if (entries == NULL) {
+      perror("Error: Memory not allocated");
+      return -1;
+    }
+    for (size_t i = 0; i < snap->capacity; i++) {
+      if (snap->entries[i].count != 0) {
+        *find_slot(entries, capacity, snap->entries[i].hash) =
+          snap->entries[i];
+      }
+    }
+    free(snap->entries);
+    snap->entries = entries;
+    snap->capacity = capacity;
+  }
+  struct loose_entry *slot = find_slot(snap->entries, snap->capacity, hash);
+  if (slot->count == 0) {
+    slot->hash = hash;
+    snap->num_entries++;
+  }
+  if (slot->count < suffix + 1) {
+    slot->count = suffix + 1;
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Re-reads the loose file names in the snapshot's directory.
+ *
+ * The directory's mtime is read before listing it, so a file added during the
+ * listing makes the next check see a newer mtime and rebuild again.
+ */
+static void rebuild_snapshot(struct dir_snapshot *snap) {
+  snap->num_entries = 0;
+  if (snap->entries != NULL) {
+    memset(snap->entries, 0, snap->capacity * sizeof(*snap->entries));
+  }
+  struct stat s;
+  if (stat(snap->directory, &s) != 0) {
+    memset(&snap->dir_mtime, 0, sizeof(snap->dir_mtime));
+    snap->racy = 1;
+    return;
+  }
+  snap->dir_mtime = s.st_mtim;
+  // a change within the mtime's granularity would go unnoticed, so a
+  // recently modified directory is re-listed rather than trusted
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  snap->racy = now.tv_sec - s.st_mtim.tv_sec < SNAPSHOT_RACY_SEC;
+
+  DIR *dir = opendir(snap->directory);
+  if (dir == NULL) {
+    snap->racy = 1;
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    uint64_t hash;
+    int suffix;
+    if (parse_loose_name(entry->d_name, &hash, &suffix) != 0) {
+      continue;
+    }
+    if (snapshot_insert(snap, hash, suffix) != 0) {
+      snap->racy = 1;
+      break;
+    }
+  }
+  closedir(dir);
+}
+
+/*--------------------------------------------------------------------*/
+
+static int64_t elapsed_nsec(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L
+    + (to->tv_nsec - from->tv_nsec);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the snapshot of directory, creating or refreshing it as needed.
+ * Must be called with snapshots_mutex held.
+ */
+static struct dir_snapshot *get_snapshot(char *directory) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+  struct dir_snapshot **prev = &snapshots;
+  int num_snapshots = 0;
+  for (struct dir_snapshot *snap = snapshots; snap; snap = snap->next) {
+    if (strcmp(snap->directory, directory) == 0) {
+      if (elapsed_nsec(&snap->checked, &now) >= SNAPSHOT_RECHECK_NSEC) {
+        struct stat s;
+        if (snap->racy || stat(directory, &s) != 0
+            || s.st_mtim.tv_sec != snap->dir_mtime.tv_sec
+            || s.st_mtim.tv_nsec != snap->dir_mtime.tv_nsec) {
+          rebuild_snapshot(snap);
+        }
+        snap->checked = now;
+      }
+      return snap;
+    }
+    num_snapshots++;
+    if (snap->next != NULL) {
+      prev = &snap->next;
+    }
+  }
+
+  if (num_snapshots >= SNAPSHOT_CACHE_SIZE) {
+    // evict the least recently created snapshot, at the end of the list
+    struct dir_snapshot *evicted = *prev;
+    *prev = NULL;
+    free(evicted->entries);
+    free(evicted->directory);
+    free(evicted);
+  }
+  struct dir_snapshot *snap = calloc(1, sizeof(*snap));
+  if (snap == NULL) {
+    perror("Error: Memory not allocated");
+    return NULL;
+  }
+  snap->directory = strdup(directory);
+  rebuild_snapshot(snap);
+  snap->checked = now;
+  snap->next = snapshots;
+  snapshots = snap;
+  return snap;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns how many loose files (HASH_000 up to HASH_NNN) may exist in
+ * directory for the file with the given hashed name.
+ *
+ * The answer comes from a per-process snapshot of the directory listing, so
+ * the usual answer of 0 costs no system calls. The snapshot is refreshed when
+ * the directory's mtime changes, checked at most every SNAPSHOT_RECHECK_NSEC,
+ * so loose files written by other processes may be missed for that long.
+ * Files the snapshot lists may since have been packed, so callers must still
+ * handle them being gone.
+ */
+int count_loose_candidates(char *directory, char *hashed_filename) {
+  uint64_t hash = strtoull(hashed_filename, NULL, 16);
+  pthread_mutex_lock(&snapshots_mutex);
+  struct dir_snapshot *snap = get_snapshot(directory);
+  int count;
+  if (snap == NULL) {
+    // without a snapshot, probe as if every suffix could exist
+    count = 1000;
+  } else if (snap->capacity == 0) {
+    count = 0;
+  } else {
+    count = find_slot(snap->entries, snap->capacity, hash)->count;
+  }
+  pthread_mutex_unlock(&snapshots_mutex);
+  return count;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Adds a loose file this process just created to the snapshot of directory,
+ * so that the process finds it again before the snapshot is next refreshed.
+ */
+void note_loose_file(char *directory, char *loose_filename) {
+  uint64_t hash;
+  int suffix;
+  if (parse_loose_name(loose_filename, &hash, &suffix) != 0) {
+    return;
+  }
+  pthread_mutex_lock(&snapshots_mutex);
+  for (struct dir_snapshot *snap = snapshots; snap; snap = snap->next) {
+    if (strcmp(snap->directory, directory) == 0) {
+      snapshot_insert(snap, hash, suffix);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&snapshots_mutex);
+}
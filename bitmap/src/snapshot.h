@@ -0,0 +1,24 @@
+#ifndef SNAPSHOT_INCLUDED
+#define SNAPSHOT_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+/*--------------------------------------------------------------------*/
+
+/* how long a directory snapshot is trusted before its mtime is checked */
+#define SNAPSHOT_RECHECK_NSEC 1000000000L
+
+/* snapshots of directories modified this recently are always rebuilt */
+#define SNAPSHOT_RACY_SEC 2
+
+/*--------------------------------------------------------------------*/
+
+int count_loose_candidates(char *directory, char *hashed_filename);
+
+void note_loose_file(char *directory, char *loose_filename);
+
+/*--------------------------------------------------------------------*/
+
+#endif
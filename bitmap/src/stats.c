@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "stats.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * Per-stage latency histograms and event counters of this process, so that
+ * the time of a slow search can be put down to the stage it was spent in.
+ *
+ * They are only kept once enable_stats is called: stats_clock then returns
+ * the time a stage starts, and add_stage_time records it when the stage ends.
+ * Updates are relaxed atomic additions, so the threads of a process share one
+ * set without locking and without allocating. Processes each keep their own;
+ * callers with several worker processes merge the JSON of each.
+ */
+
+struct stage_stats {
+  uint64_t count;
+  uint64_t total_nsec;
+  uint64_t max_nsec;
+  uint64_t histogram[STATS_BUCKETS];
+};
+
+static int stats_enabled = 0;
+static struct stage_stats stages[NUM_STAGES];
+static uint64_t counters[NUM_COUNTERS];
+
+static const char *stage_names[NUM_STAGES] = {
+  "resolve",
+  "loose_probe",
+  "packfile_lookup",
+  "decompress",
+  "content_name",
+  "build",
+  "store",
+  "lock_wait",
+  "service",
+  "filter",
+  "grep",
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+  "loose_hits",
+  "packfile_hits",
+  "content_hits",
+  "bitmaps_built",
+  "service_answers",
+};
+
+/*--------------------------------------------------------------------*/
+
+void enable_stats(int enabled) {
+  stats_enabled = enabled;
+}
+
+/*--------------------------------------------------------------------*/
+
+void reset_stats() {
+  memset(stages, 0, sizeof(stages));
+  memset(counters, 0, sizeof(counters));
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns the monotonic time in nanoseconds, to pass to add_stage_time, or 0
+ * if stats are not enabled.
+ */
+uint64_t stats_clock() {
+  if (!stats_enabled) {
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Records nsec spent in stage. stage is an int, so that callers outside the
+ * library can record the stages they time themselves.
+ */
+void record_stage_nsec(int stage, uint64_t nsec) {
+  if (!stats_enabled || stage < 0 || stage >= NUM_STAGES) {
+    return;
+  }
+  struct stage_stats *s = &stages[stage];
+  int bucket = 63 - __builtin_clzll(nsec | 1);
+  if (bucket >= STATS_BUCKETS) {
+    bucket = STATS_BUCKETS - 1;
+  }
+  __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->total_nsec, nsec, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->histogram[bucket], 1, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&s->max_nsec, __ATOMIC_RELAXED);
+  while (nsec > max
+         && !__atomic_compare_exchange_n(&s->max_nsec, &max, nsec, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Records the time since start, as returned by stats_clock, as spent in
+ * stage. Does nothing if start is 0.
+ */
+void add_stage_time(enum stats_stage stage, uint64_t start) {
+  if (start == 0) {
+    return;
+  }
+  record_stage_nsec(stage, stats_clock() - start);
+}
+
+/*--------------------------------------------------------------------*/
+
+void count_event(enum stats_counter counter) {
+  if (stats_enabled) {
+    __atomic_fetch_add(&counters[counter], 1, __ATOMIC_RELAXED);
+  }
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Writes the stats as JSON into buf, with room for capacity bytes:
+ *
+ *   {"stages": {"<stage>": {"count": N, "total_ns": N, "max_ns": N,
+ *                           "histogram_log2_ns": [N, ...]}, ...},
+ *    "counters": {"<counter>": N, ...}}
+ *
+ * Returns the length of the JSON, which was truncated if it is not less than
+ * capacity, or -1 on error.
+ */
+long stats_to_json(char *buf, size_t capacity) {
+  long len = 0;
+#define APPEND(...) do { \
+    int n = snprintf(buf + (len < capacity ? len : 0), \
+                     len < capacity ? capacity - len : 0, __VA_ARGS__); \
+    if (n < 0) { \
+      return -1; \
+    } \
+    len += n; \
+  } while (0)
+
+  APPEND("{\"stages\": {");
+  for (int i = 0; i < NUM_STAGES; i++) {
+    struct stage_stats *s = &stages[i];
+    APPEND("%s\"%s\": {\"count\": %" PRIu64 ", \"total_ns\": %" PRIu64
+           ", \"max_ns\": %" PRIu64 ", \"histogram_log2_ns\": [",
+           i ? ", " : "", stage_names[i],
+           __atomic_load_n(&s->count, __ATOMIC_RELAXED),
+           __atomic_load_n(&s->total_nsec, __ATOMIC_RELAXED),
+           __atomic_load_n(&s->max_nsec, __ATOMIC_RELAXED));
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      APPEND("%s%" PRIu64, b ? ", " : "",
+             __atomic_load_n(&s->histogram[b], __ATOMIC_RELAXED));
+    }
+    APPEND("]}");
+  }
+  APPEND("}, \"counters\": {");
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    APPEND("%s\"%s\": %" PRIu64, i ? ", " : "", counter_names[i],
+           __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+  }
+  APPEND("}}");
+#undef APPEND
+  return len;
+}
@@ -0,0 +1,63 @@
+#ifndef STATS_INCLUDED
+#define STATS_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*--------------------------------------------------------------------*/
+
+/* latency histogram buckets: bucket i counts [2^i, 2^(i+1)) nanoseconds */
+#define STATS_BUCKETS 40
+
+/**
+ * The stages of filtering a file that are timed. STAGE_PACKFILE_LOOKUP
+ * includes the decompression of the bitmap found, which is also timed on its
+ * own as STAGE_DECOMPRESS; STAGE_FILTER is the whole of start_filter, or of
+ * start_filter_batch for a batch.
+ * STAGE_GREP is timed by the caller and recorded with record_stage_nsec.
+ */
+enum stats_stage {
+  STAGE_RESOLVE,
+  STAGE_LOOSE_PROBE,
+  STAGE_PACKFILE_LOOKUP,
+  STAGE_DECOMPRESS,
+  STAGE_CONTENT_NAME,
+  STAGE_BUILD,
+  STAGE_STORE,
+  STAGE_LOCK_WAIT,
+  STAGE_SERVICE,
+  STAGE_FILTER,
+  STAGE_GREP,
+  NUM_STAGES
+};
+
+enum stats_counter {
+  COUNTER_LOOSE_HITS,
+  COUNTER_PACKFILE_HITS,
+  COUNTER_CONTENT_HITS,
+  COUNTER_BITMAPS_BUILT,
+  COUNTER_SERVICE_ANSWERS,
+  NUM_COUNTERS
+};
+
+/*--------------------------------------------------------------------*/
+
+void enable_stats(int enabled);
+
+void reset_stats();
+
+uint64_t stats_clock();
+
+void add_stage_time(enum stats_stage stage, uint64_t start);
+
+void record_stage_nsec(int stage, uint64_t nsec);
+
+void count_event(enum stats_counter counter);
+
+long stats_to_json(char *buf, size_t capacity);
+
+/*--------------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,485 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "uring.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * A minimal io_uring engine built directly on the system calls, so that no
+ * extra library is needed. Every operation is submitted in batches of up to
+ * URING_ENTRIES and waited for before returning; callers fall back to their
+ * synchronous path whenever a function here returns -1.
+ *
+ * Building with -DNO_IO_URING compiles the engine out entirely.
+ */
+
+#if !defined(NO_IO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+/*--------------------------------------------------------------------*/
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+struct uring {
+  int fd;
+  pid_t owner;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+static struct uring ring = { .fd = -1 };
+static int ring_unavailable = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*--------------------------------------------------------------------*/
+
+static void uring_teardown() {
+  if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring) {
+    munmap(ring.cq_ring, ring.cq_ring_size);
+  }
+  if (ring.sq_ring != NULL) {
+    munmap(ring.sq_ring, ring.sq_ring_size);
+  }
+  if (ring.sqes != NULL) {
+    munmap(ring.sqes, ring.sqes_size);
+  }
+  if (ring.fd != -1) {
+    close(ring.fd);
+  }
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Sets up the process's ring, mapping its submission and completion queues.
+ *
+ * A ring inherited across fork is shared with the parent, so it is replaced
+ * rather than used.
+ *
+ * Returns 0 upon success, -1 if io_uring cannot be used.
+ */
+static int uring_setup() {
+  if (ring.fd != -1 && ring.owner == getpid()) {
+    return 0;
+  }
+  uring_teardown();
+  if (ring_unavailable) {
+    return -1;
+  }
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) {
+    ring_unavailable = 1;
+    return -1;
+  }
+  ring.fd = fd;
+  ring.owner = getpid();
+
+  ring.sq_ring_size = params.sq_off.array
+    + params.sq_entries * sizeof(unsigned);
+  ring.cq_ring_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring.cq_ring_size > ring.sq_ring_size) {
+      ring.sq_ring_size = ring.cq_ring_size;
+    }
+    ring.cq_ring_size = ring.sq_ring_size;
+  }
+  ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring.sq_ring == MAP_FAILED) {
+    ring.sq_ring = NULL;
+    goto FAIL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring.cq_ring = ring.sq_ring;
+  } else {
+    ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ring == MAP_FAILED) {
+      ring.cq_ring = NULL;
+      goto FAIL;
+    }
+  }
+  ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    ring.sqes = NULL;
+    goto FAIL;
+  }
+
+  char *sq = ring.sq_ring;
+  char *cq = ring.cq_ring;
+  ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+
+  FAIL:
+    uring_teardown();
+    ring_unavailable = 1;
+    return -1;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Submits the num prepared operations in sqes and waits for all of them.
+ *
+ * The result of sqes[i] is stored in results[i]: the return value of the
+ * operation, or a negated errno.
+ *
+ * Returns 0 upon success, -1 if the ring could not be used.
+ */
+static int uring_run(struct io_uring_sqe *sqes, int num, int *results) {
+  int ret_val = -1;
+  pthread_mutex_lock(&ring_mutex);
+  if (uring_setup() != 0) {
+    goto OUT1;
+  }
+  for (int done = 0; done < num;) {
+    int batch = num - done < URING_ENTRIES ? num - done : URING_ENTRIES;
+    unsigned tail = *ring.sq_tail;
+    for (int i = 0; i < batch; i++) {
+      unsigned index = (tail + i) & *ring.sq_mask;
+      ring.sqes[index] = sqes[done + i];
+      ring.sqes[index].user_data = done + i;
+      ring.sq_array[index] = index;
+    }
+    __atomic_store_n(ring.sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    int completed = 0;
+    while (completed < batch) {
+      int ret = syscall(__NR_io_uring_enter, ring.fd, batch - submitted,
+                        batch - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // the ring is in an unknown state, so stop using it
+        uring_teardown();
+        ring_unavailable = 1;
+        goto OUT1;
+      }
+      submitted += ret;
+      unsigned head = *ring.cq_head;
+      unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; head++) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        results[cqe->user_data] = cqe->res;
+        completed++;
+      }
+      __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    done += batch;
+  }
+  ret_val = 0;
+
+  OUT1:
+    pthread_mutex_unlock(&ring_mutex);
+    return ret_val;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void prep_sqe(struct io_uring_sqe *sqe, int opcode) {
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns whether an operation result means the kernel does not know the
+ * operation, in which case the caller should use the synchronous path.
+ */
+static int is_unsupported(int res) {
+  return res == -EINVAL || res == -EOPNOTSUPP;
+}
+
+#endif
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Returns whether io_uring can be used by this process.
+ */
+int uring_available() {
+#ifdef HAVE_IO_URING
+  pthread_mutex_lock(&ring_mutex);
+  int ret = uring_setup();
+  pthread_mutex_unlock(&ring_mutex);
+  return ret == 0;
+#else
+  return 0;
+#endif
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Checks whether each of the num paths exists with a single batch of statx
+ * calls, setting exists[i] to 1 or 0.
+ *
+ * Returns 0 upon success, -1 if io_uring is not available.
+ */
+int uring_files_exist(char **paths, int num, int *exists) {
+#ifdef HAVE_IO_URING
+  int ret_val = -1;
+  struct io_uring_sqe *sqes = malloc(num * sizeof(*sqes));
+  struct statx *stats = malloc(num * sizeof(*stats));
+  int *results = malloc(num * sizeof(int));
+  if (sqes == NULL || stats == NULL || results == NULL) {
+    goto OUT1;
+  }
+  for (int i = 0; i < num; i++) {
+    prep_sqe(&sqes[i], IORING_OP_STATX);
+    sqes[i].fd = AT_FDCWD;
+    sqes[i].addr = (unsigned long) paths[i];
+    sqes[i].len = 0;
+    sqes[i].statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqes[i].off = (unsigned long) &stats[i];
+  }
+  if (uring_run(sqes, num, results) != 0) {
+    goto OUT1;
+  }
+  for (int i = 0; i < num; i++) {
+    if (is_unsupported(results[i])) {
+      goto OUT1;
+    }
+    exists[i] = results[i] == 0;
+  }
+  ret_val = 0;
+
+  OUT1:
+    free(sqes);
+    free(stats);
+    free(results);
+    return ret_val;
+#else
+  return -1;
+#endif
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Reads the whole of each of the num files in three batches: one opening and
+ * sizing every file, one reading them, and one closing them.
+ *
+ * On success, results[i].data holds a malloced buffer of results[i].length
+ * bytes, or results[i].error is set to an errno and data is NULL.
+ *
+ * Returns 0 upon success, -1 if io_uring is not available.
+ */
+int uring_read_files(char **paths, int num, struct uring_read_result *results) {
+#ifdef HAVE_IO_URING
+  int ret_val = -1;
+  struct io_uring_sqe *sqes = malloc(2 * num * sizeof(*sqes));
+  struct statx *stats = malloc(num * sizeof(*stats));
+  int *res = malloc(2 * num * sizeof(int));
+  int *fds = malloc(num * sizeof(int));
+  int *read_of = malloc(num * sizeof(int));
+  if (sqes == NULL || stats == NULL || res == NULL || fds == NULL
+      || read_of == NULL) {
+    goto OUT1;
+  }
+  for (int i = 0; i < num; i++) {
+    results[i].error = 0;
+    results[i].data = NULL;
+    results[i].length = 0;
+    fds[i] = -1;
+  }
+
+  // open and stat every file
+  for (int i = 0; i < num; i++) {
+    prep_sqe(&sqes[2 * i], IORING_OP_OPENAT);
+    sqes[2 * i].fd = AT_FDCWD;
+    sqes[2 * i].addr = (unsigned long) paths[i];
+    sqes[2 * i].open_flags = O_RDONLY;
+    prep_sqe(&sqes[2 * i + 1], IORING_OP_STATX);
+    sqes[2 * i + 1].fd = AT_FDCWD;
+    sqes[2 * i + 1].addr = (unsigned long) paths[i];
+    sqes[2 * i + 1].len = STATX_SIZE;
+    sqes[2 * i + 1].off = (unsigned long) &stats[i];
+  }
+  if (uring_run(sqes, 2 * num, res) != 0) {
+    goto OUT1;
+  }
+  for (int i = 0; i < num; i++) {
+    if (res[2 * i] >= 0) {
+      fds[i] = res[2 * i];
+    }
+  }
+  for (int i = 0; i < 2 * num; i++) {
+    if (is_unsupported(res[i])) {
+      goto OUT2;
+    }
+  }
+
+  // read every file that opened
+  int num_reads = 0;
+  for (int i = 0; i < num; i++) {
+    if (fds[i] == -1) {
+      results[i].error = -res[2 * i];
+      continue;
+    }
+    if (res[2 * i + 1] < 0) {
+      results[i].error = -res[2 * i + 1];
+      continue;
+    }
+    if (stats[i].stx_size == 0) {
+      continue;
+    }
+    results[i].data = malloc(stats[i].stx_size);
+    if (results[i].data == NULL) {
+      results[i].error = ENOMEM;
+      continue;
+    }
+    results[i].length = stats[i].stx_size;
+    prep_sqe(&sqes[num_reads], IORING_OP_READ);
+    sqes[num_reads].fd = fds[i];
+    sqes[num_reads].addr = (unsigned long) results[i].data;
+    sqes[num_reads].len = stats[i].stx_size;
+    sqes[num_reads].off = 0;
+    read_of[num_reads] = i;
+    num_reads++;
+  }
+  if (uring_run(sqes, num_reads, res) != 0) {
+    goto OUT2;
+  }
+  for (int r = 0; r < num_reads; r++) {
+    if (is_unsupported(res[r])) {
+      goto OUT2;
+    }
+    int i = read_of[r];
+    if (res[r] < 0 || (size_t) res[r] != results[i].length) {
+      results[i].error = res[r] < 0 ? -res[r] : EIO;
+      free(results[i].data);
+      results[i].data = NULL;
+      results[i].length = 0;
+    }
+  }
+  ret_val = 0;
+
+  OUT2:
+    // close every file that opened
+    {
+      int num_closes = 0;
+      for (int i = 0; i < num; i++) {
+        if (fds[i] != -1) {
+          prep_sqe(&sqes[num_closes], IORING_OP_CLOSE);
+          sqes[num_closes].fd = fds[i];
+          num_closes++;
+        }
+      }
+      int closed = uring_run(sqes, num_closes, res) == 0;
+      for (int c = 0; c < num_closes; c++) {
+        if (!closed || is_unsupported(res[c])) {
+          closed = 0;
+          break;
+        }
+      }
+      if (!closed) {
+        for (int i = 0; i < num; i++) {
+          if (fds[i] != -1) {
+            close(fds[i]);
+          }
+        }
+      }
+    }
+    if (ret_val != 0) {
+      for (int i = 0; i < num; i++) {
+        free(results[i].data);
+        results[i].data = NULL;
+        results[i].length = 0;
+      }
+    }
+  OUT1:
+    free(sqes);
+    free(stats);
+    free(res);
+    free(fds);
+    free(read_of);
+    return ret_val;
+#else
+  return -1;
+#endif
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Removes each of the num files with a single batch of unlinkat calls.
+ *
+ * Returns 0 upon success, -1 if io_uring is not available.
+ */
+int uring_unlink_files(char **paths, int num) {
+#ifdef HAVE_IO_URING
+  int ret_val = -1;
+  struct io_uring_sqe *sqes = malloc(num * sizeof(*sqes));
+  int *results = malloc(num * sizeof(int));
+  if (sqes == NULL || results == NULL) {
+    goto OUT1;
+  }
+  for (int i = 0; i < num; i++) {
+    prep_sqe(&sqes[i], IORING_OP_UNLINKAT);
+    sqes[i].fd = AT_FDCWD;
+    sqes[i].addr = (unsigned long) paths[i];
+  }
+  if (uring_run(sqes, num, results) != 0) {
+    goto OUT1;
+  }
+  ret_val = 0;
+  for (int i = 0; i < num; i++) {
+    if (is_unsupported(results[i])) {
+      // removing a file twice is harmless, so redo the batch synchronously
+      ret_val = -1;
+      break;
+    }
+  }
+
+  OUT1:
+    free(sqes);
+    free(results);
+    return ret_val;
+#else
+  return -1;
+#endif
+}
@@ -0,0 +1,31 @@
+#ifndef URING_INCLUDED
+#define URING_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stddef.h>
+
+/*--------------------------------------------------------------------*/
+
+/* most operations a single io_uring_enter call is asked to complete */
+#define URING_ENTRIES 256
+
+/*--------------------------------------------------------------------*/
+
+struct uring_read_result {
+  int error;
+  void *data;
+  size_t length;
+};
+
+int uring_available();
+
+int uring_files_exist(char **paths, int num, int *exists);
+
+int uring_read_files(char **paths, int num, struct uring_read_result *results);
+
+int uring_unlink_files(char **paths, int num);
+
+/*--------------------------------------------------------------------*/
+
+#endif
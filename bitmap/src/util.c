@@ -63,17 +63,32 @@ char *get_index_directory() {
 
 /*--------------------------------------------------------------------*/
 
+/**
+ * Writes the path of the index subdirectory for a file with the given
+ * timestamp to path, a buffer of PATH_MAX bytes, without creating it.
+ *
+ * These subdirectories are of the form "indexdir/YYYY_MM"
+ */
+void index_subdirectory_path(char *path, char *indexdir, int64_t timestamp) {
+  time_t t = timestamp;
+  struct tm gmt;
+  gmtime_r(&t, &gmt);
+  char date_string[8];
+  strftime(date_string, sizeof(date_string), "%Y_%m", &gmt);
+  snprintf(path, PATH_MAX, "%s/%s", indexdir, date_string);
+}
+
+/*--------------------------------------------------------------------*/
+
 /**
  * Returns what index subdirectory we should store the index for a file with
- * the given timestamp.
+ * the given timestamp, creating it if needed.
  *
  * These subdirectories are of the form "indexdir/YYYY_MM"
  */
 char *get_index_subdirectory(char *indexdir, int64_t timestamp) {
-  struct tm *gmt = gmtime(&timestamp);
-  char date_string[8];
-  strftime(date_string, sizeof(date_string), "%Y_%m", gmt);
-  char *index_subdir = add_path_parts(indexdir, date_string);
+  char *index_subdir = malloc(PATH_MAX);
+  index_subdirectory_path(index_subdir, indexdir, timestamp);
   mkdir(index_subdir, 0777);
   return index_subdir;
 }
@@ -143,6 +158,5 @@ int64_t get_mtime(char *path) {
  */
 int is_dir(char *path) {
   struct stat s;
-  stat(path, &s);
-  return S_ISDIR(s.st_mode);
+  return stat(path, &s) == 0 && S_ISDIR(s.st_mode);
 }
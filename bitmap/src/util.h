@@ -45,7 +45,7 @@ __attribute__((format (printf, 1, 2)));
 
 int64_t get_mtime(char *path);
 
-char *get_lock_path(char *directory, char *filename);
+void index_subdirectory_path(char *path, char *indexdir, int64_t timestamp);
 
 char *get_index_subdirectory(char *indexdir, int64_t timestamp);
 
@@ -0,0 +1,239 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "writebehind.h"
+#include "bitmap.h"
+#include "looselog.h"
+#include "util.h"
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * Write-behind of newly built bitmaps: once enabled, store_bitmap copies a
+ * bitmap into a bounded queue and returns, and a background thread compresses
+ * and writes it, so that a search can grep a file as soon as its bitmap is
+ * built. When the queue is full, store_bitmap waits for room.
+ *
+ * Bitmaps still queued are lost if the process exits without calling
+ * flush_bitmap_writes, which is only a missed cache entry: the file is indexed
+ * again by the next search. Processes exiting through exit() flush on their
+ * own. Each process drains its own queue; a forked child starts empty, as the
+ * bitmaps queued before the fork are the parent's to write.
+ */
+
+/**
+ * A bitmap waiting to be stored, with copies of its name and directory.
+ */
+struct pending_write {
+  uint8_t *bitmap;
+  char *filename;
+  char *directory;
+  int64_t mtime;
+};
+
+static struct pending_write *queue = NULL;
+static int queue_capacity = 0;
+static int queue_head = 0;
+static int queue_count = 0;
+static int writing = 0;
+/* the process whose thread drains the queue, 0 before one is started */
+static pid_t writer_pid = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Stores the bitmap right away, as a loose file or in this process's loose
+ * log.
+ */
+static int write_bitmap_now(uint8_t *bitmap, char *filename, int64_t mtime,
+    char *directory) {
+  if (loose_logs_enabled()) {
+    return append_to_loose_log(bitmap, filename, mtime, directory);
+  }
+  return compress_to_file(bitmap, filename, mtime, directory);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void free_pending_write(struct pending_write *w) {
+  free(w->bitmap);
+  free(w->filename);
+  free(w->directory);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *write_behind_thread(void *arg) {
+  pthread_mutex_lock(&queue_mutex);
+  while (1) {
+    while (queue_count == 0) {
+      pthread_cond_wait(&queue_changed, &queue_mutex);
+    }
+    struct pending_write w = queue[queue_head];
+    queue_head = (queue_head + 1) % queue_capacity;
+    queue_count--;
+    writing = 1;
+    pthread_cond_broadcast(&queue_changed);
+    pthread_mutex_unlock(&queue_mutex);
+
+    write_bitmap_now(w.bitmap, w.filename, w.mtime, w.directory);
+    free_pending_write(&w);
+
+    pthread_mutex_lock(&queue_mutex);
+    writing = 0;
+    pthread_cond_broadcast(&queue_changed);
+  }
+  return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+
+static void before_fork() {
+  pthread_mutex_lock(&queue_mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void after_fork_in_parent() {
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void after_fork_in_child() {
+  for (int i = 0; i < queue_count; i++) {
+    free_pending_write(&queue[(queue_head + i) % queue_capacity]);
+  }
+  queue_head = 0;
+  queue_count = 0;
+  writing = 0;
+  writer_pid = 0;
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Starts this process's writer thread unless it is running. Must be called
+ * with queue_mutex held.
+ *
+ * Returns 0 upon success, -1 if the thread could not be started.
+ */
+static int start_writer() {
+  static int registered = 0;
+  if (writer_pid == getpid()) {
+    return 0;
+  }
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  int ret = pthread_create(&thread, &attr, write_behind_thread, NULL);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    fprintf(stderr, "Error starting write-behind thread: %s\n",
+            strerror(ret));
+    return -1;
+  }
+  writer_pid = getpid();
+  if (!registered) {
+    pthread_atfork(before_fork, after_fork_in_parent, after_fork_in_child);
+    atexit(flush_bitmap_writes);
+    registered = 1;
+  }
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Makes store_bitmap queue up to queue_len bitmaps for a background thread
+ * to write, or write them itself if queue_len is 0, the default. Bitmaps
+ * already queued are written first.
+ */
+void enable_write_behind(int queue_len) {
+  flush_bitmap_writes();
+  pthread_mutex_lock(&queue_mutex);
+  if (queue_len < 0) {
+    queue_len = 0;
+  }
+  if (queue_len != queue_capacity) {
+    struct pending_write *resized = NULL;
+    if (queue_len > 0) {
+      resized = calloc(queue_len, sizeof(*resized));
+      if (resized == NULL) {
+        perror("Error: Memory not allocated");
+        queue_len = 0;
+      }
+    }
+    free(queue);
+    queue = resized;
+    queue_capacity = queue_len;
+    queue_head = 0;
+  }
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Stores a newly built bitmap in directory, as a loose file or, if enabled,
+ * in this process's loose log. With write-behind enabled, the bitmap is
+ * copied and stored in the background, and the call only waits if the
+ * queue is full.
+ *
+ * Returns 0 upon success, -1 on error. Errors of background writes are only
+ * reported on stderr.
+ */
+int store_bitmap(uint8_t *bitmap, char *filename, int64_t mtime,
+    char *directory) {
+  if (queue_capacity == 0) {
+    return write_bitmap_now(bitmap, filename, mtime, directory);
+  }
+  struct pending_write w = {
+    .bitmap = malloc(SIZEOF_BITMAP),
+    .filename = strdup(filename),
+    .directory = strdup(directory),
+    .mtime = mtime,
+  };
+  if (w.bitmap == NULL || w.filename == NULL || w.directory == NULL) {
+    free_pending_write(&w);
+    return write_bitmap_now(bitmap, filename, mtime, directory);
+  }
+  memcpy(w.bitmap, bitmap, SIZEOF_BITMAP);
+
+  pthread_mutex_lock(&queue_mutex);
+  if (queue_capacity == 0 || start_writer() != 0) {
+    pthread_mutex_unlock(&queue_mutex);
+    free_pending_write(&w);
+    return write_bitmap_now(bitmap, filename, mtime, directory);
+  }
+  while (queue_count == queue_capacity) {
+    pthread_cond_wait(&queue_changed, &queue_mutex);
+  }
+  queue[(queue_head + queue_count) % queue_capacity] = w;
+  queue_count++;
+  pthread_cond_broadcast(&queue_changed);
+  pthread_mutex_unlock(&queue_mutex);
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+
+/**
+ * Waits until every bitmap this process queued has been written.
+ */
+void flush_bitmap_writes() {
+  pthread_mutex_lock(&queue_mutex);
+  while ((queue_count > 0 || writing) && writer_pid == getpid()) {
+    pthread_cond_wait(&queue_changed, &queue_mutex);
+  }
+  pthread_mutex_unlock(&queue_mutex);
+}
@@ -0,0 +1,19 @@
+#ifndef WRITEBEHIND_INCLUDED
+#define WRITEBEHIND_INCLUDED
+
+/*--------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+/*--------------------------------------------------------------------*/
+
+void enable_write_behind(int queue_len);
+
+int store_bitmap(uint8_t *bitmap, char *filename, int64_t mtime,
+    char *directory);
+
+void flush_bitmap_writes();
+
+/*--------------------------------------------------------------------*/
+
+#endif
@@ -8,6 +8,8 @@ import imp
 import shutil
 import subprocess
 import sys
+import time
+import zlib
 
 TGREP_DIR = os.path.dirname(os.path.realpath(__file__))
 TGREP_FILE = os.path.join(TGREP_DIR, '4grep')
@@ -92,6 +94,68 @@ class TestFiltering(unittest.TestCase):
 			else:
 				self.assertEqual(ret, 4)
 
+	def test_filter_batch(self):
+		needle = str(10 ** tgrep.NGRAM_CHARS)
+		index = tgrep.StringIndex([[needle]])
+		names = [os.path.join(self.tempdir, '{}.txt'.format(i))
+				for i in range(10)]
+		for i, name in enumerate(names):
+			with open(name, 'w') as f:
+				f.write(str(i * 10 ** tgrep.NGRAM_CHARS) + '\n')
+		items = list(enumerate(names))
+		# the first batch builds the bitmaps, the second reads them packed
+		for bitmapped in (False, True):
+			results = tgrep.do_filter_and_grep_batch(items, ['-h'], needle,
+					index, self.tempindex)
+			self.assertEqual([r[0] for r in results], range(10))
+			for i, output, _, b, _ in results:
+				self.assertEqual(b, (bitmapped, i != 1))
+				self.assertEqual(output, needle + '\n' if i == 1 else '')
+			tgrep.flush_bitmap_writes()
+			tgrep.pack(self.tempindex)
+
+	def test_filter_batch_result_cache(self):
+		needle = str(10 ** tgrep.NGRAM_CHARS)
+		index = tgrep.StringIndex([[needle]])
+		names = [os.path.join(self.tempdir, '{}.txt'.format(i))
+				for i in range(3)]
+		cache = tgrep.ResultCache(os.path.join(self.tempdir, 'results'),
+				['-h'], needle)
+		for name in names:
+			with open(name, 'w') as f:
+				f.write(needle + '\n')
+			cache.put(cache.key(name), 'cached\n')
+		results = tgrep.do_filter_and_grep_batch(list(enumerate(names)),
+				['-h'], needle, index, self.tempindex, result_cache=cache)
+		self.assertEqual([r[1] for r in results], ['cached\n'] * 3)
+		self.assertEqual([r[3] for r in results], [(False, False)] * 3)
+		# answered by the cache, the files were not filtered or indexed
+		self.assertEqual([d for d in os.listdir(self.tempindex)
+				if not d.startswith('.')], [])
+
+	def test_compact(self):
+		index = tgrep.StringIndex([[str(10 ** tgrep.NGRAM_CHARS)]])
+		c_index = index.get_index_struct()
+		names = [os.path.join(self.tempdir, '{}.txt'.format(i))
+				for i in range(10)]
+		for i, name in enumerate(names):
+			f = open(name, 'w')
+			f.write(str(i * 10 ** tgrep.NGRAM_CHARS))
+			f.close()
+			tgrep.start_filter(c_index, ctypes.c_char_p(name), self.tempindex)
+		tgrep.pack(self.tempindex)
+		for name in names[5:]:
+			os.remove(name)
+		command = [TGREP_FILE, '--compact', '--drop-missing',
+				'--indexdir', self.tempindex]
+		out = subprocess.check_output(command, stderr=subprocess.STDOUT)
+		self.assertIn('dropped 5 entries', out)
+		# the remaining files are still answered from the index
+		for i, name in enumerate(names[:5]):
+			ret = tgrep.start_filter(c_index, ctypes.c_char_p(name),
+					self.tempindex)
+			self.assertEqual(ret, 1 if i == 1 else 2)
+
 class TestIndexAutodetection(unittest.TestCase):
 	def test_parsable_chars(self):
 		self.assertEqual(
@@ -168,6 +232,154 @@ class TestStringIndex(unittest.TestCase):
 		self.assertEqual(struct.rows[0].data[0], 0b00010001000100010001)
 		self.assertEqual(struct.rows[0].data[1], 0b00100010001000100010)
 
+class TestFilterAnalysis(unittest.TestCase):
+	def test_add(self):
+		analysis = tgrep.FilterAnalysis()
+		# (size, density, filtered, matched)
+		analysis.add(100, 0.001, True, False)
+		analysis.add(100, 0.001, False, True)
+		analysis.add(2 << 20, 0.3, False, False)
+		analysis.add(2 << 20, None, False, False)
+		result = analysis.to_dict()
+		total = result['total']
+		self.assertEqual(total['files'], 4)
+		self.assertEqual(total['passed'], 3)
+		self.assertEqual(total['false_positives'], 2)
+		self.assertAlmostEqual(total['false_positive_rate'], 2.0 / 3)
+		self.assertAlmostEqual(total['precision'], 1.0 / 3)
+		self.assertEqual([b['files'] for b in result['by_size']], [2, 2])
+		self.assertEqual(result['by_size'][1]['min_bytes'], 1 << 20)
+		self.assertEqual([b['false_positives'] for b in result['by_density']],
+				[0, 1])
+		self.assertEqual(result['unknown_density']['files'], 1)
+
+class TestNegativeCache(unittest.TestCase):
+	def setUp(self):
+		self.tempdir = tempfile.mkdtemp()
+		self.tempindex = tempfile.mkdtemp()
+
+	def tearDown(self):
+		shutil.rmtree(self.tempdir)
+		shutil.rmtree(self.tempindex)
+
+	def test_false_positive_skipped(self):
+		# collides with 'aaaaa' under the 4 bit mask
+		name = os.path.join(self.tempdir, '1.txt')
+		with open(name, 'w') as f:
+			f.write('AAAAA\n')
+		index = tgrep.StringIndex([['aaaaa']])
+		cache = tgrep.NegativeCache(self.tempindex, ['-h'], 'aaaaa', index)
+		_, _, _, b, _ = tgrep.do_filter_and_grep(0, ['-h'], 'aaaaa', name,
+				index, self.tempindex, negative_cache=cache)
+		self.assertEqual(b, (False, False))
+		_, _, _, b, _ = tgrep.do_filter_and_grep(0, ['-h'], 'aaaaa', name,
+				index, self.tempindex, negative_cache=cache)
+		self.assertEqual(b, (True, True))
+
+		# a case-sensitive search proves nothing to a case-insensitive one
+		cache = tgrep.NegativeCache(self.tempindex, ['-h', '-i'], 'aaaaa',
+				index)
+		self.assertFalse(cache.proves_absent(cache.key(name)))
+
+		# nor does a search that is not a literal
+		index = tgrep.StringIndex([['bbbbb']])
+		cache = tgrep.NegativeCache(self.tempindex, ['-h'], 'bbbbb.*c', index)
+		cache.record(cache.key(name))
+		self.assertFalse(cache.proves_absent(cache.key(name)))
+
+		# and modifying the file forgets what was proved
+		cache = tgrep.NegativeCache(self.tempindex, ['-h'], 'aaaaa',
+				tgrep.StringIndex([['aaaaa']]))
+		self.assertTrue(cache.proves_absent(cache.key(name)))
+		with open(name, 'a') as f:
+			f.write('aaaaa\n')
+		self.assertFalse(cache.proves_absent(cache.key(name)))
+
+	def test_ignore_case(self):
+		name = os.path.join(self.tempdir, '1.txt')
+		with open(name, 'w') as f:
+			f.write('nothing here\n')
+		cache = tgrep.NegativeCache(self.tempindex, ['-i'], 'Lease Lost',
+				tgrep.StringIndex([['Lease Lost']]))
+		cache.record(cache.key(name))
+		cache = tgrep.NegativeCache(self.tempindex, [], 'lease lost',
+				tgrep.StringIndex([['lease lost']]))
+		self.assertTrue(cache.proves_absent(cache.key(name)))
+		# every alternative must be proved absent
+		cache = tgrep.NegativeCache(self.tempindex, [], 'x',
+				tgrep.StringIndex([['lease lost'], ['other']]))
+		self.assertFalse(cache.proves_absent(cache.key(name)))
+
+	def test_shared_permissions(self):
+		# other users must be able to add to what one user recorded
+		name = os.path.join(self.tempdir, '1.txt')
+		with open(name, 'w') as f:
+			f.write('nothing here\n')
+		cache = tgrep.NegativeCache(self.tempindex, [], 'Lease Lost',
+				tgrep.StringIndex([['Lease Lost']]))
+		month, _ = cache.key(name)
+		os.mkdir(os.path.join(self.tempindex, month))
+		month_dir = os.path.join(cache.dir, month)
+		old_umask = os.umask(0o077)
+		try:
+			cache.record(cache.key(name))
+			log, = os.listdir(month_dir)
+			self.assertEqual(os.stat(os.path.join(month_dir, log)).st_mode
+					& 0o777, 0o666)
+			tgrep.compact_negative_cache(self.tempindex,
+					time.time() + tgrep.NEGATIVE_CACHE_SETTLE_SEC)
+		finally:
+			os.umask(old_umask)
+		merged = os.path.join(month_dir, tgrep.NEGATIVE_CACHE_MERGED_NAME)
+		self.assertEqual(os.stat(merged).st_mode & 0o777, 0o666)
+		for d in (month_dir, cache.dir):
+			self.assertEqual(os.stat(d).st_mode & 0o777, 0o777)
+
+	def test_compact(self):
+		index = tgrep.StringIndex([['Lease Lost']])
+		cache = tgrep.NegativeCache(self.tempindex, [], 'Lease Lost', index)
+		names = [os.path.join(self.tempdir, '{}.txt'.format(i))
+				for i in range(100)]
+		for name in names:
+			with open(name, 'w') as f:
+				f.write('nothing here\n')
+			cache.record(cache.key(name))
+		# a process appends all of a month's records to one log
+		month, _ = cache.key(names[0])
+		month_dir = os.path.join(cache.dir, month)
+		self.assertEqual(len(os.listdir(month_dir)), 1)
+
+		# the pack run leaves logs that may still be written alone
+		os.mkdir(os.path.join(self.tempindex, month))
+		tgrep.compact_negative_cache(self.tempindex)
+		self.assertFalse(os.path.exists(os.path.join(month_dir,
+				tgrep.NEGATIVE_CACHE_MERGED_NAME)))
+
+		# and merges them once settled, along with the merged file
+		other = tgrep.NegativeCache(self.tempindex, [], 'other string',
+				tgrep.StringIndex([['other string']]))
+		other.record(other.key(names[0]))
+		legacy = os.path.join(cache.dir, 'ab')
+		os.mkdir(legacy)
+		orphan = os.path.join(cache.dir, '2001_09')
+		os.mkdir(orphan)
+		later = time.time() + tgrep.NEGATIVE_CACHE_SETTLE_SEC
+		tgrep.compact_negative_cache(self.tempindex, later)
+		self.assertEqual(sorted(n for n in os.listdir(month_dir)
+				if not n.startswith('.')), [tgrep.NEGATIVE_CACHE_MERGED_NAME])
+		for search in ('Lease Lost', 'other string'):
+			cache = tgrep.NegativeCache(self.tempindex, [], search,
+					tgrep.StringIndex([[search]]))
+			self.assertTrue(cache.proves_absent(cache.key(names[0])))
+		cache = tgrep.NegativeCache(self.tempindex, [], 'Lease Lost', index)
+		self.assertTrue(all(cache.proves_absent(cache.key(name))
+				for name in names))
+
+		# directories of months gone from the index and of older layouts
+		# are removed
+		self.assertFalse(os.path.exists(legacy))
+		self.assertFalse(os.path.exists(orphan))
+
 class TestTgrep(unittest.TestCase):
 	def setUp(self):
 		self.tempdir = tempfile.mkdtemp()
@@ -218,5 +430,42 @@ class TestTgrep(unittest.TestCase):
 		out = subprocess.check_output(command, shell=True)
 		self.assertEqual(out.strip(), self.tempdir + '/1.txt:' + search)
 
+	def test_tgrep_result_cache(self):
+		indexdir = os.path.join(self.tempdir, 'index')
+		os.mkdir(indexdir)
+		env = dict(os.environ, XDG_CACHE_HOME=os.path.join(self.tempdir, 'cache'))
+		search = str(10 ** tgrep.NGRAM_CHARS)
+		names = []
+		for i in range(3):
+			name = os.path.join(self.tempdir, '{}.txt'.format(i))
+			with open(name, 'w') as f:
+				f.write(str(i * 10 ** tgrep.NGRAM_CHARS))
+			names.append(name)
+		command = "{} --result-cache --indexdir {} {} {}".format(
+			TGREP_FILE, indexdir, search, ' '.join(names))
+		out = subprocess.check_output(command, shell=True, env=env)
+		self.assertEqual(out.strip(), names[1] + ':' + search)
+
+		# only the file that passed the filter was grepped and cached, in
+		# the user's cache rather than the shared index
+		cache_dir = os.path.join(env['XDG_CACHE_HOME'], tgrep.RESULT_CACHE_DIR)
+		entries = [os.path.join(root, name)
+				for root, _, files in os.walk(cache_dir)
+				for name in files if not name.startswith('.')]
+		self.assertEqual(len(entries), 1)
+		self.assertEqual(os.stat(entries[0]).st_mode & 0o077, 0)
+		self.assertFalse(os.path.exists(
+				os.path.join(indexdir, os.path.basename(tgrep.RESULT_CACHE_DIR))))
+		with open(entries[0], 'wb') as f:
+			f.write(zlib.compress('cached\n'))
+		out = subprocess.check_output(command, shell=True, env=env)
+		self.assertEqual(out.strip(), 'cached')
+
+		# a modified file is searched again
+		with open(names[1], 'a') as f:
+			f.write('\n')
+		out = subprocess.check_output(command, shell=True, env=env)
+		self.assertEqual(out.strip(), names[1] + ':' + search)
+
 if __name__ == '__main__':
 	unittest.main()